@@ -153,6 +153,42 @@ typedef struct xfs_flock64 {
 	__s32		l_pad[4];	/* reserve area			    */
 } xfs_flock64_t;
 
+/*
+ * XFS_IOC_RESVSP_CONTIG reserves a hole of the file like XFS_IOC_RESVSP64,
+ * but as a single extent or not at all (ENOSPC).  l_pad[0] takes XFS_RC_*
+ * flags and l_pad[1] the AG to allocate in, the rest of the pad must be 0.
+ */
+#define XFS_RC_AGNO		0x1	/* prefer AG l_pad[1] */
+#define XFS_RC_FLAGS_ALL	(XFS_RC_AGNO)
+
+/*
+ * Structures passed to XFS_IOC_SPACE_VEC
+ *
+ * sr_vec points to sr_count ranges, each reserved (XFS_SV_RESVSP) or
+ * unreserved (XFS_SV_UNRESVSP) in order, as XFS_IOC_RESVSP64 and
+ * XFS_IOC_UNRESVSP64 would.  Offsets are absolute.
+ */
+typedef struct xfs_space_vec {
+	__s64		sv_offset;	/* start of range in bytes */
+	__s64		sv_length;	/* length of range in bytes */
+	__u32		sv_op;		/* XFS_SV_* */
+	__u32		sv_pad;		/* pad space, unused */
+} xfs_space_vec_t;
+
+#define XFS_SV_RESVSP		1
+#define XFS_SV_UNRESVSP		2
+
+typedef struct xfs_space_vec_req {
+	__u32		sr_version;	/* XFS_SPACE_VEC_VERSION */
+	__u32		sr_count;	/* number of ranges */
+	__u64		sr_vec;		/* user pointer to the ranges */
+	__u32		sr_done;	/* out: ranges done */
+	__u32		sr_pad[3];	/* pad space, unused */
+} xfs_space_vec_req_t;
+
+#define XFS_SPACE_VEC_VERSION	0
+#define XFS_SPACE_VEC_MAX	65536	/* ranges per call */
+
 /*
  * Output for XFS_IOC_FSGEOMETRY_V1
  */
@@ -473,6 +509,7 @@ typedef struct xfs_swapext
 {
 	__int64_t	sx_version;	/* version */
 #define XFS_SX_VERSION		0
+#define XFS_SX_VERSION_ATTR	1	/* swap the attribute forks only */
 	__int64_t	sx_fdtarget;	/* fd of target file */
 	__int64_t	sx_fdtmp;	/* fd of tmp file */
 	xfs_off_t	sx_offset;	/* offset into file */
@@ -481,6 +518,51 @@ typedef struct xfs_swapext
 	xfs_bstat_t	sx_stat;	/* stat of target b4 copy */
 } xfs_swapext_t;
 
+/*
+ * Structure passed to XFS_IOC_SWAPEXT_BATCH
+ *
+ * xb_swaps points to xb_count xfs_swapext_t, each done as by
+ * XFS_IOC_SWAPEXT.  xb_results points to xb_count __s32 that get 0 or
+ * the negative errno of each swap.
+ */
+typedef struct xfs_swapext_batch
+{
+	__u32		xb_version;	/* XFS_XB_VERSION */
+	__u32		xb_count;	/* number of swaps */
+	__u64		xb_swaps;	/* user pointer to the swaps */
+	__u64		xb_results;	/* user pointer to the results */
+	char		xb_pad[16];	/* pad space, unused */
+} xfs_swapext_batch_t;
+
+#define XFS_XB_VERSION		0
+#define XFS_XB_MAX		256	/* swaps per call */
+
+/*
+ * Structure passed to XFS_IOC_RELOCATE_RANGE
+ *
+ * Moves [rr_offset, rr_offset + rr_length) of the file to newly
+ * allocated blocks.  The data is copied inside the kernel and only the
+ * mappings of that range are exchanged, the rest of the file is left
+ * alone.  A length of zero means up to EOF.
+ */
+typedef struct xfs_relocate_range
+{
+	__int64_t	rr_version;	/* version */
+#define XFS_RR_VERSION		0
+	__uint32_t	rr_flags;	/* XFS_RR_* flags */
+	__uint32_t	rr_agno;	/* AG to allocate in */
+	xfs_off_t	rr_offset;	/* offset into file */
+	xfs_off_t	rr_length;	/* length from offset */
+	__int64_t	rr_bno;		/* fs block to allocate near */
+	xfs_off_t	rr_moved;	/* out: bytes relocated */
+	char		rr_pad[16];	/* pad space, unused */
+} xfs_relocate_range_t;
+
+#define XFS_RR_AGNO		0x1	/* allocate in rr_agno */
+#define XFS_RR_BNO		0x2	/* allocate near rr_bno */
+#define XFS_RR_CONTIG		0x4	/* fail unless one extent */
+#define XFS_RR_FLAGS_ALL	(XFS_RR_AGNO | XFS_RR_BNO | XFS_RR_CONTIG)
+
 /*
  * Flags for going down operation
  */
@@ -521,6 +603,11 @@ typedef struct xfs_swapext
 #define XFS_IOC_GETBMAPX	_IOWR('X', 56, struct getbmap)
 #define XFS_IOC_ZERO_RANGE	_IOW ('X', 57, struct xfs_flock64)
 #define XFS_IOC_FREE_EOFBLOCKS	_IOR ('X', 58, struct xfs_fs_eofblocks)
+#define XFS_IOC_RELOCATE_RANGE	_IOWR('X', 59, struct xfs_relocate_range)
+#define XFS_IOC_MERGE_EXTENTS	_IOR ('X', 60, __uint32_t)
+#define XFS_IOC_RESVSP_CONTIG	_IOW ('X', 61, struct xfs_flock64)
+#define XFS_IOC_SPACE_VEC	_IOWR('X', 62, struct xfs_space_vec_req)
+#define XFS_IOC_SWAPEXT_BATCH	_IOW ('X', 63, struct xfs_swapext_batch)
 
 /*
  * ioctl commands that replace IRIX syssgi()'s
@@ -31,6 +31,8 @@
 #include "xfs_attr.h"
 #include "xfs_bmap.h"
 #include "xfs_bmap_util.h"
+#include "xfs_btree.h"
+#include "xfs_bmap_btree.h"
 #include "xfs_fsops.h"
 #include "xfs_discard.h"
 #include "xfs_quota.h"
@@ -39,6 +41,7 @@
 #include "xfs_icache.h"
 #include "xfs_symlink.h"
 #include "xfs_trans.h"
+#include "xfs_log.h"
 
 #include <linux/capability.h>
 #include <linux/dcache.h>
@@ -597,6 +600,238 @@ xfs_attrmulti_by_handle(
 	return error;
 }
 
+/*
+ * Map irec into a hole in the data fork of ip.  The blocks have already
+ * been taken out of free space by the caller.  This is the part of
+ * xfs_bmapi_write() that runs after the allocator has picked the blocks,
+ * for callers that got them some other way.  The blocks are accounted to
+ * ip and the inode is logged here.
+ */
+STATIC int
+xfs_bmap_insert_extent(
+	struct xfs_trans	*tp,
+	struct xfs_inode	*ip,
+	struct xfs_bmbt_irec	*irec,
+	xfs_fsblock_t		*firstfsb,
+	struct xfs_bmap_free	*flist)
+{
+	struct xfs_mount	*mp = ip->i_mount;
+	struct xfs_ifork	*ifp = XFS_IFORK_PTR(ip, XFS_DATA_FORK);
+	struct xfs_bmalloca	bma = { NULL };
+	int			error;
+
+	if (!(ifp->if_flags & XFS_IFEXTENTS)) {
+		error = xfs_iread_extents(tp, ip, XFS_DATA_FORK);
+		if (error)
+			return error;
+	}
+
+	bma.tp = tp;
+	bma.ip = ip;
+	bma.firstblock = firstfsb;
+	bma.flist = flist;
+	bma.got = *irec;
+	xfs_iext_bno_to_ext(ifp, irec->br_startoff, &bma.idx);
+	if (XFS_IFORK_FORMAT(ip, XFS_DATA_FORK) == XFS_DINODE_FMT_BTREE) {
+		bma.cur = xfs_bmbt_init_cursor(mp, tp, ip, XFS_DATA_FORK);
+		bma.cur->bc_private.b.firstblock = *firstfsb;
+		bma.cur->bc_private.b.flist = flist;
+	}
+
+	/* this may convert the fork to btree format and set up bma.cur */
+	error = xfs_bmap_add_extent_hole_real(&bma, XFS_DATA_FORK);
+
+	if (bma.cur) {
+		if (!error)
+			*firstfsb = bma.cur->bc_private.b.firstblock;
+		xfs_btree_del_cursor(bma.cur, error ? XFS_BTREE_ERROR :
+						      XFS_BTREE_NOERROR);
+	}
+	if (error)
+		return error;
+
+	/* as in xfs_bmapi_write(), only log what the fork format has */
+	if ((bma.logflags & XFS_ILOG_DEXT) &&
+	    XFS_IFORK_FORMAT(ip, XFS_DATA_FORK) != XFS_DINODE_FMT_EXTENTS)
+		bma.logflags &= ~XFS_ILOG_DEXT;
+	else if ((bma.logflags & XFS_ILOG_DBROOT) &&
+		 XFS_IFORK_FORMAT(ip, XFS_DATA_FORK) != XFS_DINODE_FMT_BTREE)
+		bma.logflags &= ~XFS_ILOG_DBROOT;
+
+	ip->i_d.di_nblocks += irec->br_blockcount;
+	xfs_trans_mod_dquot_byino(tp, ip, XFS_TRANS_DQ_BCOUNT,
+				  irec->br_blockcount);
+	xfs_trans_log_inode(tp, ip, XFS_ILOG_CORE | bma.logflags);
+	return 0;
+}
+
+/*
+ * Reserve [offset, offset + len) of ip as one unwritten extent, or fail
+ * with ENOSPC without allocating anything.  The range has to be a hole.
+ *
+ * A defragmenter preallocating its temporary file with XFS_IOC_RESVSP
+ * only finds out after the fact, by counting extents, that free space
+ * was too fragmented to help.  This tells it up front, before any data
+ * is copied.
+ */
+STATIC int
+xfs_alloc_file_space_contig(
+	struct xfs_inode	*ip,
+	xfs_off_t		offset,
+	xfs_off_t		len,
+	xfs_agnumber_t		agno)
+{
+	struct xfs_mount	*mp = ip->i_mount;
+	struct xfs_ifork	*ifp = XFS_IFORK_PTR(ip, XFS_DATA_FORK);
+	struct xfs_trans	*tp;
+	struct xfs_bmap_free	flist;
+	struct xfs_bmbt_irec	imap;
+	struct xfs_alloc_arg	args;
+	xfs_fsblock_t		firstfsb;
+	xfs_fileoff_t		offset_fsb;
+	xfs_filblks_t		count_fsb;
+	uint			resblks;
+	int			nimaps;
+	int			committed;
+	int			error;
+
+	if (XFS_IS_REALTIME_INODE(ip))
+		return -EINVAL;
+	if (agno != NULLAGNUMBER && agno >= mp->m_sb.sb_agcount)
+		return -EINVAL;
+	if (XFS_FORCED_SHUTDOWN(mp))
+		return -EIO;
+
+	error = xfs_qm_dqattach(ip, 0);
+	if (error)
+		return error;
+
+	offset_fsb = XFS_B_TO_FSBT(mp, offset);
+	count_fsb = XFS_B_TO_FSB(mp, offset + len) - offset_fsb;
+	/* more than one extent or one AG can hold is never contiguous */
+	if (count_fsb > MAXEXTLEN || count_fsb > mp->m_sb.sb_agblocks)
+		return -ENOSPC;
+	resblks = XFS_DIOSTRAT_SPACE_RES(mp, count_fsb);
+
+	tp = xfs_trans_alloc(mp, XFS_TRANS_DIOSTRAT);
+	error = xfs_trans_reserve(tp, &M_RES(mp)->tr_write, resblks, 0);
+	if (error) {
+		xfs_trans_cancel(tp, 0);
+		return error;
+	}
+	xfs_ilock(ip, XFS_ILOCK_EXCL);
+	error = xfs_trans_reserve_quota_nblks(tp, ip, resblks, 0,
+					      XFS_QMOPT_RES_REGBLKS);
+	if (error)
+		goto error_cancel;
+	xfs_trans_ijoin(tp, ip, 0);
+
+	nimaps = 1;
+	error = xfs_bmapi_read(ip, offset_fsb, count_fsb, &imap, &nimaps, 0);
+	if (error)
+		goto error_cancel;
+	if (imap.br_startblock != HOLESTARTBLOCK ||
+	    imap.br_blockcount < count_fsb) {
+		error = -EINVAL;
+		goto error_cancel;
+	}
+
+	memset(&args, 0, sizeof(args));
+	args.tp = tp;
+	args.mp = mp;
+	args.fsbno = agno != NULLAGNUMBER ? XFS_AGB_TO_FSB(mp, agno, 0) :
+					    XFS_INO_TO_FSB(mp, ip->i_ino);
+	args.firstblock = NULLFSBLOCK;
+	args.minlen = args.maxlen = count_fsb;
+	args.prod = 1;
+	args.alignment = 1;
+	args.total = resblks;
+	args.userdata = XFS_ALLOC_USERDATA;
+	/* leave room in the AG for the bmap btree to grow */
+	args.minleft = XFS_IFORK_FORMAT(ip, XFS_DATA_FORK) ==
+			XFS_DINODE_FMT_BTREE ?
+			be16_to_cpu(ifp->if_broot->bb_level) + 1 : 1;
+	error = xfs_alloc_vextent_bestfit(&args);
+	if (error)
+		goto error_cancel;
+	if (args.fsbno == NULLFSBLOCK) {
+		error = -ENOSPC;
+		goto error_cancel;
+	}
+
+	imap.br_startoff = offset_fsb;
+	imap.br_startblock = args.fsbno;
+	imap.br_blockcount = args.len;
+	imap.br_state = XFS_EXT_UNWRITTEN;
+
+	/* we hold that AGF now; a bmbt split can't go below it */
+	xfs_bmap_init(&flist, &firstfsb);
+	firstfsb = args.fsbno;
+	error = xfs_bmap_insert_extent(tp, ip, &imap, &firstfsb, &flist);
+	if (error)
+		goto error_bmap_cancel;
+
+	error = xfs_bmap_finish(&tp, &flist, &committed);
+	if (error)
+		goto error_bmap_cancel;
+
+	error = xfs_trans_commit(tp, XFS_TRANS_RELEASE_LOG_RES);
+	xfs_iunlock(ip, XFS_ILOCK_EXCL);
+	return error;
+
+error_bmap_cancel:
+	xfs_bmap_cancel(&flist);
+error_cancel:
+	xfs_trans_cancel(tp, XFS_TRANS_RELEASE_LOG_RES | XFS_TRANS_ABORT);
+	xfs_iunlock(ip, XFS_ILOCK_EXCL);
+	return error;
+}
+
+/*
+ * Log the inode changes that go with changing the space of a file:
+ * timestamps, dropping setuid/setgid and the preallocation flag.
+ * Called with the IOLOCK held.
+ */
+STATIC int
+xfs_ioc_space_update(
+	struct xfs_inode	*ip,
+	struct file		*filp,
+	int			ioflags,
+	bool			setprealloc,
+	bool			clrprealloc)
+{
+	struct xfs_mount	*mp = ip->i_mount;
+	struct xfs_trans	*tp;
+	int			error;
+
+	tp = xfs_trans_alloc(mp, XFS_TRANS_WRITEID);
+	error = xfs_trans_reserve(tp, &M_RES(mp)->tr_writeid, 0, 0);
+	if (error) {
+		xfs_trans_cancel(tp, 0);
+		return error;
+	}
+
+	xfs_ilock(ip, XFS_ILOCK_EXCL);
+	xfs_trans_ijoin(tp, ip, XFS_ILOCK_EXCL);
+
+	if (!(ioflags & XFS_IO_INVIS)) {
+		ip->i_d.di_mode &= ~S_ISUID;
+		if (ip->i_d.di_mode & S_IXGRP)
+			ip->i_d.di_mode &= ~S_ISGID;
+		xfs_trans_ichgtime(tp, ip, XFS_ICHGTIME_MOD | XFS_ICHGTIME_CHG);
+	}
+
+	if (setprealloc)
+		ip->i_d.di_flags |= XFS_DIFLAG_PREALLOC;
+	else if (clrprealloc)
+		ip->i_d.di_flags &= ~XFS_DIFLAG_PREALLOC;
+
+	xfs_trans_log_inode(tp, ip, XFS_ILOG_CORE);
+	if (filp->f_flags & O_DSYNC)
+		xfs_trans_set_sync(tp);
+	return xfs_trans_commit(tp, 0);
+}
+
 int
 xfs_ioc_space(
 	struct xfs_inode	*ip,
@@ -607,7 +842,6 @@ xfs_ioc_space(
 	xfs_flock64_t		*bf)
 {
 	struct xfs_mount	*mp = ip->i_mount;
-	struct xfs_trans	*tp;
 	struct iattr		iattr;
 	bool			setprealloc = false;
 	bool			clrprealloc = false;
@@ -660,6 +894,7 @@ xfs_ioc_space(
 	case XFS_IOC_ZERO_RANGE:
 	case XFS_IOC_RESVSP:
 	case XFS_IOC_RESVSP64:
+	case XFS_IOC_RESVSP_CONTIG:
 	case XFS_IOC_UNRESVSP:
 	case XFS_IOC_UNRESVSP64:
 		if (bf->l_len <= 0) {
@@ -693,6 +928,18 @@ xfs_ioc_space(
 		if (!error)
 			setprealloc = true;
 		break;
+	case XFS_IOC_RESVSP_CONTIG:
+		if ((bf->l_pad[0] & ~XFS_RC_FLAGS_ALL) ||
+		    bf->l_pad[2] || bf->l_pad[3]) {
+			error = -EINVAL;
+			break;
+		}
+		error = xfs_alloc_file_space_contig(ip, bf->l_start, bf->l_len,
+				(bf->l_pad[0] & XFS_RC_AGNO) ?
+					bf->l_pad[1] : NULLAGNUMBER);
+		if (!error)
+			setprealloc = true;
+		break;
 	case XFS_IOC_UNRESVSP:
 	case XFS_IOC_UNRESVSP64:
 		error = xfs_free_file_space(ip, bf->l_start, bf->l_len);
@@ -723,36 +970,123 @@ xfs_ioc_space(
 	if (error)
 		goto out_unlock;
 
-	tp = xfs_trans_alloc(mp, XFS_TRANS_WRITEID);
-	error = xfs_trans_reserve(tp, &M_RES(mp)->tr_writeid, 0, 0);
-	if (error) {
-		xfs_trans_cancel(tp, 0);
-		goto out_unlock;
-	}
+	error = xfs_ioc_space_update(ip, filp, ioflags, setprealloc,
+				     clrprealloc);
 
-	xfs_ilock(ip, XFS_ILOCK_EXCL);
-	xfs_trans_ijoin(tp, ip, XFS_ILOCK_EXCL);
+out_unlock:
+	xfs_iunlock(ip, XFS_IOLOCK_EXCL);
+	mnt_drop_write_file(filp);
+	return error;
+}
 
-	if (!(ioflags & XFS_IO_INVIS)) {
-		ip->i_d.di_mode &= ~S_ISUID;
-		if (ip->i_d.di_mode & S_IXGRP)
-			ip->i_d.di_mode &= ~S_ISGID;
-		xfs_trans_ichgtime(tp, ip, XFS_ICHGTIME_MOD | XFS_ICHGTIME_CHG);
+/*
+ * Reserve and unreserve a list of ranges of a file in one call.
+ *
+ * The ranges are applied in order.  Runs of adjacent ranges with the
+ * same operation are merged and done as one, the IOLOCK is taken once
+ * for the whole list and the inode update that every XFS_IOC_RESVSP
+ * call logs is logged once at the end.  On failure sr_done tells the
+ * caller how many ranges were done.
+ */
+STATIC int
+xfs_ioc_space_vec(
+	struct xfs_inode		*ip,
+	struct inode			*inode,
+	struct file			*filp,
+	int				ioflags,
+	struct xfs_space_vec_req __user	*arg)
+{
+	struct xfs_mount	*mp = ip->i_mount;
+	struct xfs_space_vec_req req;
+	struct xfs_space_vec	*vec;
+	xfs_off_t		start, end;
+	bool			setprealloc = false;
+	__u32			i, j;
+	int			error, error2;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+	if (req.sr_version != XFS_SPACE_VEC_VERSION ||
+	    req.sr_count == 0 || req.sr_count > XFS_SPACE_VEC_MAX)
+		return -EINVAL;
+
+	/* the same rules as xfs_ioc_space() */
+	if (!xfs_sb_version_hasextflgbit(&mp->m_sb) &&
+	    !capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (inode->i_flags & (S_IMMUTABLE|S_APPEND))
+		return -EPERM;
+	if (!(filp->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+
+	vec = kmem_zalloc_large(req.sr_count * sizeof(*vec), KM_SLEEP);
+	if (!vec)
+		return -ENOMEM;
+	if (copy_from_user(vec, (void __user *)(unsigned long)req.sr_vec,
+			   req.sr_count * sizeof(*vec))) {
+		error = -EFAULT;
+		goto out_free;
 	}
 
-	if (setprealloc)
-		ip->i_d.di_flags |= XFS_DIFLAG_PREALLOC;
-	else if (clrprealloc)
-		ip->i_d.di_flags &= ~XFS_DIFLAG_PREALLOC;
+	for (i = 0; i < req.sr_count; i++) {
+		if ((vec[i].sv_op != XFS_SV_RESVSP &&
+		     vec[i].sv_op != XFS_SV_UNRESVSP) ||
+		    vec[i].sv_offset < 0 || vec[i].sv_length <= 0 ||
+		    vec[i].sv_offset + vec[i].sv_length < 0 ||
+		    vec[i].sv_offset + vec[i].sv_length >=
+				mp->m_super->s_maxbytes) {
+			error = -EINVAL;
+			goto out_free;
+		}
+	}
 
-	xfs_trans_log_inode(tp, ip, XFS_ILOG_CORE);
-	if (filp->f_flags & O_DSYNC)
-		xfs_trans_set_sync(tp);
-	error = xfs_trans_commit(tp, 0);
+	error = mnt_want_write_file(filp);
+	if (error)
+		goto out_free;
 
-out_unlock:
+	xfs_ilock(ip, XFS_IOLOCK_EXCL);
+	req.sr_done = 0;
+	for (i = 0; i < req.sr_count; i = j) {
+		start = vec[i].sv_offset;
+		end = start + vec[i].sv_length;
+		for (j = i + 1; j < req.sr_count &&
+				vec[j].sv_op == vec[i].sv_op &&
+				vec[j].sv_offset == end; j++)
+			end += vec[j].sv_length;
+		if (end >= mp->m_super->s_maxbytes) {
+			error = -EINVAL;
+			break;
+		}
+
+		if (vec[i].sv_op == XFS_SV_RESVSP) {
+			error = xfs_alloc_file_space(ip, start, end - start,
+						     XFS_BMAPI_PREALLOC);
+			if (!error)
+				setprealloc = true;
+		} else {
+			error = xfs_free_file_space(ip, start, end - start);
+		}
+		if (error)
+			break;
+		req.sr_done = j;
+	}
+
+	if (req.sr_done) {
+		error2 = xfs_ioc_space_update(ip, filp, ioflags, setprealloc,
+					      false);
+		if (!error)
+			error = error2;
+	}
 	xfs_iunlock(ip, XFS_IOLOCK_EXCL);
 	mnt_drop_write_file(filp);
+
+	if (copy_to_user(&arg->sr_done, &req.sr_done, sizeof(req.sr_done)) &&
+	    !error)
+		error = -EFAULT;
+out_free:
+	kmem_free(vec);
 	return error;
 }
 
@@ -1440,58 +1774,292 @@ xfs_ioc_getbmapx(
 	return 0;
 }
 
-int
-xfs_ioc_swapext(
-	xfs_swapext_t	*sxp)
+/*
+ * Count the blocks of an attribute fork: those its extents map and, in
+ * btree format, the btree blocks below the root in the inode.
+ */
+STATIC int
+xfs_attr_fork_blocks(
+	struct xfs_trans	*tp,
+	struct xfs_inode	*ip,
+	xfs_filblks_t		*count)
 {
-	xfs_inode_t     *ip, *tip;
-	struct fd	f, tmp;
-	int		error = 0;
+	struct xfs_mount	*mp = ip->i_mount;
+	struct xfs_ifork	*ifp = XFS_IFORK_PTR(ip, XFS_ATTR_FORK);
+	struct xfs_btree_block	*block;
+	struct xfs_buf		*bp;
+	xfs_fsblock_t		bno, child;
+	xfs_extnum_t		i, nextents;
+	int			level;
+	int			error;
 
-	/* Pull information for the target fd */
-	f = fdget((int)sxp->sx_fdtarget);
-	if (!f.file) {
-		error = -EINVAL;
-		goto out;
+	*count = 0;
+	if (!ifp || XFS_IFORK_FORMAT(ip, XFS_ATTR_FORK) == XFS_DINODE_FMT_LOCAL)
+		return 0;
+	if (!(ifp->if_flags & XFS_IFEXTENTS)) {
+		error = xfs_iread_extents(tp, ip, XFS_ATTR_FORK);
+		if (error)
+			return error;
 	}
+	nextents = ifp->if_bytes / (uint)sizeof(xfs_bmbt_rec_t);
+	for (i = 0; i < nextents; i++)
+		*count += xfs_bmbt_get_blockcount(xfs_iext_get_ext(ifp, i));
+	if (XFS_IFORK_FORMAT(ip, XFS_ATTR_FORK) != XFS_DINODE_FMT_BTREE)
+		return 0;
 
-	if (!(f.file->f_mode & FMODE_WRITE) ||
-	    !(f.file->f_mode & FMODE_READ) ||
-	    (f.file->f_flags & O_APPEND)) {
-		error = -EBADF;
-		goto out_put_file;
+	/* walk each level left to right along the sibling pointers */
+	block = ifp->if_broot;
+	level = be16_to_cpu(block->bb_level);
+	bno = be64_to_cpu(*XFS_BMAP_BROOT_PTR_ADDR(mp, block, 1,
+						    ifp->if_broot_bytes));
+	while (level-- > 0) {
+		child = NULLFSBLOCK;
+		while (bno != NULLFSBLOCK) {
+			error = xfs_btree_read_bufl(mp, tp, bno, 0, &bp,
+					XFS_BMAP_BTREE_REF, &xfs_bmbt_buf_ops);
+			if (error)
+				return error;
+			block = XFS_BUF_TO_BLOCK(bp);
+			if (level && child == NULLFSBLOCK)
+				child = be64_to_cpu(*XFS_BMBT_PTR_ADDR(mp,
+						block, 1, mp->m_bmap_dmxr[1]));
+			bno = be64_to_cpu(block->bb_u.l.bb_rightsib);
+			xfs_trans_brelse(tp, bp);
+			(*count)++;
+		}
+		bno = child;
 	}
+	return 0;
+}
 
-	tmp = fdget((int)sxp->sx_fdtmp);
-	if (!tmp.file) {
-		error = -EINVAL;
-		goto out_put_file;
+/*
+ * Will the attribute fork of ip fit in an attribute area of size bytes?
+ */
+STATIC int
+xfs_attr_fork_fits(
+	struct xfs_inode	*ip,
+	int			size)
+{
+	struct xfs_ifork	*ifp = XFS_IFORK_PTR(ip, XFS_ATTR_FORK);
+
+	switch (XFS_IFORK_FORMAT(ip, XFS_ATTR_FORK)) {
+	case XFS_DINODE_FMT_LOCAL:
+		return ifp->if_bytes <= size;
+	case XFS_DINODE_FMT_EXTENTS:
+		return XFS_IFORK_NEXTENTS(ip, XFS_ATTR_FORK) *
+			(int)sizeof(xfs_bmbt_rec_t) <= size;
+	case XFS_DINODE_FMT_BTREE:
+		return XFS_BMAP_BMDR_SPACE(ifp->if_broot) <= size;
 	}
+	return 0;
+}
 
-	if (!(tmp.file->f_mode & FMODE_WRITE) ||
-	    !(tmp.file->f_mode & FMODE_READ) ||
-	    (tmp.file->f_flags & O_APPEND)) {
-		error = -EBADF;
-		goto out_put_tmp_file;
+STATIC int
+xfs_attr_fork_logflags(
+	struct xfs_inode	*ip)
+{
+	switch (XFS_IFORK_FORMAT(ip, XFS_ATTR_FORK)) {
+	case XFS_DINODE_FMT_LOCAL:
+		return XFS_ILOG_ADATA;
+	case XFS_DINODE_FMT_EXTENTS:
+		return XFS_ILOG_AEXT;
+	case XFS_DINODE_FMT_BTREE:
+		return XFS_ILOG_ABROOT;
 	}
+	return 0;
+}
 
-	if (IS_SWAPFILE(file_inode(f.file)) ||
-	    IS_SWAPFILE(file_inode(tmp.file))) {
-		error = -EINVAL;
-		goto out_put_tmp_file;
-	}
+/*
+ * XFS_SX_VERSION_ATTR: exchange the attribute forks of ip and tip and
+ * leave the data forks alone.  tip is a temporary file with no data that
+ * the caller has given a copy of ip's attributes, written in one go so
+ * that they are laid out contiguously.  Each inode keeps its fork
+ * offset, so each attribute fork has to fit in the other inode; tip
+ * has no data, so it simply takes on ip's fork offset.  As for
+ * XFS_IOC_SWAPEXT, ip must not have changed since sx_stat was taken.
+ * With nosync the commit isn't made synchronous on wsync mounts.
+ */
+STATIC int
+xfs_swap_attr_forks(
+	struct xfs_inode	*ip,
+	struct xfs_inode	*tip,
+	xfs_swapext_t		*sxp,
+	bool			nosync)
+{
+	struct xfs_mount	*mp = ip->i_mount;
+	struct xfs_bstat	*sbp = &sxp->sx_stat;
+	struct xfs_trans	*tp;
+	struct xfs_ifork	*tempifp;
+	xfs_filblks_t		aforkblks, taforkblks;
+	int			src_log_flags, target_log_flags;
+	int			tmp;
+	int			error;
 
-	ip = XFS_I(file_inode(f.file));
-	tip = XFS_I(file_inode(tmp.file));
+	xfs_lock_two_inodes(ip, tip, XFS_IOLOCK_EXCL);
 
-	if (ip->i_mount != tip->i_mount) {
-		error = -EINVAL;
-		goto out_put_tmp_file;
+	tp = xfs_trans_alloc(mp, XFS_TRANS_SWAPEXT);
+	error = xfs_trans_reserve(tp, &M_RES(mp)->tr_ichange, 0, 0);
+	if (error) {
+		xfs_trans_cancel(tp, 0);
+		goto out_unlock;
 	}
+	xfs_lock_two_inodes(ip, tip, XFS_ILOCK_EXCL);
+	xfs_trans_ijoin(tp, ip, 0);
+	xfs_trans_ijoin(tp, tip, 0);
 
-	if (ip->i_ino == tip->i_ino) {
+	if (!XFS_IFORK_Q(ip) || !XFS_IFORK_Q(tip) ||
+	    tip->i_d.di_nextents || tip->i_d.di_size) {
 		error = -EINVAL;
-		goto out_put_tmp_file;
+		goto out_trans_cancel;
+	}
+
+	/* the attributes, and so the ctime, must not have changed */
+	if (sbp->bs_ctime.tv_sec != VFS_I(ip)->i_ctime.tv_sec ||
+	    sbp->bs_ctime.tv_nsec != VFS_I(ip)->i_ctime.tv_nsec ||
+	    sbp->bs_mtime.tv_sec != VFS_I(ip)->i_mtime.tv_sec ||
+	    sbp->bs_mtime.tv_nsec != VFS_I(ip)->i_mtime.tv_nsec) {
+		error = -EBUSY;
+		goto out_trans_cancel;
+	}
+
+	if (!xfs_attr_fork_fits(ip, XFS_IFORK_ASIZE(ip)) ||
+	    !xfs_attr_fork_fits(tip, XFS_IFORK_ASIZE(ip))) {
+		error = -EINVAL;
+		goto out_trans_cancel;
+	}
+
+	error = xfs_attr_fork_blocks(tp, ip, &aforkblks);
+	if (!error)
+		error = xfs_attr_fork_blocks(tp, tip, &taforkblks);
+	if (error)
+		goto out_trans_cancel;
+
+	/*
+	 * v3 btree blocks carry their owner.  As in xfs_swap_extents(),
+	 * the owner change flag goes on the inode that ends up with the
+	 * fork, and the blocks are restamped before the forks move.
+	 */
+	src_log_flags = XFS_ILOG_CORE;
+	target_log_flags = XFS_ILOG_CORE;
+	if (ip->i_d.di_version == 3 &&
+	    XFS_IFORK_FORMAT(ip, XFS_ATTR_FORK) == XFS_DINODE_FMT_BTREE) {
+		target_log_flags |= XFS_ILOG_AOWNER;
+		error = xfs_bmbt_change_owner(tp, ip, XFS_ATTR_FORK,
+					      tip->i_ino, NULL);
+		if (error)
+			goto out_trans_cancel;
+	}
+	if (tip->i_d.di_version == 3 &&
+	    XFS_IFORK_FORMAT(tip, XFS_ATTR_FORK) == XFS_DINODE_FMT_BTREE) {
+		src_log_flags |= XFS_ILOG_AOWNER;
+		error = xfs_bmbt_change_owner(tp, tip, XFS_ATTR_FORK,
+					      ip->i_ino, NULL);
+		if (error)
+			goto out_trans_cancel;
+	}
+
+	tempifp = ip->i_afp;
+	ip->i_afp = tip->i_afp;
+	tip->i_afp = tempifp;
+	tip->i_d.di_forkoff = ip->i_d.di_forkoff;
+
+	tmp = ip->i_d.di_aformat;
+	ip->i_d.di_aformat = tip->i_d.di_aformat;
+	tip->i_d.di_aformat = tmp;
+
+	tmp = ip->i_d.di_anextents;
+	ip->i_d.di_anextents = tip->i_d.di_anextents;
+	tip->i_d.di_anextents = tmp;
+
+	ip->i_d.di_nblocks += taforkblks - aforkblks;
+	tip->i_d.di_nblocks += aforkblks - taforkblks;
+
+	src_log_flags |= xfs_attr_fork_logflags(ip);
+	target_log_flags |= xfs_attr_fork_logflags(tip);
+	xfs_trans_log_inode(tp, ip, src_log_flags);
+	xfs_trans_log_inode(tp, tip, target_log_flags);
+
+	if ((mp->m_flags & XFS_MOUNT_WSYNC) && !nosync)
+		xfs_trans_set_sync(tp);
+	error = xfs_trans_commit(tp, XFS_TRANS_RELEASE_LOG_RES);
+	xfs_iunlock(ip, XFS_ILOCK_EXCL);
+	xfs_iunlock(tip, XFS_ILOCK_EXCL);
+	goto out_unlock;
+
+out_trans_cancel:
+	xfs_trans_cancel(tp, XFS_TRANS_RELEASE_LOG_RES | XFS_TRANS_ABORT);
+	xfs_iunlock(ip, XFS_ILOCK_EXCL);
+	xfs_iunlock(tip, XFS_ILOCK_EXCL);
+out_unlock:
+	xfs_iunlock(ip, XFS_IOLOCK_EXCL);
+	xfs_iunlock(tip, XFS_IOLOCK_EXCL);
+	return error;
+}
+
+/*
+ * Swap the extents of one pair of files.  If mp is set, both have to
+ * be on that filesystem.  With nosync the swap is not committed
+ * synchronously on wsync mounts, the caller forces the log instead.
+ */
+STATIC int
+xfs_swapext_one(
+	struct xfs_mount *mp,
+	xfs_swapext_t	*sxp,
+	bool		nosync)
+{
+	xfs_inode_t     *ip, *tip;
+	struct fd	f, tmp;
+	int		error = 0;
+
+	/* Pull information for the target fd */
+	f = fdget((int)sxp->sx_fdtarget);
+	if (!f.file) {
+		error = -EINVAL;
+		goto out;
+	}
+
+	if (!(f.file->f_mode & FMODE_WRITE) ||
+	    !(f.file->f_mode & FMODE_READ) ||
+	    (f.file->f_flags & O_APPEND)) {
+		error = -EBADF;
+		goto out_put_file;
+	}
+
+	tmp = fdget((int)sxp->sx_fdtmp);
+	if (!tmp.file) {
+		error = -EINVAL;
+		goto out_put_file;
+	}
+
+	if (!(tmp.file->f_mode & FMODE_WRITE) ||
+	    !(tmp.file->f_mode & FMODE_READ) ||
+	    (tmp.file->f_flags & O_APPEND)) {
+		error = -EBADF;
+		goto out_put_tmp_file;
+	}
+
+	if (IS_SWAPFILE(file_inode(f.file)) ||
+	    IS_SWAPFILE(file_inode(tmp.file))) {
+		error = -EINVAL;
+		goto out_put_tmp_file;
+	}
+
+	ip = XFS_I(file_inode(f.file));
+	tip = XFS_I(file_inode(tmp.file));
+
+	if (ip->i_mount != tip->i_mount) {
+		error = -EINVAL;
+		goto out_put_tmp_file;
+	}
+
+	if (mp && ip->i_mount != mp) {
+		error = -EXDEV;
+		goto out_put_tmp_file;
+	}
+
+	if (ip->i_ino == tip->i_ino) {
+		error = -EINVAL;
+		goto out_put_tmp_file;
 	}
 
 	if (XFS_FORCED_SHUTDOWN(ip->i_mount)) {
@@ -1499,7 +2067,10 @@ xfs_ioc_swapext(
 		goto out_put_tmp_file;
 	}
 
-	error = xfs_swap_extents(ip, tip, sxp);
+	if (sxp->sx_version == XFS_SX_VERSION_ATTR)
+		error = xfs_swap_attr_forks(ip, tip, sxp, nosync);
+	else
+		error = xfs_swap_extents(ip, tip, sxp, nosync);
 
  out_put_tmp_file:
 	fdput(tmp);
@@ -1509,6 +2080,733 @@ xfs_ioc_swapext(
 	return error;
 }
 
+int
+xfs_ioc_swapext(
+	xfs_swapext_t	*sxp)
+{
+	return xfs_swapext_one(NULL, sxp, false);
+}
+
+/*
+ * Swap the extents of many independent pairs of files in one call, for
+ * a defragmenter working through lots of small files.  Each swap is
+ * done and fails on its own, the result of each goes back in
+ * xb_results.  On wsync mounts a single XFS_IOC_SWAPEXT commits
+ * synchronously; here the swaps are committed asynchronously and the
+ * log is forced once at the end of the batch instead.  Other mounts
+ * don't force the log for a swap at all, and neither does the batch.
+ */
+STATIC int
+xfs_ioc_swapext_batch(
+	struct file			*filp,
+	struct xfs_swapext_batch __user	*arg)
+{
+	struct xfs_mount	*mp = XFS_I(file_inode(filp))->i_mount;
+	struct xfs_swapext_batch xb;
+	xfs_swapext_t		*sxp;
+	__s32			*results;
+	bool			swapped = false;
+	__u32			i;
+	int			error;
+
+	if (copy_from_user(&xb, arg, sizeof(xb)))
+		return -EFAULT;
+	if (xb.xb_version != XFS_XB_VERSION ||
+	    xb.xb_count == 0 || xb.xb_count > XFS_XB_MAX)
+		return -EINVAL;
+
+	sxp = kmem_zalloc_large(xb.xb_count * sizeof(*sxp), KM_SLEEP);
+	if (!sxp)
+		return -ENOMEM;
+	results = kmem_zalloc(xb.xb_count * sizeof(*results), KM_SLEEP);
+	if (copy_from_user(sxp, (void __user *)(unsigned long)xb.xb_swaps,
+			   xb.xb_count * sizeof(*sxp))) {
+		error = -EFAULT;
+		goto out_free;
+	}
+
+	error = mnt_want_write_file(filp);
+	if (error)
+		goto out_free;
+	for (i = 0; i < xb.xb_count; i++) {
+		results[i] = xfs_swapext_one(mp, &sxp[i], true);
+		if (!results[i])
+			swapped = true;
+	}
+	if (swapped && (mp->m_flags & XFS_MOUNT_WSYNC))
+		xfs_log_force(mp, XFS_LOG_SYNC);
+	mnt_drop_write_file(filp);
+
+	if (copy_to_user((void __user *)(unsigned long)xb.xb_results,
+			 results, xb.xb_count * sizeof(*results)))
+		error = -EFAULT;
+out_free:
+	kmem_free(results);
+	kmem_free(sxp);
+	return error;
+}
+
+/*
+ * Allocate count_fsb blocks at offset_fsb in the relocation temp inode,
+ * starting near hint.  Each allocation is hinted at the end of the
+ * previous one so the destination ends up as contiguous as free space
+ * allows.  With contig set we fail rather than take a fragmented range.
+ */
+STATIC int
+xfs_relocate_alloc(
+	struct xfs_inode	*tip,
+	xfs_fileoff_t		offset_fsb,
+	xfs_filblks_t		count_fsb,
+	xfs_fsblock_t		hint,
+	bool			contig)
+{
+	struct xfs_mount	*mp = tip->i_mount;
+	struct xfs_trans	*tp;
+	struct xfs_bmap_free	flist;
+	struct xfs_bmbt_irec	imap;
+	xfs_fsblock_t		firstfsb;
+	xfs_filblks_t		len;
+	uint			resblks;
+	bool			first = true;
+	int			nimaps;
+	int			committed;
+	int			error;
+
+	while (count_fsb) {
+		len = min_t(xfs_filblks_t, count_fsb, MAXEXTLEN);
+		resblks = XFS_DIOSTRAT_SPACE_RES(mp, len);
+
+		tp = xfs_trans_alloc(mp, XFS_TRANS_DIOSTRAT);
+		error = xfs_trans_reserve(tp, &M_RES(mp)->tr_write, resblks, 0);
+		if (error) {
+			xfs_trans_cancel(tp, 0);
+			return error;
+		}
+		xfs_ilock(tip, XFS_ILOCK_EXCL);
+		error = xfs_trans_reserve_quota_nblks(tp, tip, resblks, 0,
+						      XFS_QMOPT_RES_REGBLKS);
+		if (error)
+			goto error_cancel;
+		xfs_trans_ijoin(tp, tip, 0);
+
+		/* a valid firstblock is where the allocator starts looking */
+		xfs_bmap_init(&flist, &firstfsb);
+		if (hint != NULLFSBLOCK)
+			firstfsb = hint;
+
+		nimaps = 1;
+		error = xfs_bmapi_write(tp, tip, offset_fsb, len,
+				XFS_BMAPI_PREALLOC |
+				(contig ? XFS_BMAPI_CONTIG : 0),
+				&firstfsb, 0, &imap, &nimaps, &flist);
+		if (error)
+			goto error_bmap_cancel;
+
+		error = xfs_bmap_finish(&tp, &flist, &committed);
+		if (error)
+			goto error_bmap_cancel;
+
+		error = xfs_trans_commit(tp, XFS_TRANS_RELEASE_LOG_RES);
+		xfs_iunlock(tip, XFS_ILOCK_EXCL);
+		if (error)
+			return error;
+
+		if (nimaps == 0)
+			return -ENOSPC;
+		if (contig && !first && imap.br_startblock != hint)
+			return -ENOSPC;
+
+		first = false;
+		hint = imap.br_startblock + imap.br_blockcount;
+		offset_fsb += imap.br_blockcount;
+		count_fsb -= imap.br_blockcount;
+	}
+	return 0;
+
+error_bmap_cancel:
+	xfs_bmap_cancel(&flist);
+error_cancel:
+	xfs_trans_cancel(tp, XFS_TRANS_RELEASE_LOG_RES | XFS_TRANS_ABORT);
+	xfs_iunlock(tip, XFS_ILOCK_EXCL);
+	return error;
+}
+
+/*
+ * Copy [pos, pos + len) from ip to the same offset in tip through the
+ * page cache.
+ */
+STATIC int
+xfs_relocate_copy_pages(
+	struct xfs_inode	*ip,
+	struct xfs_inode	*tip,
+	xfs_off_t		pos,
+	xfs_off_t		len)
+{
+	struct address_space	*mapping = VFS_I(ip)->i_mapping;
+	struct address_space	*tmapping = VFS_I(tip)->i_mapping;
+	struct page		*page, *tpage;
+	void			*fsdata;
+	char			*src, *dst;
+	unsigned		offset, bytes;
+	int			error;
+
+	while (len > 0) {
+		offset = pos & (PAGE_CACHE_SIZE - 1);
+		bytes = min_t(xfs_off_t, PAGE_CACHE_SIZE - offset, len);
+
+		page = read_mapping_page(mapping, pos >> PAGE_CACHE_SHIFT,
+					 NULL);
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+
+		error = pagecache_write_begin(NULL, tmapping, pos, bytes, 0,
+					      &tpage, &fsdata);
+		if (error) {
+			page_cache_release(page);
+			return error;
+		}
+
+		src = kmap_atomic(page);
+		dst = kmap_atomic(tpage);
+		memcpy(dst + offset, src + offset, bytes);
+		kunmap_atomic(dst);
+		kunmap_atomic(src);
+		flush_dcache_page(tpage);
+
+		error = pagecache_write_end(NULL, tmapping, pos, bytes, bytes,
+					    tpage, fsdata);
+		page_cache_release(page);
+		if (error < 0)
+			return error;
+
+		balance_dirty_pages_ratelimited(tmapping);
+		if (fatal_signal_pending(current))
+			return -EINTR;
+
+		pos += bytes;
+		len -= bytes;
+	}
+	return 0;
+}
+
+/*
+ * Copy every written extent of ip in the range to tip.  Holes, delalloc
+ * and unwritten extents have no data on disk, so they are not moved.
+ */
+STATIC int
+xfs_relocate_copy(
+	struct xfs_inode	*ip,
+	struct xfs_inode	*tip,
+	xfs_fileoff_t		offset_fsb,
+	xfs_filblks_t		count_fsb,
+	xfs_off_t		isize)
+{
+	struct xfs_mount	*mp = ip->i_mount;
+	struct xfs_bmbt_irec	imap;
+	xfs_off_t		pos, end;
+	uint			lock;
+	int			nimaps;
+	int			error;
+
+	while (count_fsb) {
+		lock = xfs_ilock_data_map_shared(ip);
+		nimaps = 1;
+		error = xfs_bmapi_read(ip, offset_fsb, count_fsb, &imap,
+				       &nimaps, 0);
+		xfs_iunlock(ip, lock);
+		if (error)
+			return error;
+
+		if (imap.br_startblock != HOLESTARTBLOCK &&
+		    imap.br_startblock != DELAYSTARTBLOCK &&
+		    imap.br_state == XFS_EXT_NORM) {
+			pos = XFS_FSB_TO_B(mp, imap.br_startoff);
+			end = min_t(xfs_off_t, isize, XFS_FSB_TO_B(mp,
+					imap.br_startoff + imap.br_blockcount));
+			error = xfs_relocate_copy_pages(ip, tip, pos,
+							end - pos);
+			if (error)
+				return error;
+		}
+		offset_fsb += imap.br_blockcount;
+		count_fsb -= imap.br_blockcount;
+	}
+	return 0;
+}
+
+/*
+ * Move the blocks behind every copied extent of tip into ip, one extent
+ * per transaction.  The range is unmapped from both files, the new
+ * blocks are taken back off the free list and mapped into ip, and the
+ * old blocks of ip are freed.  Each transaction leaves both files
+ * consistent, so a crash part way through leaves ip with some ranges
+ * old and some new but never with stale data.
+ */
+STATIC int
+xfs_relocate_swap(
+	struct xfs_inode	*ip,
+	struct xfs_inode	*tip,
+	xfs_fileoff_t		offset_fsb,
+	xfs_filblks_t		count_fsb,
+	xfs_filblks_t		*moved)
+{
+	struct xfs_mount	*mp = ip->i_mount;
+	struct xfs_trans	*tp;
+	struct xfs_bmap_free	flist;
+	struct xfs_bmap_free_item *free, *prev;
+	struct xfs_bmbt_irec	irec, tirec;
+	xfs_fsblock_t		firstfsb;
+	uint			lock;
+	int			nimaps;
+	int			committed;
+	int			done;
+	int			error;
+
+	*moved = 0;
+	while (count_fsb) {
+		/* IOLOCK_EXCL keeps both maps stable between the lookups */
+		lock = xfs_ilock_data_map_shared(ip);
+		nimaps = 1;
+		error = xfs_bmapi_read(ip, offset_fsb, count_fsb, &irec,
+				       &nimaps, 0);
+		xfs_iunlock(ip, lock);
+		if (error)
+			return error;
+
+		if (irec.br_startblock == HOLESTARTBLOCK ||
+		    irec.br_startblock == DELAYSTARTBLOCK ||
+		    irec.br_state != XFS_EXT_NORM) {
+			offset_fsb += irec.br_blockcount;
+			count_fsb -= irec.br_blockcount;
+			continue;
+		}
+
+		lock = xfs_ilock_data_map_shared(tip);
+		nimaps = 1;
+		error = xfs_bmapi_read(tip, offset_fsb, irec.br_blockcount,
+				       &tirec, &nimaps, 0);
+		xfs_iunlock(tip, lock);
+		if (error)
+			return error;
+
+		/* the copy has to be on disk before the blocks change hands */
+		if (tirec.br_startblock == HOLESTARTBLOCK ||
+		    tirec.br_startblock == DELAYSTARTBLOCK ||
+		    tirec.br_state != XFS_EXT_NORM)
+			return -EIO;
+		irec.br_blockcount = tirec.br_blockcount;
+
+		tp = xfs_trans_alloc(mp, XFS_TRANS_SWAPEXT);
+		error = xfs_trans_reserve(tp, &M_RES(mp)->tr_write,
+				3 * XFS_EXTENTADD_SPACE_RES(mp, XFS_DATA_FORK),
+				0);
+		if (error) {
+			xfs_trans_cancel(tp, 0);
+			return error;
+		}
+		xfs_lock_two_inodes(ip, tip, XFS_ILOCK_EXCL);
+		xfs_trans_ijoin(tp, ip, 0);
+		xfs_trans_ijoin(tp, tip, 0);
+
+		xfs_bmap_init(&flist, &firstfsb);
+		error = xfs_bunmapi(tp, tip, tirec.br_startoff,
+				    tirec.br_blockcount, 0, 1, &firstfsb,
+				    &flist, &done);
+		if (error)
+			goto out_bmap_cancel;
+
+		/* the new blocks must not be freed; they go to ip below */
+		prev = NULL;
+		for (free = flist.xbf_first; free; free = free->xbfi_next) {
+			if (free->xbfi_startblock == tirec.br_startblock &&
+			    free->xbfi_blockcount == tirec.br_blockcount)
+				break;
+			prev = free;
+		}
+		if (!done || !free) {
+			error = -EFSCORRUPTED;
+			goto out_bmap_cancel;
+		}
+		xfs_bmap_del_free(&flist, prev, free);
+
+		error = xfs_bunmapi(tp, ip, irec.br_startoff,
+				    irec.br_blockcount, 0, 1, &firstfsb,
+				    &flist, &done);
+		if (error)
+			goto out_bmap_cancel;
+		if (!done) {
+			error = -EFSCORRUPTED;
+			goto out_bmap_cancel;
+		}
+
+		error = xfs_bmap_insert_extent(tp, ip, &tirec, &firstfsb,
+					       &flist);
+		if (error)
+			goto out_bmap_cancel;
+
+		error = xfs_bmap_finish(&tp, &flist, &committed);
+		if (error)
+			goto out_bmap_cancel;
+		if (committed) {
+			xfs_trans_ijoin(tp, ip, 0);
+			xfs_trans_ijoin(tp, tip, 0);
+		}
+
+		xfs_trans_log_inode(tp, ip, XFS_ILOG_CORE);
+		xfs_trans_log_inode(tp, tip, XFS_ILOG_CORE);
+		error = xfs_trans_commit(tp, XFS_TRANS_RELEASE_LOG_RES);
+		xfs_iunlock(ip, XFS_ILOCK_EXCL);
+		xfs_iunlock(tip, XFS_ILOCK_EXCL);
+		if (error)
+			return error;
+
+		*moved += tirec.br_blockcount;
+		offset_fsb += tirec.br_blockcount;
+		count_fsb -= tirec.br_blockcount;
+	}
+	return 0;
+
+out_bmap_cancel:
+	xfs_bmap_cancel(&flist);
+	xfs_trans_cancel(tp, XFS_TRANS_RELEASE_LOG_RES | XFS_TRANS_ABORT);
+	xfs_iunlock(ip, XFS_ILOCK_EXCL);
+	xfs_iunlock(tip, XFS_ILOCK_EXCL);
+	return error;
+}
+
+/*
+ * Move a range of a file to new blocks without going through userspace.
+ *
+ * The written extents in the range are copied to an O_TMPFILE style
+ * inode whose blocks were allocated in one go near the caller's hint,
+ * and then mapped into the file in place of the original extents.  Only
+ * the range is read, written and remapped, which is what makes partial
+ * defrag of large files cheap.  The file is held under the IOLOCK for
+ * the whole operation, so the only way to change it behind our back is
+ * a mapping; mapped files are refused.  mmap() does not take the IOLOCK,
+ * so the check is repeated under i_mmap_rwsem, which mmap() needs to add
+ * a mapping, and that is held over the remap.
+ */
+STATIC int
+xfs_ioc_relocate_range(
+	struct file			*filp,
+	struct xfs_relocate_range	*rrp)
+{
+	struct inode		*inode = file_inode(filp);
+	struct xfs_inode	*ip = XFS_I(inode);
+	struct xfs_mount	*mp = ip->i_mount;
+	struct xfs_inode	*tip;
+	struct dentry		*parent;
+	xfs_fsblock_t		hint = NULLFSBLOCK;
+	xfs_fileoff_t		offset_fsb;
+	xfs_filblks_t		count_fsb, moved;
+	xfs_off_t		start, end;
+	int			error;
+
+	if (rrp->rr_version != XFS_RR_VERSION ||
+	    (rrp->rr_flags & ~XFS_RR_FLAGS_ALL))
+		return -EINVAL;
+
+	if (!(filp->f_mode & FMODE_WRITE) ||
+	    !(filp->f_mode & FMODE_READ) ||
+	    (filp->f_flags & O_APPEND))
+		return -EBADF;
+
+	if (!S_ISREG(inode->i_mode) || IS_SWAPFILE(inode) ||
+	    XFS_IS_REALTIME_INODE(ip))
+		return -EINVAL;
+
+	if (inode->i_flags & (S_IMMUTABLE|S_APPEND))
+		return -EPERM;
+
+	if (rrp->rr_offset < 0 || rrp->rr_length < 0)
+		return -EINVAL;
+
+	if (rrp->rr_flags & XFS_RR_BNO) {
+		if (XFS_FSB_TO_AGNO(mp, rrp->rr_bno) >= mp->m_sb.sb_agcount ||
+		    XFS_FSB_TO_AGBNO(mp, rrp->rr_bno) >= mp->m_sb.sb_agblocks)
+			return -EINVAL;
+		hint = rrp->rr_bno;
+	} else if (rrp->rr_flags & XFS_RR_AGNO) {
+		if (rrp->rr_agno >= mp->m_sb.sb_agcount)
+			return -EINVAL;
+		hint = XFS_AGB_TO_FSB(mp, rrp->rr_agno, 0);
+	}
+
+	if (XFS_FORCED_SHUTDOWN(mp))
+		return -EIO;
+
+	rrp->rr_moved = 0;
+	xfs_ilock(ip, XFS_IOLOCK_EXCL);
+
+	/* nothing past EOF is worth moving */
+	end = XFS_ISIZE(ip);
+	if (rrp->rr_length && rrp->rr_offset + rrp->rr_length < end)
+		end = rrp->rr_offset + rrp->rr_length;
+	if (rrp->rr_offset >= end) {
+		error = 0;
+		goto out_unlock;
+	}
+	offset_fsb = XFS_B_TO_FSBT(mp, rrp->rr_offset);
+	count_fsb = XFS_B_TO_FSB(mp, end) - offset_fsb;
+	start = XFS_FSB_TO_B(mp, offset_fsb);
+
+	/* don't copy anything for nothing; checked again before the remap */
+	if (mapping_mapped(inode->i_mapping)) {
+		error = -EBUSY;
+		goto out_unlock;
+	}
+
+	/* get delalloc and in-flight direct I/O out of the way */
+	inode_dio_wait(inode);
+	error = filemap_write_and_wait_range(inode->i_mapping, start, end - 1);
+	if (error)
+		goto out_unlock;
+
+	parent = dget_parent(filp->f_path.dentry);
+	error = xfs_create_tmpfile(XFS_I(parent->d_inode), NULL, S_IFREG, &tip);
+	dput(parent);
+	if (error)
+		goto out_unlock;
+
+	error = xfs_relocate_alloc(tip, offset_fsb, count_fsb, hint,
+				   rrp->rr_flags & XFS_RR_CONTIG);
+	if (error)
+		goto out_irele;
+
+	error = xfs_relocate_copy(ip, tip, offset_fsb, count_fsb, end);
+	if (error)
+		goto out_irele;
+
+	/* writeback converts the unwritten extents the copy went into */
+	error = filemap_write_and_wait_range(VFS_I(tip)->i_mapping,
+					     start, end - 1);
+	if (error)
+		goto out_irele;
+
+	/*
+	 * Cached pages still point at the old blocks.  Drop them before
+	 * the remap, as the copy read them in, and again after it in case
+	 * readahead brought some back while we waited for i_mmap_rwsem.
+	 * Unmapping them takes i_mmap_rwsem, so not while we hold it.
+	 */
+	truncate_pagecache_range(inode, start, end - 1);
+	i_mmap_lock_read(inode->i_mapping);
+	if (mapping_mapped(inode->i_mapping)) {
+		i_mmap_unlock_read(inode->i_mapping);
+		error = -EBUSY;
+		goto out_irele;
+	}
+	error = xfs_relocate_swap(ip, tip, offset_fsb, count_fsb, &moved);
+	i_mmap_unlock_read(inode->i_mapping);
+
+	truncate_pagecache_range(inode, start, end - 1);
+	rrp->rr_moved = XFS_FSB_TO_B(mp, moved);
+
+out_irele:
+	IRELE(tip);
+out_unlock:
+	xfs_iunlock(ip, XFS_IOLOCK_EXCL);
+	return error;
+}
+
+/*
+ * Merge the data fork record at idx with the one after it.  The caller
+ * has checked that they are logically and physically adjacent and in
+ * the same state.
+ */
+STATIC int
+xfs_merge_extent_pair(
+	struct xfs_inode	*ip,
+	struct xfs_btree_cur	*cur,
+	xfs_extnum_t		idx,
+	struct xfs_bmbt_irec	*left,
+	struct xfs_bmbt_irec	*right)
+{
+	struct xfs_ifork	*ifp = XFS_IFORK_PTR(ip, XFS_DATA_FORK);
+	union xfs_btree_rec	rec;
+	int			stat;
+	int			error = 0;
+
+	if (cur) {
+		/* drop the right record and extend the left one over it */
+		cur->bc_rec.b = *right;
+		error = xfs_btree_lookup(cur, XFS_LOOKUP_EQ, &stat);
+		if (error)
+			goto done;
+		XFS_WANT_CORRUPTED_GOTO(stat == 1, done);
+		error = xfs_btree_delete(cur, &stat);
+		if (error)
+			goto done;
+		XFS_WANT_CORRUPTED_GOTO(stat == 1, done);
+		error = xfs_btree_decrement(cur, 0, &stat);
+		if (error)
+			goto done;
+		XFS_WANT_CORRUPTED_GOTO(stat == 1, done);
+		xfs_bmbt_disk_set_allf(&rec.bmbt, left->br_startoff,
+				left->br_startblock,
+				left->br_blockcount + right->br_blockcount,
+				left->br_state);
+		error = xfs_btree_update(cur, &rec);
+		if (error)
+			goto done;
+	}
+
+	xfs_iext_remove(ip, idx + 1, 1, 0);
+	xfs_bmbt_set_blockcount(xfs_iext_get_ext(ifp, idx),
+			left->br_blockcount + right->br_blockcount);
+	XFS_IFORK_NEXT_SET(ip, XFS_DATA_FORK,
+			XFS_IFORK_NEXTENTS(ip, XFS_DATA_FORK) - 1);
+done:
+	return error;
+}
+
+/*
+ * Merge data fork extents that are back to back both in the file and on
+ * disk and in the same state.  The allocator leaves these behind when
+ * an extent hits MAXEXTLEN at allocation time and later shrinks, or when
+ * unwritten conversion splits a range and the pieces are converted
+ * separately.  No data moves; only the extent records change.
+ *
+ * The whole fork is done in one transaction when it is in extents
+ * format.  In btree format every merge deletes a btree record, so each
+ * one gets its own transaction to keep the log reservation bounded, and
+ * the fork is converted back to extents format once the records fit in
+ * the inode again.
+ */
+STATIC int
+xfs_ioc_merge_extents(
+	struct file		*filp,
+	__uint32_t		*merged)
+{
+	struct inode		*inode = file_inode(filp);
+	struct xfs_inode	*ip = XFS_I(inode);
+	struct xfs_mount	*mp = ip->i_mount;
+	struct xfs_ifork	*ifp = XFS_IFORK_PTR(ip, XFS_DATA_FORK);
+	struct xfs_trans	*tp;
+	struct xfs_btree_cur	*cur;
+	struct xfs_bmap_free	flist;
+	struct xfs_bmbt_irec	left, right;
+	xfs_fsblock_t		firstfsb;
+	xfs_extnum_t		idx = 0;
+	bool			done = false;
+	int			logflags;
+	int			committed;
+	int			error = 0;
+
+	*merged = 0;
+
+	if (!(filp->f_mode & FMODE_WRITE))
+		return -EBADF;
+
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+
+	if (inode->i_flags & (S_IMMUTABLE|S_APPEND))
+		return -EPERM;
+
+	if (XFS_FORCED_SHUTDOWN(mp))
+		return -EIO;
+
+	xfs_ilock(ip, XFS_IOLOCK_EXCL);
+
+	while (!done) {
+		tp = xfs_trans_alloc(mp, XFS_TRANS_DIOSTRAT);
+		error = xfs_trans_reserve(tp, &M_RES(mp)->tr_write, 0, 0);
+		if (error) {
+			xfs_trans_cancel(tp, 0);
+			break;
+		}
+		xfs_ilock(ip, XFS_ILOCK_EXCL);
+		xfs_trans_ijoin(tp, ip, 0);
+
+		if (!(ifp->if_flags & XFS_IFEXTENTS)) {
+			error = xfs_iread_extents(tp, ip, XFS_DATA_FORK);
+			if (error)
+				goto out_cancel;
+		}
+
+		xfs_bmap_init(&flist, &firstfsb);
+		cur = NULL;
+		logflags = XFS_ILOG_CORE;
+		if (XFS_IFORK_FORMAT(ip, XFS_DATA_FORK) == XFS_DINODE_FMT_BTREE) {
+			cur = xfs_bmbt_init_cursor(mp, tp, ip, XFS_DATA_FORK);
+			cur->bc_private.b.firstblock = firstfsb;
+			cur->bc_private.b.flist = &flist;
+		} else {
+			logflags |= XFS_ILOG_DEXT;
+		}
+
+		done = true;
+		for (; idx + 1 < ifp->if_bytes / sizeof(xfs_bmbt_rec_t); idx++) {
+			xfs_bmbt_get_all(xfs_iext_get_ext(ifp, idx), &left);
+			xfs_bmbt_get_all(xfs_iext_get_ext(ifp, idx + 1), &right);
+
+			if (isnullstartblock(left.br_startblock) ||
+			    isnullstartblock(right.br_startblock) ||
+			    left.br_startoff + left.br_blockcount !=
+							right.br_startoff ||
+			    left.br_startblock + left.br_blockcount !=
+							right.br_startblock ||
+			    left.br_state != right.br_state ||
+			    left.br_blockcount + right.br_blockcount >
+							MAXEXTLEN)
+				continue;
+
+			error = xfs_merge_extent_pair(ip, cur, idx, &left,
+						      &right);
+			if (error)
+				break;
+			(*merged)++;
+
+			/* the merged record may merge again; stay on idx */
+			if (cur) {
+				done = false;
+				break;
+			}
+			idx--;
+		}
+
+		/* as in xfs_bunmapi(), go back to extents once they fit */
+		if (!error && cur &&
+		    XFS_IFORK_NEXTENTS(ip, XFS_DATA_FORK) <=
+				XFS_IFORK_MAXEXT(ip, XFS_DATA_FORK)) {
+			int	tmp_logflags = 0;
+
+			error = xfs_bmap_btree_to_extents(tp, ip, cur,
+					&tmp_logflags, XFS_DATA_FORK);
+			logflags |= tmp_logflags;
+		}
+
+		if (cur) {
+			xfs_btree_del_cursor(cur, error ? XFS_BTREE_ERROR :
+							  XFS_BTREE_NOERROR);
+		}
+		if (error)
+			goto out_bmap_cancel;
+
+		xfs_trans_log_inode(tp, ip, logflags);
+		error = xfs_bmap_finish(&tp, &flist, &committed);
+		if (error)
+			goto out_bmap_cancel;
+		error = xfs_trans_commit(tp, XFS_TRANS_RELEASE_LOG_RES);
+		xfs_iunlock(ip, XFS_ILOCK_EXCL);
+		if (error)
+			break;
+	}
+
+	xfs_iunlock(ip, XFS_IOLOCK_EXCL);
+	return error;
+
+out_bmap_cancel:
+	xfs_bmap_cancel(&flist);
+out_cancel:
+	xfs_trans_cancel(tp, XFS_TRANS_RELEASE_LOG_RES | XFS_TRANS_ABORT);
+	xfs_iunlock(ip, XFS_ILOCK_EXCL);
+	xfs_iunlock(ip, XFS_IOLOCK_EXCL);
+	return error;
+}
+
 /*
  * Mostly similar to ioctl_fiemap() function present
  * in fs/ioctl.c 
@@ -1597,6 +2895,7 @@ xfs_file_ioctl(
 	case XFS_IOC_FREESP64:
 	case XFS_IOC_RESVSP64:
 	case XFS_IOC_UNRESVSP64:
+	case XFS_IOC_RESVSP_CONTIG:
 	case XFS_IOC_ZERO_RANGE: {
 		xfs_flock64_t		bf;
 
@@ -1604,6 +2903,8 @@ xfs_file_ioctl(
 			return -EFAULT;
 		return xfs_ioc_space(ip, inode, filp, ioflags, cmd, &bf);
 	}
+	case XFS_IOC_SPACE_VEC:
+		return xfs_ioc_space_vec(ip, inode, filp, ioflags, arg);
 	case XFS_IOC_DIOINFO: {
 		struct dioattr	da;
 		xfs_buftarg_t	*target =
@@ -1714,6 +3015,37 @@ xfs_file_ioctl(
 		return error;
 	}
 
+	case XFS_IOC_SWAPEXT_BATCH:
+		return xfs_ioc_swapext_batch(filp, arg);
+
+	case XFS_IOC_RELOCATE_RANGE: {
+		struct xfs_relocate_range	rr;
+
+		if (copy_from_user(&rr, arg, sizeof(rr)))
+			return -EFAULT;
+		error = mnt_want_write_file(filp);
+		if (error)
+			return error;
+		error = xfs_ioc_relocate_range(filp, &rr);
+		mnt_drop_write_file(filp);
+		if (copy_to_user(arg, &rr, sizeof(rr)))
+			return -EFAULT;
+		return error;
+	}
+
+	case XFS_IOC_MERGE_EXTENTS: {
+		__uint32_t	merged;
+
+		error = mnt_want_write_file(filp);
+		if (error)
+			return error;
+		error = xfs_ioc_merge_extents(filp, &merged);
+		mnt_drop_write_file(filp);
+		if (copy_to_user(arg, &merged, sizeof(merged)))
+			return -EFAULT;
+		return error;
+	}
+
 	case XFS_IOC_FSCOUNTS: {
 		xfs_fsop_counts_t out;
 
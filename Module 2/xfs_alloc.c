@@ -46,6 +46,8 @@ struct workqueue_struct *xfs_alloc_wq;
 STATIC int xfs_alloc_ag_vextent_exact(xfs_alloc_arg_t *);
 STATIC int xfs_alloc_ag_vextent_near(xfs_alloc_arg_t *);
 STATIC int xfs_alloc_ag_vextent_size(xfs_alloc_arg_t *);
+STATIC int xfs_alloc_ag_vextent_bestfit(xfs_alloc_arg_t *);
+STATIC int xfs_alloc_ag_vextent_done(xfs_alloc_arg_t *);
 STATIC int xfs_alloc_ag_vextent_small(xfs_alloc_arg_t *,
 		xfs_btree_cur_t *, xfs_agblock_t *, xfs_extlen_t *, int *);
 
@@ -609,6 +611,18 @@ xfs_alloc_ag_vextent(
 	if (error || args->agbno == NULLAGBLOCK)
 		return error;
 
+	return xfs_alloc_ag_vextent_done(args);
+}
+
+/*
+ * Account for an extent just taken out of the free space btrees.
+ */
+STATIC int			/* error */
+xfs_alloc_ag_vextent_done(
+	xfs_alloc_arg_t	*args)	/* argument structure for allocation */
+{
+	int		error = 0;
+
 	ASSERT(args->len >= args->minlen);
 	ASSERT(args->len <= args->maxlen);
 	ASSERT(!args->wasfromfl || !args->isfl);
@@ -1444,6 +1458,86 @@ out_nominleft:
 	return 0;
 }
 
+/*
+ * Allocate exactly maxlen blocks in the allocation group agno, from the
+ * smallest free extent that holds them.  Busy extents are skipped rather
+ * than waited for and nothing shorter is accepted, so unlike
+ * xfs_alloc_ag_vextent_size() this never forces the log.
+ * Return the starting a.g. block, or NULLAGBLOCK if we can't do it.
+ */
+STATIC int				/* error */
+xfs_alloc_ag_vextent_bestfit(
+	xfs_alloc_arg_t	*args)		/* allocation argument structure */
+{
+	xfs_btree_cur_t	*bno_cur;	/* cursor for bno btree */
+	xfs_btree_cur_t	*cnt_cur;	/* cursor for cnt btree */
+	int		error;		/* error result */
+	xfs_agblock_t	fbno;		/* start of found freespace */
+	xfs_extlen_t	flen;		/* length of found freespace */
+	int		i;		/* temp status variable */
+	xfs_agblock_t	rbno;		/* returned block number */
+	xfs_extlen_t	rlen;		/* length of returned extent */
+
+	ASSERT(args->minlen == args->maxlen);
+	ASSERT(args->alignment == 1);
+
+	cnt_cur = xfs_allocbt_init_cursor(args->mp, args->tp, args->agbp,
+		args->agno, XFS_BTNUM_CNT);
+
+	/*
+	 * The by-size btree is sorted by length, so the first non-busy
+	 * entry >= maxlen is the best fit.
+	 */
+	if ((error = xfs_alloc_lookup_ge(cnt_cur, 0, args->maxlen, &i)))
+		goto error0;
+	while (i) {
+		if ((error = xfs_alloc_get_rec(cnt_cur, &fbno, &flen, &i)))
+			goto error0;
+		XFS_WANT_CORRUPTED_GOTO(i == 1, error0);
+		xfs_alloc_compute_aligned(args, fbno, flen, &rbno, &rlen);
+		if (rlen >= args->maxlen)
+			break;
+		if ((error = xfs_btree_increment(cnt_cur, 0, &i)))
+			goto error0;
+	}
+	if (!i) {
+		xfs_btree_del_cursor(cnt_cur, XFS_BTREE_NOERROR);
+		trace_xfs_alloc_size_noentry(args);
+		args->agbno = NULLAGBLOCK;
+		return 0;
+	}
+
+	args->wasfromfl = 0;
+	args->len = args->maxlen;
+	if (!xfs_alloc_fix_minleft(args)) {
+		xfs_btree_del_cursor(cnt_cur, XFS_BTREE_NOERROR);
+		trace_xfs_alloc_size_nominleft(args);
+		args->agbno = NULLAGBLOCK;
+		return 0;
+	}
+
+	bno_cur = xfs_allocbt_init_cursor(args->mp, args->tp, args->agbp,
+		args->agno, XFS_BTNUM_BNO);
+	if ((error = xfs_alloc_fixup_trees(cnt_cur, bno_cur, fbno, flen,
+			rbno, args->len, XFSA_FIXUP_CNT_OK))) {
+		xfs_btree_del_cursor(bno_cur, XFS_BTREE_ERROR);
+		goto error0;
+	}
+	xfs_btree_del_cursor(cnt_cur, XFS_BTREE_NOERROR);
+	xfs_btree_del_cursor(bno_cur, XFS_BTREE_NOERROR);
+	args->agbno = rbno;
+	XFS_WANT_CORRUPTED_RETURN(
+		args->agbno + args->len <=
+			be32_to_cpu(XFS_BUF_TO_AGF(args->agbp)->agf_length));
+	trace_xfs_alloc_size_done(args);
+	return 0;
+
+error0:
+	trace_xfs_alloc_size_error(args);
+	xfs_btree_del_cursor(cnt_cur, XFS_BTREE_ERROR);
+	return error;
+}
+
 /*
  * Deal with the case where only small freespaces remain.
  * Either return the contents of the last freespace record,
@@ -2580,6 +2674,111 @@ error0:
 	return error;
 }
 
+/*
+ * Allocate maxlen blocks as a single extent, or nothing.
+ *
+ * This is for callers like a defragmenter that would rather fail than
+ * take a fragmented or shorter allocation.  Whether an AG can hold the
+ * request is decided from its in-core longest free extent, without
+ * reading its btrees.  Of the AGs that can, the one fsbno is in wins,
+ * else the one whose longest free extent is the smallest, and inside
+ * it the smallest free extent that fits is used.  If nothing fits we
+ * return NULLFSBLOCK straight away instead of retrying with a forced
+ * log or a smaller length the way xfs_alloc_vextent() does.
+ */
+int				/* error */
+xfs_alloc_vextent_bestfit(
+	xfs_alloc_arg_t	*args)	/* allocation argument structure */
+{
+	xfs_mount_t	*mp = args->mp;
+	xfs_perag_t	*pag;
+	xfs_agnumber_t	agno;
+	xfs_agnumber_t	sagno;	/* a.g. of the hint */
+	xfs_agnumber_t	bestagno = NULLAGNUMBER;
+	xfs_extlen_t	longest;
+	xfs_extlen_t	bestlongest = 0;
+	xfs_extlen_t	minleft;
+	int		error;
+
+	args->otype = args->type = XFS_ALLOCTYPE_THIS_AG;
+	args->agbno = NULLAGBLOCK;
+	args->minlen = args->maxlen;
+	if (args->alignment == 0)
+		args->alignment = 1;
+	if (XFS_FSB_TO_AGNO(mp, args->fsbno) >= mp->m_sb.sb_agcount ||
+	    args->maxlen == 0 || args->maxlen > mp->m_sb.sb_agblocks ||
+	    args->alignment != 1 || args->mod >= args->prod) {
+		args->fsbno = NULLFSBLOCK;
+		trace_xfs_alloc_vextent_badargs(args);
+		return 0;
+	}
+	sagno = XFS_FSB_TO_AGNO(mp, args->fsbno);
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		/* once we hold an AGF, only higher ones can be locked */
+		if (args->firstblock != NULLFSBLOCK &&
+		    agno < XFS_FSB_TO_AGNO(mp, args->firstblock))
+			continue;
+		pag = xfs_perag_get(mp, agno);
+		if (!pag->pagf_init) {
+			error = xfs_alloc_pagf_init(mp, args->tp, agno,
+						    XFS_ALLOC_FLAG_TRYLOCK);
+			if (error) {
+				xfs_perag_put(pag);
+				return error;
+			}
+		}
+		longest = pag->pagf_init ?
+			xfs_alloc_longest_free_extent(mp, pag) : 0;
+		xfs_perag_put(pag);
+		if (longest < args->maxlen)
+			continue;
+		if (agno == sagno) {
+			bestagno = agno;
+			break;
+		}
+		if (bestagno == NULLAGNUMBER || longest < bestlongest) {
+			bestagno = agno;
+			bestlongest = longest;
+		}
+	}
+	if (bestagno == NULLAGNUMBER) {
+		args->fsbno = NULLFSBLOCK;
+		trace_xfs_alloc_vextent_allfailed(args);
+		return 0;
+	}
+
+	args->agno = bestagno;
+	args->pag = xfs_perag_get(mp, args->agno);
+	minleft = args->minleft;
+	args->minleft = 0;
+	error = xfs_alloc_fix_freelist(args, 0);
+	args->minleft = minleft;
+	if (error) {
+		trace_xfs_alloc_vextent_nofix(args);
+		goto error0;
+	}
+	if (!args->agbp) {
+		trace_xfs_alloc_vextent_noagbp(args);
+	} else {
+		args->wasfromfl = 0;
+		error = xfs_alloc_ag_vextent_bestfit(args);
+		if (!error && args->agbno != NULLAGBLOCK)
+			error = xfs_alloc_ag_vextent_done(args);
+		if (error)
+			goto error0;
+	}
+	if (args->agbno == NULLAGBLOCK)
+		args->fsbno = NULLFSBLOCK;
+	else
+		args->fsbno = XFS_AGB_TO_FSB(mp, args->agno, args->agbno);
+	xfs_perag_put(args->pag);
+	return 0;
+error0:
+	xfs_perag_put(args->pag);
+	return error;
+}
+
 /*
  * Free an extent.
  * Just break up the extent address and hand off to xfs_free_ag_extent
@@ -31,11 +31,33 @@
 #include <mntent.h>
 #include <syslog.h>
 #include <signal.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
 #include <sys/wait.h>
 #include <sys/vfs.h>
 #include <sys/statvfs.h>
 #include <sys/xattr.h>
+/*
+ * configure normally defines these and adds -luring/-laio; otherwise
+ * use whichever headers are installed.
+ */
+#if defined(__has_include)
+# if !defined(HAVE_LIBURING) && __has_include(<liburing.h>)
+#  define HAVE_LIBURING 1
+# endif
+# if !defined(HAVE_LIBAIO) && __has_include(<libaio.h>)
+#  define HAVE_LIBAIO 1
+# endif
+#endif
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+#ifdef HAVE_LIBAIO
+#include <libaio.h>
+#endif
 
 
 #ifndef XFS_XFLAG_NODEFRAG
@@ -43,8 +65,97 @@
 #endif
 
 #define _PATH_FSRLAST		"/var/tmp/.fsrlast_xfs"
+#define _PATH_FSRCACHE		"/var/tmp/.fsrcache_xfs"
+#define _PATH_FSRRMAP		"/var/tmp/.fsrrmap_xfs"
 #define _PATH_PROC_MOUNTS	"/proc/mounts"
 
+#ifndef FIEMAPFS_FLAG_FREESP
+#define FIEMAPFS_FLAG_FREESP		0x80000000
+#endif
+
+/*
+ * The ioctls below are newer than most installed xfs headers, so carry
+ * their definitions here.  Kernels without them fail with ENOTTY and
+ * fsr falls back to what it did before.
+ */
+#ifndef XFS_SX_VERSION_ATTR
+#define XFS_SX_VERSION_ATTR	1
+#endif
+
+#ifndef XFS_IOC_RELOCATE_RANGE
+typedef struct xfs_relocate_range
+{
+	__int64_t	rr_version;	/* version */
+#define XFS_RR_VERSION		0
+	__uint32_t	rr_flags;	/* XFS_RR_* flags */
+	__uint32_t	rr_agno;	/* AG to allocate in */
+	xfs_off_t	rr_offset;	/* offset into file */
+	xfs_off_t	rr_length;	/* length from offset */
+	__int64_t	rr_bno;		/* fs block to allocate near */
+	xfs_off_t	rr_moved;	/* out: bytes relocated */
+	char		rr_pad[16];	/* pad space, unused */
+} xfs_relocate_range_t;
+
+#define XFS_RR_AGNO		0x1	/* allocate in rr_agno */
+#define XFS_RR_BNO		0x2	/* allocate near rr_bno */
+#define XFS_RR_CONTIG		0x4	/* fail unless one extent */
+#define XFS_IOC_RELOCATE_RANGE	_IOWR('X', 59, struct xfs_relocate_range)
+#endif
+
+#ifndef XFS_IOC_MERGE_EXTENTS
+#define XFS_IOC_MERGE_EXTENTS	_IOR ('X', 60, __uint32_t)
+#endif
+
+#ifndef XFS_IOC_RESVSP_CONTIG
+#define XFS_RC_AGNO		0x1
+#define XFS_IOC_RESVSP_CONTIG	_IOW ('X', 61, struct xfs_flock64)
+#endif
+
+#ifndef XFS_IOC_SPACE_VEC
+typedef struct xfs_space_vec {
+	__s64		sv_offset;	/* start of range in bytes */
+	__s64		sv_length;	/* length of range in bytes */
+	__u32		sv_op;		/* XFS_SV_* */
+	__u32		sv_pad;		/* pad space, unused */
+} xfs_space_vec_t;
+
+#define XFS_SV_RESVSP		1
+#define XFS_SV_UNRESVSP		2
+
+typedef struct xfs_space_vec_req {
+	__u32		sr_version;	/* XFS_SPACE_VEC_VERSION */
+	__u32		sr_count;	/* number of ranges */
+	__u64		sr_vec;		/* user pointer to the ranges */
+	__u32		sr_done;	/* out: ranges done */
+	__u32		sr_pad[3];	/* pad space, unused */
+} xfs_space_vec_req_t;
+
+#define XFS_SPACE_VEC_VERSION	0
+#define XFS_SPACE_VEC_MAX	65536	/* ranges per call */
+#define XFS_IOC_SPACE_VEC	_IOWR('X', 62, struct xfs_space_vec_req)
+#endif
+
+#ifndef XFS_IOC_SWAPEXT_BATCH
+typedef struct xfs_swapext_batch
+{
+	__u32		xb_version;	/* XFS_XB_VERSION */
+	__u32		xb_count;	/* number of swaps */
+	__u64		xb_swaps;	/* user pointer to the swaps */
+	__u64		xb_results;	/* user pointer to the results */
+	char		xb_pad[16];	/* pad space, unused */
+} xfs_swapext_batch_t;
+
+#define XFS_XB_VERSION		0
+#define XFS_XB_MAX		256	/* swaps per call */
+#define XFS_IOC_SWAPEXT_BATCH	_IOW ('X', 63, struct xfs_swapext_batch)
+#endif
+
+/* copy backends, in the order aio_probe() tries them */
+#define AIO_SYNC	0
+#define AIO_URING	1
+#define AIO_LIBAIO	2
+
+static const char *aio_names[] = { "synchronous I/O", "io_uring", "libaio" };
 
 char *progname;
 
@@ -57,14 +168,35 @@ int uflag = 0;
 long freesp = 0;
 int unselected = 0;
 
-/* static int sflag; */
+static int sflag;
+static int zflag;			/* -z: compact free space */
+static int bspread = -1;		/* -B: rebalance AGs to this spread */
+static int relocating;			/* move files even if not fragmented */
+static int swapbatch;			/* queue swaps of small files */
+static int norelocate;			/* no XFS_IOC_RELOCATE_RANGE */
 int argv_blksz_dio;
 extern int max_ext_size;
 static int npasses = 10;
 static int startpass = 0;
+static int nworkers = 1;		/* -j: parallel defrag workers */
+static int maxfs;			/* -c: filesystems reorganized at once */
+static int aio_depth = 4;		/* -q: copy I/Os in flight per file */
+static int aio_backend = -1;		/* copy backend, set by aio_probe() */
+static double minscore;			/* -S: skip files scoring below this */
+static int worker_id = 0;		/* this process' worker slot */
+static int tmp_agstep = 1;		/* AG stride for tmp_next() */
+
+/* where tmp_place() expects the temporary file's data to go */
+static struct {
+	xfs_agnumber_t	agno;
+	xfs_agblock_t	bno;
+	int		nextents;	/* extents free space allows */
+	int		valid;
+} tmp_hint;
 
 struct getbmap  *outmap = NULL;
 int             outmap_size = 0;
+#define FSR_BMV_UNWRITTEN	(-3)	/* outmap: -1 is a hole, -2 delalloc */
 int		RealUid;
 int		tmp_agi;
 static __int64_t	minimumfree = 2048;
@@ -92,25 +224,105 @@ static int	pagesize;
 void usage(int ret);
 static int  fsrfile(char *fname, xfs_ino_t ino);
 static int  fsrfile_common( char *fname, char *tname, char *mnt,
-                            int fd, xfs_bstat_t *statp);
+                            int fd, xfs_bstat_t *statp, int *packedp);
 static int  packfile(char *fname, char *tname, int fd,
                      xfs_bstat_t *statp, struct fsxattr *fsxp);
 static void fsrdir(char *dirname);
 static int  fsrfs(char *mntdir, xfs_ino_t ino, int targetrange);
+static void fsrstats(char *mntdir);
+static void fsrcompact(char *mntdir);
+static void fsrbalance(char *mntdir);
 static void initallfs(char *mtab);
+static dev_t fsr_backing_disk(dev_t rdev);
 static void fsrallfs(char *mtab, int howlong, char *leftofffile);
 static void fsrall_cleanup(int timeout);
+static void fsrall_checkpoint(void);
+static void aio_probe(void);
+struct fsr_layout {
+	int		nextents;	/* data extents, holes excluded */
+	int		ndisc;		/* physical discontinuities */
+	int		nmerge;		/* mergeable neighbours GETBMAPX split */
+	int		agjumps;	/* discontinuities into another AG */
+	__u64		seekdist;	/* sum of gaps between extents */
+};
+
+/* per filesystem counters, shared with the worker processes */
+struct fsr_fsstats {
+	__u64		contig_files;	/* skipped, contiguous on disk */
+	__u64		contig_bytes;	/* data they would have copied */
+};
+static struct fsr_fsstats *fsstats;
+
+#define FSR_CACHE_MAGIC		"XFSRCACH"
+#define FSR_CACHE_VERSION	2
+#define FSR_CACHE_LOGSIZE	(4 << 20)	/* new records per pass */
+#define FSR_CACHE_NOGAIN_AGE	(7 * 24 * 3600)	/* retry no-gain files */
+
+/* what the last look at a file found */
+#define FSR_CACHE_SCORED	0	/* block map scored, not defragged */
+#define FSR_CACHE_CLEAN		1	/* nothing to gain, file is fine */
+#define FSR_CACHE_NOGAIN	2	/* a copy would not have helped */
+#define FSR_CACHE_DONE		3	/* defragmented */
+
+struct fsr_cache_hdr {
+	char		magic[8];
+	__u32		version;
+	__u32		entsize;
+	__u64		count;
+};
+
+struct fsr_cache_ent {
+	__u64		ino;
+	__s64		ctime;
+	__s64		size;
+	__u32		ctime_nsec;
+	__u32		gen;
+	__u32		extents;
+	__u32		outcome;
+	float		score;
+	__u32		stamp;		/* when recorded */
+	__u32		maphash;	/* block map up to size, or 0 */
+};
+
+struct fsr_cache_log {
+	unsigned int	count;
+	unsigned int	max;
+	struct fsr_cache_ent ent[];
+};
+
+static struct {
+	char			path[PATH_MAX];
+	struct fsr_cache_hdr	*hdr;	/* mmap'ed cache file */
+	size_t			maplen;
+	struct fsr_cache_ent	*ents;
+	unsigned char		*seen;	/* records the scan came across */
+	struct fsr_cache_log	*log;	/* this pass, shared with workers */
+} cache;
+
+static void cache_close(void);
+static struct fsr_cache_ent *cache_note(xfs_bstat_t *bs, int outcome,
+					 double score);
+static void packfile_note(xfs_bstat_t *bs, int outcome, int saved);
+static xfs_agnumber_t fsr_ino_to_agno(xfs_ino_t ino);
+static int fsr_agino_log(void);
+static int fsr_attr_layout(int fd, int *nextents, int *ndisc);
+static int packfile_attr(char *fname, char *tname, int fd, xfs_bstat_t *statp);
+static __s64 fsr_daddr_to_fsb(__s64 daddr);
+
 static int  getnextents(int);
+static int  fsr_layout(int, struct fsr_layout *);
 int xfsrtextsize(int fd);
 int xfs_getrt(int fd, struct statvfs64 *sfbp);
 char * gettmpname(char *fname);
 char * getparent(char *fname);
 int fsrprintf(const char *fmt, ...);
 int read_fd_bmap(int, xfs_bstat_t *, int *);
-int cmp(const void *, const void *);
 static void tmp_init(char *mnt);
 static char * tmp_next(char *mnt);
+static void tmp_freesum(int fsfd);
+static char * tmp_place(char *mnt, xfs_bstat_t *bs);
 static void tmp_close(char *mnt);
+static void swapq_flush(void);
 int xfs_getgeom(int , xfs_fsop_geom_v1_t * );
 
 int extent_map(struct getbmap *tmp_map); 
@@ -120,14 +332,102 @@ xfs_fsop_geom_v1_t fsgeom;	/* geometry of active mounted system */
 #define NMOUNT 64
 static int numfs;
 
+/*
+ * Checkpoint state of one filesystem.
+ *
+ * The parent maps one of these per filesystem and shares it with the
+ * child reorganizing that filesystem and with the child's workers, so
+ * it can write a checkpoint at any time without asking them.  The child
+ * keeps the scan cursor, the ranked candidates it has not got to yet
+ * and the statistics up to date.  The statistics add up over runs.
+ */
+#define FSR_CKPT_MAGIC		"# xfs_fsr checkpoint 2"
+#define FSR_CKPT_BACKLOG	4096	/* ranked candidates carried over */
+#define FSR_CKPT_MAXAG		4096	/* AGs with progress counters */
+#define FSR_CKPT_INTERVAL	60	/* seconds between checkpoints */
+#define FSR_CKPT_CHUNKS		256	/* huge files part way done */
+
+struct fsr_cand {
+	xfs_ino_t	ino;
+	double		benefit;
+};
+
+struct fsr_chunk_cursor {
+	xfs_ino_t	ino;		/* 0 if the slot is free */
+	__u32		gen;
+	__s64		offset;		/* bytes done */
+};
+
+struct fsr_ckpt_stats {
+	__u64		examined;	/* files packfile looked at */
+	__u64		defragged;
+	__u64		clean;		/* nothing to gain */
+	__u64		nogain;		/* a copy would not have helped */
+	__u64		extents;	/* extents removed */
+	__u64		bytes;		/* data copied */
+	__u64		seconds;	/* time spent on this filesystem */
+};
+
+struct fsr_ckpt {
+	xfs_ino_t		startino;	/* the scan resumes here */
+	int			target;		/* files left to do this pass */
+	int			nbacklog;	/* slots used in backlog[] */
+	struct fsr_ckpt_stats	stats;
+	__u32			agdone[FSR_CKPT_MAXAG];	/* candidates done */
+	struct fsr_cand		backlog[FSR_CKPT_BACKLOG]; /* ino 0 = done */
+	struct fsr_chunk_cursor	chunks[FSR_CKPT_CHUNKS];
+};
+
+static struct fsr_ckpt *ckpt;		/* child: our filesystem's state */
+static time_t nextckpt;			/* parent: next checkpoint due */
+
 typedef struct fsdesc {
 	char *dev;
 	char *mnt;
 	int  npass;
+	dev_t disk;		/* backing disk, filesystems sharing one run serially */
+	pid_t pid;		/* child reorganizing this fs, 0 if idle */
+	time_t started;		/* when that child was started */
+	struct fsr_ckpt *ckpt;	/* progress, shared with the child */
 } fsdesc_t;
 
 fsdesc_t	*fs, *fsbase, *fsend;
 
+/*
+ * Parallel defragmentation (-j).
+ *
+ * fsrfs() keeps walking the inodes with bulkstat and hands the candidate
+ * files to a set of forked workers through queues in shared memory.
+ * Worker N owns the allocation groups with agno % nworkers == N: files
+ * whose inode lives in one of those AGs are queued to it and its temp
+ * files are only created in the matching .fsr/agN directories, so two
+ * workers rarely allocate from the same AG at the same time.  A worker
+ * whose own queue runs dry steals from the fullest of the others.
+ */
+#define FSR_WQ_DEPTH	64
+#define FSR_MAXWORKERS	64
+
+struct fsr_wq {
+	int		head;		/* index of the oldest entry */
+	int		count;		/* number of queued entries */
+	xfs_ino_t	busy;		/* inode being defragmented, 0 if idle */
+	xfs_bstat_t	bs[FSR_WQ_DEPTH];
+};
+
+struct fsr_workq {
+	pthread_mutex_t	lock;
+	pthread_cond_t	work;		/* work queued, or done/stop set */
+	pthread_cond_t	room;		/* a queue slot was freed */
+	int		nworkers;
+	int		done;		/* nothing more will be queued */
+	int		stop;		/* out of time, quit after current file */
+	pid_t		pid[FSR_MAXWORKERS];
+	struct fsr_wq	wq[];
+};
+
+static struct fsr_workq	*workq;		/* NULL unless running parallel */
+static size_t		workq_size;
+
 struct cumulative_exts
 {
 	int start;
@@ -232,6 +532,8 @@ xfs_fscounts(int fd, xfs_fsop_counts_t *counts)
 void
 aborter(int unused)
 {
+	if (workq)
+		workq->stop = 1;
 	fsrall_cleanup(1);
 	exit(1);
 }
@@ -595,7 +897,7 @@ main(int argc, char **argv)
 
 	gflag = ! isatty(0);
 
-	while ((c = getopt(argc, argv, "C:p:e:MgsdunvTt:f:m:b:N:FV")) != -1) { 
+	while ((c = getopt(argc, argv, "C:p:e:MgsdunvTt:f:m:b:N:FVj:c:q:S:zB:")) != -1) { 
 		switch (c) {
 		case 'M':
 			Mflag = 1;
@@ -616,11 +918,15 @@ main(int argc, char **argv)
 			uflag = 1;
 			break;
 		case 's':		/* frag stats only */
-			/* sflag = 1; */
-			fprintf(stderr,
-				_("%s: Stats not yet supported for XFS\n"),
-				progname);
-			usage(1);
+			sflag = 1;
+			break;
+		case 'z':		/* compact free space */
+			zflag = 1;
+			break;
+		case 'B':		/* rebalance AGs */
+			bspread = atoi(optarg);
+			if (bspread < 0 || bspread > 100)
+				usage(1);
 			break;
 		case 't':
 			howlong = atoi(optarg);
@@ -637,6 +943,22 @@ main(int argc, char **argv)
 		case 'p':
 			npasses = atoi(optarg);
 			break;
+		case 'j':
+			nworkers = atoi(optarg);
+			if (nworkers < 1)
+				nworkers = 1;
+			if (nworkers > FSR_MAXWORKERS)
+				nworkers = FSR_MAXWORKERS;
+			break;
+		case 'c':
+			maxfs = atoi(optarg);
+			break;
+		case 'q':
+			aio_depth = atoi(optarg);
+			break;
+		case 'S':
+			minscore = atof(optarg);
+			break;
 		case 'C':
 			/* Testing opt: coerses frag count in result */
 			if (getenv("FSRXFSTEST") != NULL) {
@@ -670,12 +992,17 @@ main(int argc, char **argv)
 		setbuf(stdout, NULL);
 
 	starttime = time(0);
+	if (zflag || bspread >= 0)
+		endtime = starttime + howlong;
 
 	/* Save the caller's real uid */
 	RealUid = getuid();
 
 	pagesize = getpagesize();
 
+	if (!sflag)
+		aio_probe();
+
 	if (optind < argc) {
 		for (; optind < argc; optind++) {
 			argname = argv[optind];
@@ -697,8 +1024,19 @@ main(int argc, char **argv)
 			}
 
 			mntp = find_mountpoint(mtab, argname, &sb);
-			if (mntp != NULL) {
+			if (mntp != NULL && sflag) {
+				fsrstats(mntp);
+			} else if (mntp != NULL && zflag) {
+				fsrcompact(mntp);
+			} else if (mntp != NULL && bspread >= 0) {
+				fsrbalance(mntp);
+			} else if (mntp != NULL) {
 				fsrfs(mntp, 0, 100);
+			} else if (sflag || zflag || bspread >= 0) {
+				fprintf(stderr, _(
+				"%s: %s needs a filesystem: %s\n"),
+					progname, sflag ? "-s" :
+					zflag ? "-z" : "-B", argname);
 			} else if (S_ISCHR(sb.st_mode)) {
 				fprintf(stderr, _(
 					"%s: char special not supported: %s\n"),
@@ -721,6 +1059,18 @@ main(int argc, char **argv)
 					argname);
 			}
 		}
+	} else if (sflag) {
+		initallfs(mtab);
+		for (fs = fsbase; fs < fsend; fs++)
+			fsrstats(fs->mnt);
+	} else if (zflag) {
+		initallfs(mtab);
+		for (fs = fsbase; fs < fsend && endtime > time(0); fs++)
+			fsrcompact(fs->mnt);
+	} else if (bspread >= 0) {
+		initallfs(mtab);
+		for (fs = fsbase; fs < fsend && endtime > time(0); fs++)
+			fsrbalance(fs->mnt);
 	} else {
 		initallfs(mtab);
 		fsrallfs(mtab, howlong, leftofffile);
@@ -731,23 +1081,100 @@ main(int argc, char **argv)
 void
 usage(int ret)
 {
+	aio_probe();
 	fprintf(stderr, _(
-"Usage: %s [-d] [-v] [-g] [-t time] [-p passes] [-f leftf] [-m mtab]\n"
-"       %s [-d] [-v] [-g] xfsdev | dir | file ...\n"
+"Usage: %s [-d] [-v] [-g] [-j jobs] [-c maxfs] [-t time] [-p passes] [-f leftf] [-m mtab]\n"
+"       %s [-d] [-v] [-g] [-j jobs] xfsdev | dir | file ...\n"
+"       %s -s [-j jobs] [xfsdev ...]\n"
+"       %s -z [-d] [-v] [-t time] [xfsdev ...]\n"
+"       %s -B spread [-d] [-v] [-t time] [xfsdev ...]\n"
 "       %s -V\n\n"
 "Options:\n"
 "       -g              Print to syslog (default if stdout not a tty).\n"
 "       -t time         How long to run in seconds.\n"
 "       -p passes       Number of passes before terminating global re-org.\n"
+"       -j jobs         Defragment up to this many files in parallel.\n"
+"       -c maxfs        Reorganize at most this many filesystems at once.\n"
+"       -q depth        Keep this many copy I/Os in flight (1 = synchronous).\n"
+"                       Copies use %s on this system.\n"
+"       -S score        Skip files with a fragmentation score below this.\n"
+"       -s              Print fragmentation statistics, change nothing.\n"
+"       -z              Compact free space instead of defragmenting files.\n"
+"       -B spread       Move files out of full AGs until AG usage is within\n"
+"                       spread percent.\n"
 "       -f leftoff      Use this instead of %s.\n"
 "       -m mtab         Use something other than /etc/mtab.\n"
 "       -d              Debug, print even more.\n"
 "       -v              Verbose, more -v's more verbose.\n"
 "       -V              Print version number and exit.\n"
-		), progname, progname, progname, _PATH_FSRLAST);
+		), progname, progname, progname, progname, progname,
+		progname, aio_names[aio_backend], _PATH_FSRLAST);
 	exit(ret);
 }
 
+/*
+ * Read a "major:minor" device number from a sysfs dev file.
+ */
+static int
+fsr_read_devno(char *path, dev_t *devp)
+{
+	FILE		*fp;
+	unsigned int	maj, mn;
+	int		ret = -1;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return -1;
+	if (fscanf(fp, "%u:%u", &maj, &mn) == 2) {
+		*devp = makedev(maj, mn);
+		ret = 0;
+	}
+	fclose(fp);
+	return ret;
+}
+
+/*
+ * Find the disk backing a block device, so that filesystems living on
+ * the same spindle are not reorganized at the same time.  Device mapper
+ * and md devices are followed down to their first underlying device,
+ * partitions up to the whole disk.  If sysfs can't tell us, every
+ * device is assumed to be independent.
+ */
+static dev_t
+fsr_backing_disk(dev_t rdev)
+{
+	char		path[PATH_MAX];
+	struct dirent	*de;
+	DIR		*dir;
+	int		depth;
+
+	for (depth = 0; depth < 8; depth++) {
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/slaves",
+			major(rdev), minor(rdev));
+		if ((dir = opendir(path)) == NULL)
+			break;
+		while ((de = readdir(dir)) != NULL) {
+			if (de->d_name[0] != '.')
+				break;
+		}
+		if (de)
+			snprintf(path, sizeof(path),
+				"/sys/dev/block/%u:%u/slaves/%s/dev",
+				major(rdev), minor(rdev), de->d_name);
+		closedir(dir);
+		if (!de || fsr_read_devno(path, &rdev) < 0)
+			break;
+	}
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/partition",
+		major(rdev), minor(rdev));
+	if (access(path, F_OK) == 0) {
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../dev",
+			major(rdev), minor(rdev));
+		fsr_read_devno(path, &rdev);
+	}
+	return rdev;
+}
+
 /*
  * initallfs -- read the mount table and set up an internal form
  */
@@ -814,6 +1241,11 @@ initallfs(char *mtab)
 
 		fs->dev = strdup(mp->mnt_fsname);
 		fs->mnt = strdup(mp->mnt_dir);
+		fs->npass = 0;
+		fs->disk = fsr_backing_disk(sb.st_rdev);
+		fs->pid = 0;
+		fs->started = 0;
+		fs->ckpt = NULL;
 
 		if (fs->dev == NULL) {
 			fsrprintf(_("strdup(%s) failed\n"), mp->mnt_fsname);
@@ -838,7 +1270,315 @@ initallfs(char *mtab)
 		           numfs);
 		if (dflag)
 			for (fs = fsbase; fs < fsend; fs++)
-			    fsrprintf("\t%-30.30s%-30.30s\n", fs->dev, fs->mnt);
+			    fsrprintf("\t%-30.30s%-30.30s%u:%u\n", fs->dev, fs->mnt,
+				      major(fs->disk), minor(fs->disk));
+	}
+}
+
+/*
+ * Pick the next filesystem to start a child on: round robin from 'fs',
+ * skipping filesystems that are already being worked on, have done all
+ * their passes, or share a backing disk with one being worked on.
+ */
+static fsdesc_t *
+fsrall_next(void)
+{
+	fsdesc_t	*fsp, *busy;
+	int		i;
+
+	for (i = 0; i < numfs; i++, fs++) {
+		if (fs >= fsend)
+			fs = fsbase;
+		if (fs->pid || fs->npass >= npasses)
+			continue;
+		for (busy = fsbase; busy < fsend; busy++)
+			if (busy->pid && busy->disk == fs->disk)
+				break;
+		if (busy < fsend)
+			continue;
+		fsp = fs++;
+		return fsp;
+	}
+	return NULL;
+}
+
+/*
+ * Wait for a child to finish, writing a checkpoint now and then while
+ * we wait.  Only a child that exits with status 0 has completed its
+ * pass.  One that ran out of time (status 1), failed, or was killed has
+ * left its progress in the shared checkpoint state, which is kept so
+ * the next run resumes where it stopped.
+ */
+static void
+fsrall_reap(void)
+{
+	fsdesc_t	*fsp;
+	pid_t		pid;
+	int		status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) == 0) {
+		if (time(0) >= nextckpt)
+			fsrall_checkpoint();
+		sleep(1);
+	}
+	if (pid < 0)
+		return;
+	for (fsp = fsbase; fsp < fsend; fsp++)
+		if (fsp->pid == pid)
+			break;
+	if (fsp == fsend)
+		return;
+
+	fsp->pid = 0;
+	fsp->ckpt->stats.seconds += time(0) - fsp->started;
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		fsp->npass++;
+		fsp->ckpt->startino = 0;
+		fsp->ckpt->target = 0;
+		fsp->ckpt->nbacklog = 0;
+		memset(fsp->ckpt->agdone, 0, sizeof(fsp->ckpt->agdone));
+	}
+	if (vflag)
+		fsrprintf(_("%s: pass %d, next inode %llu\n"), fsp->mnt,
+			  fsp->npass, (unsigned long long)fsp->ckpt->startino);
+}
+
+static int
+fsrall_running(void)
+{
+	fsdesc_t	*fsp;
+	int		running = 0;
+
+	for (fsp = fsbase; fsp < fsend; fsp++)
+		if (fsp->pid)
+			running++;
+	return running;
+}
+
+static fsdesc_t *
+fsrall_lookup(char *dev)
+{
+	fsdesc_t	*fsp;
+
+	for (fsp = fsbase; fsp < fsend; fsp++)
+		if (strcmp(dev, fsp->dev) == 0)
+			return fsp;
+	return NULL;
+}
+
+/*
+ * Read a checkpoint written by fsrall_checkpoint().  Every line starts
+ * with a keyword and the device it is about:
+ *
+ *	fs dev npass startino target
+ *	stats dev examined defragged clean nogain extents bytes seconds
+ *	ag dev agno done
+ *	cand dev ino benefit
+ *	chunk dev ino gen offset
+ *
+ * cand lines come best first.  Unknown lines are ignored.
+ */
+static fsdesc_t *
+fsrall_readckpt(FILE *fp)
+{
+	fsdesc_t	*fsp, *first = NULL;
+	struct fsr_ckpt	*cp;
+	struct fsr_ckpt_stats st;
+	char		buf[SMBUFSZ];
+	char		key[16];
+	char		dev[SMBUFSZ];
+	unsigned long long ino;
+	unsigned int	agno, done, gen;
+	long long	offset;
+	double		benefit;
+	int		npass, target;
+	int		n, i;
+
+	while (fgets(buf, SMBUFSZ, fp) != NULL) {
+		if (sscanf(buf, "%15s %1023s%n", key, dev, &n) < 2)
+			continue;
+		if ((fsp = fsrall_lookup(dev)) == NULL)
+			continue;
+		cp = fsp->ckpt;
+
+		if (strcmp(key, "fs") == 0) {
+			if (sscanf(buf + n, "%d %llu %d", &npass, &ino,
+				   &target) != 3)
+				continue;
+			fsp->npass = max(npass, 0);
+			cp->startino = ino;
+			cp->target = target;
+			if (!first)
+				first = fsp;
+		} else if (strcmp(key, "stats") == 0) {
+			if (sscanf(buf + n, "%llu %llu %llu %llu %llu %llu %llu",
+				   (unsigned long long *)&st.examined,
+				   (unsigned long long *)&st.defragged,
+				   (unsigned long long *)&st.clean,
+				   (unsigned long long *)&st.nogain,
+				   (unsigned long long *)&st.extents,
+				   (unsigned long long *)&st.bytes,
+				   (unsigned long long *)&st.seconds) == 7)
+				cp->stats = st;
+		} else if (strcmp(key, "ag") == 0) {
+			if (sscanf(buf + n, "%u %u", &agno, &done) == 2 &&
+			    agno < FSR_CKPT_MAXAG)
+				cp->agdone[agno] = done;
+		} else if (strcmp(key, "cand") == 0) {
+			if (sscanf(buf + n, "%llu %lf", &ino, &benefit) == 2 &&
+			    ino && cp->nbacklog < FSR_CKPT_BACKLOG) {
+				cp->backlog[cp->nbacklog].ino = ino;
+				cp->backlog[cp->nbacklog].benefit = benefit;
+				cp->nbacklog++;
+			}
+		} else if (strcmp(key, "chunk") == 0) {
+			if (sscanf(buf + n, "%llu %u %lld", &ino, &gen,
+				   &offset) != 3 || !ino || offset <= 0)
+				continue;
+			for (i = 0; i < FSR_CKPT_CHUNKS; i++) {
+				if (cp->chunks[i].ino)
+					continue;
+				cp->chunks[i].ino = ino;
+				cp->chunks[i].gen = gen;
+				cp->chunks[i].offset = offset;
+				break;
+			}
+		}
+	}
+	return first;
+}
+
+/*
+ * Read the leftoff file.  It is either a checkpoint, or the older format
+ * of one "dev npass ino" line per filesystem.  The oldest versions only
+ * wrote a line for the filesystem they stopped in, in which case the
+ * ones before it in the mount table have already done that pass.
+ */
+static void
+fsrall_readleftoff(int fd)
+{
+	FILE		*fp;
+	fsdesc_t	*fsp, *first = NULL;
+	char		buf[SMBUFSZ];
+	char		dev[SMBUFSZ];
+	unsigned long long ino;
+	int		npass;
+	int		nlines = 0;
+
+	if ((fp = fdopen(fd, "r")) == NULL) {
+		fsrprintf(_("could not read %s, starting with %s\n"),
+			leftofffile, fsbase->dev);
+		close(fd);
+		return;
+	}
+
+	buf[0] = '\0';
+	if (fgets(buf, SMBUFSZ, fp) != NULL &&
+	    strncmp(buf, FSR_CKPT_MAGIC, strlen(FSR_CKPT_MAGIC)) == 0) {
+		first = fsrall_readckpt(fp);
+	} else if (buf[0]) {
+		do {
+			ino = 0;
+			if (sscanf(buf, "%1023s %d %llu", dev, &npass,
+				   &ino) < 2)
+				continue;
+			nlines++;
+			if ((fsp = fsrall_lookup(dev)) == NULL)
+				continue;
+			fsp->npass = max(npass, 0);
+			fsp->ckpt->startino = ino;
+			if (!first)
+				first = fsp;
+		} while (fgets(buf, SMBUFSZ, fp) != NULL);
+	}
+	fclose(fp);
+
+	if (!first)
+		return;
+	fs = first;
+	startpass = first->npass;
+	if (nlines == 1) {
+		for (fsp = fsbase; fsp < first; fsp++)
+			fsp->npass = startpass + 1;
+		for (fsp = first + 1; fsp < fsend; fsp++)
+			fsp->npass = startpass;
+	}
+	for (fsp = fsbase; fsp < fsend; fsp++)
+		startpass = min(startpass, fsp->npass);
+}
+
+/*
+ * Write a checkpoint of every filesystem to the leftoff file.  It goes
+ * to a temporary file first and is renamed into place, so a crash
+ * leaves either the old checkpoint or the new one.
+ */
+static void
+fsrall_checkpoint(void)
+{
+	fsdesc_t	*fsp;
+	struct fsr_ckpt	*cp;
+	char		tmpfile[PATH_MAX];
+	FILE		*fp;
+	int		fd;
+	int		i;
+
+	nextckpt = time(0) + FSR_CKPT_INTERVAL;
+
+	snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", leftofffile);
+	unlink(tmpfile);
+	fd = open(tmpfile, O_WRONLY|O_CREAT|O_EXCL, 0644);
+	if (fd == -1 || (fp = fdopen(fd, "w")) == NULL) {
+		fsrprintf(_("open(%s) failed: %s\n"),
+			  tmpfile, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+
+	fprintf(fp, "%s\n", FSR_CKPT_MAGIC);
+	for (fsp = fsbase; fsp < fsend; fsp++) {
+		cp = fsp->ckpt;
+		fprintf(fp, "fs %s %d %llu %d\n", fsp->dev, fsp->npass,
+			(unsigned long long)cp->startino, cp->target);
+		fprintf(fp, "stats %s %llu %llu %llu %llu %llu %llu %llu\n",
+			fsp->dev,
+			(unsigned long long)cp->stats.examined,
+			(unsigned long long)cp->stats.defragged,
+			(unsigned long long)cp->stats.clean,
+			(unsigned long long)cp->stats.nogain,
+			(unsigned long long)cp->stats.extents,
+			(unsigned long long)cp->stats.bytes,
+			(unsigned long long)(cp->stats.seconds +
+				(fsp->pid ? time(0) - fsp->started : 0)));
+		for (i = 0; i < FSR_CKPT_MAXAG; i++)
+			if (cp->agdone[i])
+				fprintf(fp, "ag %s %d %u\n", fsp->dev, i,
+					cp->agdone[i]);
+		for (i = 0; i < cp->nbacklog; i++)
+			if (cp->backlog[i].ino)
+				fprintf(fp, "cand %s %llu %g\n", fsp->dev,
+					(unsigned long long)cp->backlog[i].ino,
+					cp->backlog[i].benefit);
+		for (i = 0; i < FSR_CKPT_CHUNKS; i++)
+			if (cp->chunks[i].ino && cp->chunks[i].offset)
+				fprintf(fp, "chunk %s %llu %u %lld\n", fsp->dev,
+					(unsigned long long)cp->chunks[i].ino,
+					cp->chunks[i].gen,
+					(long long)cp->chunks[i].offset);
+	}
+
+	if (fflush(fp) != 0 || fsync(fd) < 0) {
+		fsrprintf(_("write(%s) failed: %s\n"),
+			  tmpfile, strerror(errno));
+		fclose(fp);
+		unlink(tmpfile);
+		return;
+	}
+	fclose(fp);
+	if (rename(tmpfile, leftofffile) < 0) {
+		fsrprintf(_("rename(%s) failed: %s\n"),
+			  tmpfile, strerror(errno));
+		unlink(tmpfile);
 	}
 }
 
@@ -847,20 +1587,30 @@ fsrallfs(char *mtab, int howlong, char *leftofffile)
 {
 	int fd;
 	int error;
-	int found = 0;
-	char *fsname;
-	char buf[SMBUFSZ];
 	int mdonly = Mflag;
-	char *ptr;
-	xfs_ino_t startino = 0;
-	fsdesc_t *fsp;
+	int ngroups;
+	int nrun;
+	time_t slice;
+	fsdesc_t *fsp, *gp;
 	struct stat64 sb, sb2;
+	pid_t pid;
 
 	fsrprintf("xfs_fsr -m %s -t %d -f %s ...\n", mtab, howlong, leftofffile);
 
 	endtime = starttime + howlong;
 	fs = fsbase;
 
+	for (fsp = fsbase; fsp < fsend; fsp++) {
+		fsp->ckpt = mmap(NULL, sizeof(struct fsr_ckpt),
+				 PROT_READ|PROT_WRITE,
+				 MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		if (fsp->ckpt == MAP_FAILED) {
+			fsrprintf(_("couldn't map checkpoint: %s\n"),
+				  strerror(errno));
+			exit(1);
+		}
+	}
+
 	/* where'd we leave off last time? */
 	if (lstat64(leftofffile, &sb) == 0) {
 		if ( (fd = open(leftofffile, O_RDONLY)) == -1 ) {
@@ -896,53 +1646,39 @@ fsrallfs(char *mtab, int howlong, char *leftofffile)
 		fd = NULLFD;
 	}
 
-	if (fd != NULLFD) {
-		if (read(fd, buf, SMBUFSZ) == -1) {
-			fs = fsbase;
-			fsrprintf(_("could not read %s, starting with %s\n"),
-				leftofffile, *fs->dev);
-		} else {
-			/* Ensure the buffer we read is null terminated */
-			buf[SMBUFSZ-1] = '\0';
-			for (fs = fsbase; fs < fsend; fs++) {
-				fsname = fs->dev;
-				if ((strncmp(buf,fsname,strlen(fsname)) == 0)
-				    && buf[strlen(fsname)] == ' ') {
-					found = 1;
-					break;
-				}
-			}
-			if (! found)
-				fs = fsbase;
-
-			ptr = strchr(buf, ' ');
-			if (ptr) {
-				startpass = atoi(++ptr);
-				ptr = strchr(ptr, ' ');
-				if (ptr) {
-					startino = strtoull(++ptr, NULL, 10);
-				}
-			}
-			if (startpass < 0)
-				startpass = 0;
-
-			/* Init pass counts */
-			for (fsp = fsbase; fsp < fs; fsp++) {
-				fsp->npass = startpass + 1;
-			}
-			for (fsp = fs; fsp <= fsend; fsp++) {
-				fsp->npass = startpass;
-			}
-		}
-		close(fd);
-	}
+	if (fd != NULLFD)
+		fsrall_readleftoff(fd);
+	nextckpt = time(0) + FSR_CKPT_INTERVAL;
 
 	if (vflag) {
 		fsrprintf(_("START: pass=%d ino=%llu %s %s\n"),
-			  fs->npass, (unsigned long long)startino,
+			  fs->npass, (unsigned long long)fs->ckpt->startino,
 			  fs->dev, fs->mnt);
 	}
 
+	/*
+	 * Filesystems on independent disks are reorganized concurrently,
+	 * up to maxfs at a time.  Give each child a fair share of the
+	 * total time so that one filesystem can't eat the whole budget;
+	 * a filesystem whose share runs out picks up where it left off
+	 * on its next turn.
+	 */
+	ngroups = 0;
+	for (fsp = fsbase; fsp < fsend; fsp++) {
+		for (gp = fsbase; gp < fsp; gp++)
+			if (gp->disk == fsp->disk)
+				break;
+		if (gp == fsp)
+			ngroups++;
+	}
+	if (maxfs <= 0)
+		maxfs = max(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+	nrun = min(maxfs, ngroups);
+	slice = max((time_t)howlong * nrun / numfs, (time_t)60);
+	if (vflag || dflag)
+		fsrprintf(_("%d filesystems on %d disks, %d at a time, "
+			  "%d seconds each\n"), numfs, ngroups, nrun, (int)slice);
+
 	signal(SIGABRT, aborter);
 	signal(SIGHUP, aborter);
 	signal(SIGINT, aborter);
@@ -951,14 +1687,20 @@ fsrallfs(char *mtab, int howlong, char *leftofffile)
 
 	/* reorg for 'howlong' -- checked in 'fsrfs' */
 	while (endtime > time(0)) {
-		pid_t pid;
-		if (fs == fsend)
-			fs = fsbase;
-		if (fs->npass == npasses) {
+		if (fsrall_running() >= nrun) {
+			fsrall_reap();
+			continue;
+		}
+		fsp = fsrall_next();
+		if (fsp == NULL) {
+			if (fsrall_running()) {
+				fsrall_reap();
+				continue;
+			}
 			fsrprintf(_("Completed all %d passes\n"), npasses);
 			break;
 		}
-		if (npasses > 1 && !fs->npass)
+		if (npasses > 1 && !fsp->npass)
 			Mflag = 1;
 		else
 			Mflag = mdonly;
@@ -969,21 +1711,20 @@ fsrallfs(char *mtab, int howlong, char *leftofffile)
 			exit(1);
 			break;
 		case 0:
-			error = fsrfs(fs->mnt, startino, TARGETRANGE);
+			ckpt = fsp->ckpt;
+			fs = fsp;
+			endtime = min(endtime, time(0) + slice);
+			error = fsrfs(fsp->mnt, ckpt->startino, TARGETRANGE);
 			exit (error);
 			break;
 		default:
-			wait(&error);
-			if (WIFEXITED(error) && WEXITSTATUS(error) == 1) {
-				/* child timed out & did fsrall_cleanup */
-				exit(0);
-			}
+			fsp->pid = pid;
+			fsp->started = time(0);
 			break;
 		}
-		startino = 0;  /* reset after the first time through */
-		fs->npass++;
-		fs++;
 	}
+	while (fsrall_running())
+		fsrall_reap();
 	fsrall_cleanup(endtime <= time(0));
 }
 
@@ -993,1378 +1734,6080 @@ fsrallfs(char *mtab, int howlong, char *leftofffile)
 static void
 fsrall_cleanup(int timeout)
 {
-	int fd;
-	int ret;
-	char buf[SMBUFSZ];
+	int endpass;
+	fsdesc_t *fsp;
 
-	unlink(leftofffile);
+	/* children keep their progress in the shared checkpoint state */
+	if (ckpt)
+		return;
 
-	if (timeout) {
-		fsrprintf(_("%s startpass %d, endpass %d, time %d seconds\n"),
-			progname, startpass, fs->npass,
-			time(0) - endtime + howlong);
+	/* a single filesystem or file run keeps no checkpoint */
+	if (!fsbase)
+		return;
 
-		/* record where we left off */
-		fd = open(leftofffile, O_WRONLY|O_CREAT|O_EXCL, 0644);
-		if (fd == -1) {
-			fsrprintf(_("open(%s) failed: %s\n"),
-			          leftofffile, strerror(errno));
-		} else {
-			ret = sprintf(buf, "%s %d %llu\n", fs->dev,
-			        fs->npass, (unsigned long long)leftoffino);
-			if (write(fd, buf, ret) < strlen(buf))
-				fsrprintf(_("write(%s) failed: %s\n"),
-					leftofffile, strerror(errno));
-			close(fd);
+	/*
+	 * Every pass is done, so the next run starts over from the top.
+	 * Keep the per-filesystem totals and drop everything else.
+	 */
+	if (!timeout) {
+		for (fsp = fsbase; fsp < fsend; fsp++) {
+			struct fsr_ckpt_stats st = fsp->ckpt->stats;
+
+			memset(fsp->ckpt, 0, sizeof(struct fsr_ckpt));
+			fsp->ckpt->stats = st;
+			fsp->npass = 0;
 		}
+		fsrall_checkpoint();
+		return;
 	}
+
+	/* collect progress from children still running */
+	while (fsrall_running())
+		fsrall_reap();
+
+	endpass = fsbase->npass;
+	for (fsp = fsbase; fsp < fsend; fsp++)
+		endpass = min(endpass, fsp->npass);
+	fsrprintf(_("%s startpass %d, endpass %d, time %d seconds\n"),
+		progname, startpass, endpass,
+		time(0) - endtime + howlong);
+
+	fsrall_checkpoint();
 }
 
 /*
- * fsrfs -- reorganize a file system
+ * Candidate ranking.
+ *
+ * Rather than sorting each bulkstat batch on its own, fsrfs() first
+ * streams bulkstat over the whole filesystem and keeps the FSR_RANKMAX
+ * files with the best expected benefit in a min-heap, so the weakest
+ * candidate is always at the root and is the one to drop.  The defrag
+ * phase then sorts what is left and works through it best first.
+ *
+ * The benefit of a file is the number of extents a copy could save per
+ * byte that has to be moved, in the data and the attribute fork.
  */
+#define FSR_RANKMAX	(64 * 1024)
+#define FSR_RESCOREMIN	1024	/* candidates scored from block maps */
+#define FSR_AFORK_MIN	2	/* attribute extents worth a look */
+
+struct fsr_rank {
+	int		count;		/* entries in heap */
+	int		max;		/* size of heap */
+	__u64		seen;		/* candidates offered */
+	struct fsr_cand	*heap;
+};
+
 static int
-fsrfs(char *mntdir, xfs_ino_t startino, int targetrange)
+rank_init(struct fsr_rank *rp, int max)
 {
-
-	int	fsfd, fd;
-	int	count = 0;
-	int	ret;
-	__s32	buflenout;
-	xfs_bstat_t buf[GRABSZ];
-	char	fname[64];
-	char	*tname;
-	jdm_fshandle_t	*fshandlep;
-	xfs_ino_t	lastino = startino;
-
-	fsrprintf(_("%s start inode=%llu\n"), mntdir,
-		(unsigned long long)startino);
-
-	fshandlep = jdm_getfshandle( mntdir );
-	if ( ! fshandlep ) {
-		fsrprintf(_("unable to get handle: %s: %s\n"),
-		          mntdir, strerror( errno ));
+	rp->count = 0;
+	rp->max = max;
+	rp->seen = 0;
+	rp->heap = malloc(max * sizeof(struct fsr_cand));
+	if (!rp->heap) {
+		fsrprintf(_("malloc failed: %s\n"), strerror(errno));
 		return -1;
 	}
+	return 0;
+}
 
-	if ((fsfd = open(mntdir, O_RDONLY)) < 0) {
-		fsrprintf(_("unable to open: %s: %s\n"),
-		          mntdir, strerror( errno ));
-		free(fshandlep);
-		return -1;
-	}
+static void
+rank_free(struct fsr_rank *rp)
+{
+	free(rp->heap);
+	rp->heap = NULL;
+	rp->count = rp->max = 0;
+}
 
-	if (xfs_getgeom(fsfd, &fsgeom) < 0 ) {
-		fsrprintf(_("Skipping %s: could not get XFS geometry\n"),
-			  mntdir);
-		close(fsfd);
-		free(fshandlep);
-		return -1;
-	}
+static double
+rank_benefit(xfs_bstat_t *bs)
+{
+	__int64_t	bytes = (__int64_t)bs->bs_blksize * bs->bs_blocks;
 
-	tmp_init(mntdir);
+	if (bytes <= 0)
+		bytes = bs->bs_blksize;
+	return (double)(max(bs->bs_extents - 1, 0) +
+			max(bs->bs_aextents - 1, 0)) / bytes;
+}
 
-	while ((ret = xfs_bulkstat(fsfd,
-				&lastino, GRABSZ, &buf[0], &buflenout) == 0)) {
-		xfs_bstat_t *p;
-		xfs_bstat_t *endp;
+/*
+ * Is there anything in either fork that defragmenting could improve?
+ */
+static int
+rank_candidate(xfs_bstat_t *bs)
+{
+	return bs->bs_extents >= 2 || bs->bs_aextents >= FSR_AFORK_MIN;
+}
 
-		if (buflenout == 0)
-			goto out0;
-
-		/* Each loop through, defrag targetrange percent of the files */
-		count = (buflenout * targetrange) / 100;
-
-		qsort((char *)buf, buflenout, sizeof(struct xfs_bstat), cmp);
-
-		for (p = buf, endp = (buf + buflenout); p < endp ; p++) {
-			/* Do some obvious checks now */
-			if (((p->bs_mode & S_IFMT) != S_IFREG) ||
-			     (p->bs_extents < 2))
-				continue;
+static void
+rank_siftdown(struct fsr_rank *rp, int i)
+{
+	struct fsr_cand	tmp;
+	int		child;
 
-			fd = jdm_open(fshandlep, p, O_RDWR|O_DIRECT);
-			if (fd < 0) {
-				/* This probably means the file was
-				 * removed while in progress of handling
-				 * it.  Just quietly ignore this file.
-				 */
-				if (dflag)
-					fsrprintf(_("could not open: "
-						"inode %llu\n"), p->bs_ino);
-				continue;
-			}
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= rp->count)
+			break;
+		if (child + 1 < rp->count &&
+		    rp->heap[child + 1].benefit < rp->heap[child].benefit)
+			child++;
+		if (rp->heap[i].benefit <= rp->heap[child].benefit)
+			break;
+		tmp = rp->heap[i];
+		rp->heap[i] = rp->heap[child];
+		rp->heap[child] = tmp;
+		i = child;
+	}
+}
 
-			/* Don't know the pathname, so make up something */
-			sprintf(fname, "ino=%lld", (long long)p->bs_ino);
+static void
+rank_siftup(struct fsr_rank *rp, int i)
+{
+	struct fsr_cand	tmp;
+	int		parent;
 
-			/* Get a tmp file name */
-			tname = tmp_next(mntdir);
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (rp->heap[parent].benefit <= rp->heap[i].benefit)
+			break;
+		tmp = rp->heap[i];
+		rp->heap[i] = rp->heap[parent];
+		rp->heap[parent] = tmp;
+		i = parent;
+	}
+}
 
-			ret = fsrfile_common(fname, tname, mntdir, fd, p);
+/*
+ * Offer a candidate to the ranking.  It's kept if there is room or if
+ * it beats the weakest one ranked so far.
+ */
+static void
+rank_insert(struct fsr_rank *rp, xfs_ino_t ino, double benefit)
+{
+	struct fsr_cand	cand;
+
+	cand.ino = ino;
+	cand.benefit = benefit;
+	rp->seen++;
+
+	if (rp->count < rp->max) {
+		rp->heap[rp->count] = cand;
+		rank_siftup(rp, rp->count++);
+	} else if (cand.benefit > rp->heap[0].benefit) {
+		rp->heap[0] = cand;
+		rank_siftdown(rp, 0);
+	}
+}
 
-			leftoffino = p->bs_ino;
+static void
+rank_offer(struct fsr_rank *rp, xfs_bstat_t *bs)
+{
+	rank_insert(rp, bs->bs_ino, rank_benefit(bs));
+}
 
-			close(fd);
+/*
+ * To sort ranked candidates best first with qsort.
+ */
+static int
+rank_cmp(const void *s1, const void *s2)
+{
+	double	b1 = ((struct fsr_cand *)s1)->benefit;
+	double	b2 = ((struct fsr_cand *)s2)->benefit;
 
-			if (ret == 0) {
-				if (--count <= 0)
-					break;
-			}
-		}
-		if (endtime && endtime < time(0)) {
-			tmp_close(mntdir);
-			close(fsfd);
-			fsrall_cleanup(1);
-			exit(1);
-		}
-	}
-	if (ret < 0)
-		fsrprintf(_("%s: xfs_bulkstat: %s\n"), progname, strerror(errno));
-out0:
-	tmp_close(mntdir);
-	close(fsfd);
-	free(fshandlep);
-	return 0;
+	return (b1 < b2) - (b1 > b2);
 }
 
 /*
- * To compare bstat structs for qsort.
+ * Persistent per filesystem cache of what fsr found out about inodes.
+ *
+ * Most files on an archive filesystem don't change between runs, and
+ * there is no point opening and mapping them every night to learn again
+ * that they are fine.  The cache is a header followed by records sorted
+ * by inode number, mmap'ed read-only and searched with bsearch().  A
+ * record is only trusted while generation, ctime, size and extent count
+ * still match what bulkstat says, so any change to the file invalidates
+ * it without fsr having to notice.
+ *
+ * New records go to a shared log, since they come from the workers as
+ * well, and are merged into a new cache file which is renamed over the
+ * old one when the filesystem pass ends.
  */
-int
-cmp(const void *s1, const void *s2)
+static int
+cache_entcmp(const void *s1, const void *s2)
 {
-	return( ((xfs_bstat_t *)s2)->bs_extents -
-	        ((xfs_bstat_t *)s1)->bs_extents);
+	const struct fsr_cache_ent *e1 = s1;
+	const struct fsr_cache_ent *e2 = s2;
 
+	return (e1->ino > e2->ino) - (e1->ino < e2->ino);
 }
 
 /*
- * reorganize by directory hierarchy.
- * Stay in dev (a restriction based on structure of this program -- either
- * call efs_{n,u}mount() around each file, something smarter or this)
+ * To sort the log by inode with qsort, through an array of slot numbers
+ * so records of the same inode stay in the order they were made.
  */
+static int
+cache_logcmp(const void *s1, const void *s2)
+{
+	unsigned int	i1 = *(const unsigned int *)s1;
+	unsigned int	i2 = *(const unsigned int *)s2;
+	int		c;
+
+	c = cache_entcmp(&cache.log->ent[i1], &cache.log->ent[i2]);
+	return c ? c : (i1 > i2) - (i1 < i2);
+}
+
 static void
-fsrdir(char *dirname)
+cache_open(char *mntdir)
+{
+	struct fsr_cache_hdr *hdr;
+	struct stat64	sb;
+	char		*p;
+	int		fd;
+	int		i;
+
+	memset(&cache, 0, sizeof(cache));
+	p = cache.path + sprintf(cache.path, "%s.", _PATH_FSRCACHE);
+	for (i = 0; i < sizeof(fsgeom.uuid); i++)
+		p += sprintf(p, "%02x", fsgeom.uuid[i]);
+
+	cache.log = mmap(NULL, FSR_CACHE_LOGSIZE, PROT_READ|PROT_WRITE,
+			 MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (cache.log == MAP_FAILED) {
+		cache.log = NULL;
+		return;
+	}
+	cache.log->max = (FSR_CACHE_LOGSIZE - sizeof(*cache.log)) /
+			 sizeof(struct fsr_cache_ent);
+
+	if ((fd = open(cache.path, O_RDONLY)) < 0)
+		return;
+	if (fstat64(fd, &sb) < 0 || sb.st_size < sizeof(*hdr)) {
+		close(fd);
+		return;
+	}
+	hdr = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+		return;
+	if (memcmp(hdr->magic, FSR_CACHE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != FSR_CACHE_VERSION ||
+	    hdr->entsize != sizeof(struct fsr_cache_ent) ||
+	    sizeof(*hdr) + hdr->count * hdr->entsize > sb.st_size) {
+		if (dflag)
+			fsrprintf(_("ignoring bad cache file %s\n"),
+				  cache.path);
+		munmap(hdr, sb.st_size);
+		return;
+	}
+	cache.hdr = hdr;
+	cache.maplen = sb.st_size;
+	cache.ents = (struct fsr_cache_ent *)(hdr + 1);
+	cache.seen = calloc(hdr->count, 1);
+}
+
+static struct fsr_cache_ent *
+cache_lookup(xfs_bstat_t *bs)
 {
-	fsrprintf(_("%s: Directory defragmentation not supported\n"), dirname);
+	struct fsr_cache_ent key, *ce;
+
+	if (!cache.hdr)
+		return NULL;
+	key.ino = bs->bs_ino;
+	ce = bsearch(&key, cache.ents, cache.hdr->count,
+		     sizeof(struct fsr_cache_ent), cache_entcmp);
+	if (!ce)
+		return NULL;
+	if (cache.seen)
+		cache.seen[ce - cache.ents] = 1;
+	if (ce->gen != bs->bs_gen || ce->size != bs->bs_size ||
+	    ce->ctime != bs->bs_ctime.tv_sec ||
+	    ce->ctime_nsec != bs->bs_ctime.tv_nsec ||
+	    ce->extents != bs->bs_extents)
+		return NULL;
+	return ce;
 }
 
 /*
- * Sets up the defragmentation of a file based on the
- * filepath.  It collects the bstat information, does
- * an open on the file and passes this all to fsrfile_common.
+ * Can the scan drop this inode on the strength of an earlier run?
  */
 static int
-fsrfile(char *fname, xfs_ino_t ino)
+cache_skip(xfs_bstat_t *bs)
 {
-	xfs_bstat_t	statbuf;
-	jdm_fshandle_t	*fshandlep;
-	int	fd = -1, fsfd = -1;
-	int	error = -1;
-	char	*tname;
+	struct fsr_cache_ent *ce = cache_lookup(bs);
 
-	fshandlep = jdm_getfshandle(getparent (fname) );
-	if (!fshandlep) {
-		fsrprintf(_("unable to construct sys handle for %s: %s\n"),
-			fname, strerror(errno));
-		goto out;
+	if (!ce)
+		return 0;
+	switch (ce->outcome) {
+	case FSR_CACHE_CLEAN:
+		return 1;
+	case FSR_CACHE_NOGAIN:
+		/* free space changes, so try again now and then */
+		return time(0) - ce->stamp < FSR_CACHE_NOGAIN_AGE;
+	case FSR_CACHE_SCORED:
+		return ce->score <= 0 || ce->score < minscore;
 	}
+	return 0;
+}
 
-	/*
-	 * Need to open something on the same filesystem as the
-	 * file.  Open the parent.
-	 */
-	fsfd = open(getparent(fname), O_RDONLY);
-	if (fsfd < 0) {
-		fsrprintf(_("unable to open sys handle for %s: %s\n"),
-			fname, strerror(errno));
-		goto out;
-	}
+/*
+ * Record what we found out about a file.  Called from the workers too.
+ * Returns the new record, or NULL if there is no room for it.
+ */
+static struct fsr_cache_ent *
+cache_note(xfs_bstat_t *bs, int outcome, double score)
+{
+	struct fsr_cache_ent *ce;
+	unsigned int	slot;
+
+	if (!cache.log)
+		return NULL;
+	slot = __sync_fetch_and_add(&cache.log->count, 1);
+	if (slot >= cache.log->max)
+		return NULL;
+	ce = &cache.log->ent[slot];
+	ce->ino = bs->bs_ino;
+	ce->gen = bs->bs_gen;
+	ce->size = bs->bs_size;
+	ce->ctime = bs->bs_ctime.tv_sec;
+	ce->ctime_nsec = bs->bs_ctime.tv_nsec;
+	ce->extents = bs->bs_extents;
+	ce->outcome = outcome;
+	ce->score = score;
+	ce->stamp = time(0);
+	ce->maphash = 0;
+	return ce;
+}
 
-	if ((xfs_bulkstat_single(fsfd, &ino, &statbuf)) < 0) {
-		fsrprintf(_("unable to get bstat on %s: %s\n"),
-			fname, strerror(errno));
-		goto out;
+/*
+ * Merge the log into the old records and atomically replace the cache
+ * file.  The last record made for an inode replaces any older ones.  If
+ * the scan covered the whole filesystem, records of inodes it never saw
+ * belong to deleted files and are dropped.
+ */
+static void
+cache_save(int fullscan)
+{
+	struct fsr_cache_hdr hdr;
+	struct fsr_cache_ent *old = NULL, *new, *ce;
+	unsigned int	*order = NULL;
+	__u64		nold = 0, nnew = 0, i = 0, j = 0, count = 0;
+	char		tmppath[PATH_MAX];
+	FILE		*fp;
+
+	if (!cache.log)
+		return;
+	if (cache.hdr) {
+		old = cache.ents;
+		nold = cache.hdr->count;
 	}
-
-	fd = jdm_open(fshandlep, &statbuf, O_RDWR|O_DIRECT);
-	if (fd < 0) {
-		fsrprintf(_("unable to open handle %s: %s\n"),
-			fname, strerror(errno));
+	new = cache.log->ent;
+	nnew = min(cache.log->count, cache.log->max);
+	if (nnew && (order = malloc(nnew * sizeof(*order))) == NULL)
 		goto out;
-	}
+	for (j = 0; j < nnew; j++)
+		order[j] = j;
+	qsort(order, nnew, sizeof(*order), cache_logcmp);
+	j = 0;
 
-	/* Get the fs geometry */
-	if (xfs_getgeom(fsfd, &fsgeom) < 0 ) {
-		fsrprintf(_("Unable to get geom on fs for: %s\n"), fname);
+	sprintf(tmppath, "%s.tmp", cache.path);
+	if ((fp = fopen(tmppath, "w")) == NULL)
 		goto out;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, FSR_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = FSR_CACHE_VERSION;
+	hdr.entsize = sizeof(struct fsr_cache_ent);
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		goto out_unlink;
+
+	while (i < nold || j < nnew) {
+		if (j >= nnew || (i < nold && old[i].ino < new[order[j]].ino)) {
+			ce = &old[i++];
+			if (fullscan && cache.seen && !cache.seen[ce - old])
+				continue;
+		} else {
+			/* of several new records for an inode keep the last */
+			while (j + 1 < nnew &&
+			       new[order[j + 1]].ino == new[order[j]].ino)
+				j++;
+			while (i < nold && old[i].ino == new[order[j]].ino)
+				i++;
+			ce = &new[order[j++]];
+		}
+		if (fwrite(ce, sizeof(*ce), 1, fp) != 1)
+			goto out_unlink;
+		count++;
 	}
 
-	tname = gettmpname(fname);
+	hdr.count = count;
+	if (fseek(fp, 0, SEEK_SET) < 0 ||
+	    fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fflush(fp) != 0 || fsync(fileno(fp)) < 0)
+		goto out_unlink;
+	fclose(fp);
+	fp = NULL;
+	if (rename(tmppath, cache.path) < 0)
+		goto out_unlink;
+	if (dflag)
+		fsrprintf(_("cache %s: %llu records\n"), cache.path,
+			  (unsigned long long)count);
+	goto out;
+
+out_unlink:
+	fsrprintf(_("could not write cache %s: %s\n"), tmppath,
+		  strerror(errno));
+	if (fp)
+		fclose(fp);
+	unlink(tmppath);
+out:
+	free(order);
+	cache_close();
+}
 
-	if (tname)
-		error = fsrfile_common(fname, tname, NULL, fd, &statbuf);
+static void
+cache_close(void)
+{
+	if (cache.hdr)
+		munmap(cache.hdr, cache.maplen);
+	if (cache.log)
+		munmap(cache.log, FSR_CACHE_LOGSIZE);
+	free(cache.seen);
+	memset(&cache, 0, sizeof(cache));
+}
 
-out:
-	if (fsfd >= 0)
-		close(fsfd);
-	if (fd >= 0)
-		close(fd);
-	free(fshandlep);
+/*
+ * Fragmentation score: roughly the extra seeks needed to read 64MB of
+ * the file.  Every discontinuity is a seek, a jump to another AG is
+ * worth a few more, and long travel adds up too.  Dividing by the size
+ * lets a small file with ten scattered extents outrank a huge one with
+ * fifty extents a few megabytes apart.
+ */
+#define FSR_AGJUMP_SEEKS	4		/* cost of a jump to another AG */
+#define FSR_SEEK_SPAN		(1ULL << 30)	/* travel worth one more seek */
+#define FSR_SCORE_UNIT		(64ULL << 20)	/* bytes the score is per */
 
-	return error;
+static double
+fsr_score(struct fsr_layout *lp, __s64 size)
+{
+	double	seeks;
+
+	seeks = lp->ndisc + FSR_AGJUMP_SEEKS * lp->agjumps +
+		(double)BBTOB(lp->seekdist) / FSR_SEEK_SPAN;
+	if (size > FSR_SCORE_UNIT)
+		seeks = seeks * FSR_SCORE_UNIT / size;
+	return seeks;
 }
 
+/*
+ * Record the outcome of packfile() in both the cache and the checkpoint
+ * statistics.  'saved' is the number of extents the file lost.
+ */
+static void
+packfile_note(xfs_bstat_t *bs, int outcome, int saved)
+{
+	cache_note(bs, outcome, 0);
+	if (!ckpt)
+		return;
+	switch (outcome) {
+	case FSR_CACHE_CLEAN:
+		__sync_fetch_and_add(&ckpt->stats.clean, 1);
+		break;
+	case FSR_CACHE_NOGAIN:
+		__sync_fetch_and_add(&ckpt->stats.nogain, 1);
+		break;
+	case FSR_CACHE_DONE:
+		__sync_fetch_and_add(&ckpt->stats.defragged, 1);
+		__sync_fetch_and_add(&ckpt->stats.extents, saved);
+		__sync_fetch_and_add(&ckpt->stats.bytes, bs->bs_size);
+		break;
+	}
+}
 
 /*
- * This is the common defrag code for either a full fs
- * defragmentation or a single file.  Check as much as
- * possible with the file, fork a process to setuid to the
- * target file owner's uid and defragment the file.
- * This is done so the new extents created in a tmp file are
- * reflected in the owners' quota without having to do any
- * special code in the kernel.  When the existing extents
- * are removed, the quotas will be correct.  It's ugly but
- * it saves us from doing some quota  re-construction in
- * the extent swap.  The price is that the defragmentation
- * will fail if the owner of the target file is already at
- * their quota limit.
+ * The swap changed the ctime and extent count a cache record is checked
+ * against, so a record made from the bstat we started with would never
+ * match again.  Record the file as it is now.
  */
-static int
-fsrfile_common(
-	char		*fname,
-	char		*tname,
-	char		*fsname,
-	int		fd,
-	xfs_bstat_t	*statp)
+static void
+packfile_done(int fd, xfs_bstat_t *statp, int saved)
 {
-	int		error;
-	struct statvfs64 vfss;
-	struct fsxattr	fsx;
-	unsigned long	bsize;
+	xfs_bstat_t	bstat;
+	xfs_ino_t	ino = statp->bs_ino;
 
-	if(uflag)
-		fsrprintf("User has forced partial defragmentation on %s\n",fname);
+	if (xfs_bulkstat_single(fd, &ino, &bstat) < 0)
+		bstat = *statp;
+	packfile_note(&bstat, FSR_CACHE_DONE, saved);
+}
 
-	if (vflag)
-		fsrprintf("%s\n", fname);
+/*
+ * Cross a candidate off the checkpoint backlog once it has been looked
+ * at, so a run resuming from the checkpoint doesn't do it again.
+ */
+static void
+ckpt_done(xfs_ino_t ino)
+{
+	xfs_agnumber_t	agno;
+	int		i;
 
-	if (fsync(fd) < 0) {
-		fsrprintf(_("sync failed: %s: %s\n"), fname, strerror(errno));
-		return -1;
+	if (!ckpt)
+		return;
+	__sync_fetch_and_add(&ckpt->stats.examined, 1);
+	agno = fsr_ino_to_agno(ino);
+	if (agno < FSR_CKPT_MAXAG)
+		__sync_fetch_and_add(&ckpt->agdone[agno], 1);
+	for (i = 0; i < ckpt->nbacklog; i++) {
+		if (ckpt->backlog[i].ino == ino) {
+			ckpt->backlog[i].ino = 0;
+			break;
+		}
 	}
+}
 
-	if (statp->bs_size == 0) {
-		if (vflag)
-			fsrprintf(_("%s: zero size, ignoring\n"), fname);
-		return(0);
-	}
+/*
+ * Save the best 'n' ranked candidates in the checkpoint.  From here on a
+ * run that is cut short resumes with what is left of them rather than
+ * scanning the filesystem again.
+ */
+static void
+ckpt_save_rank(struct fsr_rank *rp, int n)
+{
+	if (!ckpt)
+		return;
+	n = min(n, FSR_CKPT_BACKLOG);
+	ckpt->nbacklog = 0;
+	memcpy(ckpt->backlog, rp->heap, n * sizeof(struct fsr_cand));
+	ckpt->nbacklog = n;
+	ckpt->startino = 0;
+	memset(ckpt->agdone, 0, sizeof(ckpt->agdone));
+}
 
-	/* Check if a mandatory lock is set on the file to try and
-	 * avoid blocking indefinitely on the reads later. Note that
-	 * someone could still set a mandatory lock after this check
-	 * but before all reads have completed to block fsr reads.
-	 * This change just closes the window a bit.
-	 */
-	if ( (statp->bs_mode & S_ISGID) && ( ! (statp->bs_mode&S_IXGRP) ) ) {
-		struct flock fl;
+/*
+ * The scan ran out of time before reaching 'lastino'.  Save the best of
+ * what it ranked so far, so the next run's scan carries on from there
+ * with them instead of losing them.  This reorders rp.
+ */
+static void
+ckpt_save_partial(struct fsr_rank *rp, xfs_ino_t lastino)
+{
+	int	n;
+
+	if (!ckpt)
+		return;
+	qsort(rp->heap, rp->count, sizeof(struct fsr_cand), rank_cmp);
+	n = min(rp->count, FSR_CKPT_BACKLOG);
+	ckpt->nbacklog = 0;
+	memcpy(ckpt->backlog, rp->heap, n * sizeof(struct fsr_cand));
+	ckpt->nbacklog = n;
+	ckpt->startino = lastino;
+}
 
-		fl.l_type = F_RDLCK;
-		fl.l_whence = SEEK_SET;
-		fl.l_start = (off_t)0;
-		fl.l_len = 0;
-		if ((fcntl(fd, F_GETLK, &fl)) < 0 ) {
-			if (vflag)
-				fsrprintf(_("locking check failed: %s\n"),
-					fname);
-			return(-1);
-		}
-		if (fl.l_type != F_UNLCK) {
-			/* Mandatory lock is set */
-			if (vflag)
-				fsrprintf(_("mandatory lock: %s: ignoring\n"),
-					fname);
-			return(-1);
+/*
+ * Load the candidates left over from an interrupted pass into 'rp'.
+ * If that pass had finished ranking, returns how many of them still
+ * want doing.  If it ran out of time while ranking, they seed the
+ * ranking the scan carries on with and 0 is returned.
+ */
+static int
+ckpt_resume(struct fsr_rank *rp)
+{
+	int	i;
+
+	if (!ckpt)
+		return 0;
+	rp->count = rp->seen = 0;
+	for (i = 0; i < ckpt->nbacklog; i++)
+		if (ckpt->backlog[i].ino)
+			rank_insert(rp, ckpt->backlog[i].ino,
+				    ckpt->backlog[i].benefit);
+	if (ckpt->startino || rp->count == 0)
+		return 0;
+	return min(rp->count, max(ckpt->target, 1));
+}
+
+/*
+ * The ranking only had bulkstat to go on.  Look at the block maps of the
+ * best n candidates, score them, and reorder those by score.  Files that
+ * fall under -S are dropped here so they don't take a worker's time.
+ */
+static void
+rank_rescore(int fsfd, jdm_fshandle_t *fshandlep, struct fsr_rank *rp, int n)
+{
+	struct fsr_layout layout;
+	struct fsr_cache_ent *ce;
+	xfs_bstat_t	bstat;
+	xfs_ino_t	ino;
+	int		fd;
+	int		i, j;
+	int		anextents, andisc;
+
+	for (i = j = 0; i < n; i++) {
+		ino = rp->heap[i].ino;
+		if (xfs_bulkstat_single(fsfd, &ino, &bstat) < 0)
+			continue;
+		if ((ce = cache_lookup(&bstat)) &&
+		    ce->outcome == FSR_CACHE_SCORED) {
+			rp->heap[i].benefit = ce->score;
+		} else {
+			if ((fd = jdm_open(fshandlep, &bstat, O_RDONLY)) < 0)
+				continue;
+			if (fsr_layout(fd, &layout) < 0) {
+				close(fd);
+				continue;
+			}
+			rp->heap[i].benefit = fsr_score(&layout,
+							bstat.bs_size);
+			/* every attribute lookup pays for these in full */
+			if (bstat.bs_aextents >= FSR_AFORK_MIN &&
+			    fsr_attr_layout(fd, &anextents, &andisc) == 0)
+				rp->heap[i].benefit += andisc;
+			close(fd);
+			cache_note(&bstat, FSR_CACHE_SCORED,
+				   rp->heap[i].benefit);
 		}
+		if (rp->heap[i].benefit <= 0 || rp->heap[i].benefit < minscore)
+			continue;
+		rp->heap[j++] = rp->heap[i];
 	}
 
-	/*
-	 * Check if there is room to copy the file.
-	 *
-	 * Note that xfs_bstat.bs_blksize returns the filesystem blocksize,
-	 * not the optimal I/O size as struct stat.
-	 */
-	if (statvfs64(fsname ? fsname : fname, &vfss) < 0) {
-		fsrprintf(_("unable to get fs stat on %s: %s\n"),
-			fname, strerror(errno));
-		return -1;
-	}
-	bsize = vfss.f_frsize ? vfss.f_frsize : vfss.f_bsize;
-	
-	freesp = vfss.f_bfree * bsize - minimumfree;
+	/* keep the unscored tail behind the scored head */
+	memmove(&rp->heap[j], &rp->heap[n],
+		(rp->count - n) * sizeof(struct fsr_cand));
+	rp->count -= n - j;
+	qsort(rp->heap, j, sizeof(struct fsr_cand), rank_cmp);
+}
 
-	if (statp->bs_blksize * statp->bs_blocks >
-	    vfss.f_bfree * bsize - minimumfree) {
-		if(uflag)								
-		{	
-		 fsrprintf("Free Space: freesp = %lld bytes\n",freesp);							
-		 fsrprintf("File Size: statp->bs_size = %lld bytes\n",statp->bs_size);	
-		 fsrprintf("Insufficent free space to defragment ENTIRE file: %s\n", fname);
-		}										
-		else
-		{										
-		fsrprintf(_("insufficient freespace for: %s: "
-			    "size=%lld: ignoring\n"), fname,
-			    statp->bs_blksize * statp->bs_blocks);
-		return 1;
-		}									
-	}
+/*
+ * Defragment a single inode found by the filesystem walk.
+ */
+static int
+fsrfs_one(jdm_fshandle_t *fshandlep, char *mntdir, xfs_bstat_t *p)
+{
+	int	fd;
+	int	ret;
+	char	fname[64];
+	char	*tname;
 
-	if ((ioctl(fd, XFS_IOC_FSGETXATTR, &fsx)) < 0) {
-		fsrprintf(_("failed to get inode attrs: %s\n"), fname);
-		return(-1);
-	}
-	if (fsx.fsx_xflags & (XFS_XFLAG_IMMUTABLE|XFS_XFLAG_APPEND)) {
-		if (vflag)
-			fsrprintf(_("%s: immutable/append, ignoring\n"), fname);
-		return(0);
-	}
-	if (fsx.fsx_xflags & XFS_XFLAG_NODEFRAG) {
-		if (vflag)
-			fsrprintf(_("%s: marked as don't defrag, ignoring\n"),
-			    fname);
-		return(0);
+	fd = jdm_open(fshandlep, p, O_RDWR|O_DIRECT);
+	if (fd < 0) {
+		/* This probably means the file was
+		 * removed while in progress of handling
+		 * it.  Just quietly ignore this file.
+		 */
+		if (dflag)
+			fsrprintf(_("could not open: "
+				"inode %llu\n"), p->bs_ino);
+		return -1;
 	}
-	if (fsx.fsx_xflags & XFS_XFLAG_REALTIME) {
-		if (xfs_getrt(fd, &vfss) < 0) {
-			fsrprintf(_("cannot get realtime geometry for: %s\n"),
-				fname);
-			return(-1);
+
+	/* Don't know the pathname, so make up something */
+	sprintf(fname, "ino=%lld", (long long)p->bs_ino);
+
+	/* Get a tmp file name */
+	tname = tmp_place(mntdir, p);
+
+	ret = fsrfile_common(fname, tname, mntdir, fd, p, NULL);
+	ckpt_done(p->bs_ino);
+
+	close(fd);
+	return ret;
+}
+
+/*
+ * Take the next inode for worker 'id', stealing from the fullest other
+ * queue if its own is empty.  Returns 0 once there is nothing left to do.
+ */
+static int
+workq_get(struct fsr_workq *wqp, int id, xfs_bstat_t *bs)
+{
+	struct fsr_wq	*q;
+	int		i, victim;
+
+	pthread_mutex_lock(&wqp->lock);
+	wqp->wq[id].busy = 0;
+	for (;;) {
+		if (endtime && endtime < time(0))
+			wqp->stop = 1;
+		if (wqp->stop)
+			break;
+
+		victim = id;
+		if (wqp->wq[id].count == 0) {
+			for (i = 0; i < wqp->nworkers; i++)
+				if (wqp->wq[i].count > wqp->wq[victim].count)
+					victim = i;
 		}
-		if (statp->bs_size > ((vfss.f_bfree * bsize) - minimumfree)) {
-			fsrprintf(_("low on realtime free space: %s: "
-				"ignoring file\n"), fname);
-			return(-1);
+		q = &wqp->wq[victim];
+		if (q->count) {
+			*bs = q->bs[q->head];
+			q->head = (q->head + 1) % FSR_WQ_DEPTH;
+			q->count--;
+			wqp->wq[id].busy = bs->bs_ino;
+			pthread_cond_broadcast(&wqp->room);
+			pthread_mutex_unlock(&wqp->lock);
+			if (dflag && victim != id)
+				fsrprintf(_("worker %d: took inode %llu from "
+					"worker %d\n"), id,
+					(unsigned long long)bs->bs_ino, victim);
+			return 1;
 		}
+		if (wqp->done)
+			break;
+		pthread_cond_wait(&wqp->work, &wqp->lock);
 	}
+	pthread_cond_broadcast(&wqp->room);
+	pthread_mutex_unlock(&wqp->lock);
+	return 0;
+}
 
-	if ((RealUid != ROOT) && (RealUid != statp->bs_uid)) {
-		fsrprintf(_("cannot open: %s: Permission denied\n"), fname);
+/*
+ * Queue an inode to the worker owning its AG, waiting for room.
+ * Returns -1 if the workers have been told to stop.
+ */
+static int
+workq_put(struct fsr_workq *wqp, xfs_bstat_t *bs)
+{
+	struct fsr_wq	*q;
+
+	q = &wqp->wq[fsr_ino_to_agno(bs->bs_ino) % wqp->nworkers];
+
+	pthread_mutex_lock(&wqp->lock);
+	while (q->count == FSR_WQ_DEPTH && !wqp->stop)
+		pthread_cond_wait(&wqp->room, &wqp->lock);
+	if (wqp->stop) {
+		pthread_mutex_unlock(&wqp->lock);
 		return -1;
 	}
+	q->bs[(q->head + q->count) % FSR_WQ_DEPTH] = *bs;
+	q->count++;
+	pthread_cond_broadcast(&wqp->work);
+	pthread_mutex_unlock(&wqp->lock);
+	return 0;
+}
 
-	/*
-	 * Previously the code forked here, & the child changed it's uid to
-	 * that of the file's owner and then called packfile(), to keep
-	 * quota counts correct.  (defragged files could use fewer blocks).
-	 *
-	 * Instead, just fchown() the temp file to the uid,gid of the
-	 * file we're defragging, in packfile().
-	 */
+/*
+ * Work out where to restart the inode walk: just before the lowest inode
+ * that is still queued or being worked on, or at 'lastino' if the
+ * workers have caught up with the walk.
+ */
+static xfs_ino_t
+workq_leftoff(struct fsr_workq *wqp, xfs_ino_t lastino)
+{
+	struct fsr_wq	*q;
+	xfs_ino_t	low = 0;
+	int		i, j;
+
+	pthread_mutex_lock(&wqp->lock);
+	for (i = 0; i < wqp->nworkers; i++) {
+		q = &wqp->wq[i];
+		if (q->busy && (!low || q->busy < low))
+			low = q->busy;
+		for (j = 0; j < q->count; j++) {
+			xfs_ino_t ino = q->bs[(q->head + j) % FSR_WQ_DEPTH].bs_ino;
+
+			if (!low || ino < low)
+				low = ino;
+		}
+	}
+	pthread_mutex_unlock(&wqp->lock);
 
-	if ((error = packfile(fname, tname, fd, statp, &fsx)))
-		return error;
-	return -1; /* no error */
+	return low ? low - 1 : lastino;
+}
+
+static void
+fsr_worker(int id, char *mntdir, jdm_fshandle_t *fshandlep)
+{
+	xfs_bstat_t	bs;
+
+	/* the parent records where we left off, not us */
+	signal(SIGABRT, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGQUIT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+
+	/* keep our temp files in the AGs we own */
+	worker_id = id;
+	tmp_agi = id;
+	tmp_agstep = workq->nworkers;
+
+	while (workq_get(workq, id, &bs))
+		fsrfs_one(fshandlep, mntdir, &bs);
+	swapq_flush();
+	exit(0);
 }
 
 /*
- * Attempt to set the attr fork up correctly. This is simple for attr1
- * filesystems as they have a fixed inode fork offset. In that case
- * just create an attribute and that's all we need to do.
- *
- * For attr2 filesystems, see if we have the actual fork offset in
- * the bstat structure. If so, just create additional attributes on
- * the temporary inode until the offset matches.
- *
- * If it doesn't exist, we can only do best effort. Add an attribute at a time
- * to move the inode fork around, but take into account that the attribute
- * might be too small to move the fork every time we add one.  This should
- * hopefully put the fork offset in the right place. It's not a big deal if we
- * don't get it right - the kernel will reject it when we try to swap extents.
+ * Set up the shared queues and fork the workers.  Returns the number of
+ * workers started; 0 means defragment in this process instead.
  */
 static int
-fsr_setup_attr_fork(
-	int		fd,
-	int		tfd,
-	xfs_bstat_t	*bstatp)
+workq_start(char *mntdir, jdm_fshandle_t *fshandlep)
 {
-	struct stat64	tstatbuf;
-	int		i;
-	int		diff = 0;
-	int		last_forkoff = 0;
-	int		no_change_cnt = 0;
-	int		ret;
+	pthread_mutexattr_t	mattr;
+	pthread_condattr_t	cattr;
+	size_t			size;
+	int			n, i;
 
-	if (!(bstatp->bs_xflags & XFS_XFLAG_HASATTR))
+	n = min(nworkers, fsgeom.agcount);
+	if (n < 2)
 		return 0;
 
-	/*
-	 * use the old method if we have attr1 or the kernel does not yet
-	 * support passing the fork offset in the bulkstat data.
-	 */
-	if (!(fsgeom.flags & XFS_FSOP_GEOM_FLAGS_ATTR2) ||
-	    bstatp->bs_forkoff == 0) {
-		/* attr1 */
-		ret = fsetxattr(tfd, "user.X", "X", 1, XATTR_CREATE);
-		if (ret) {
-			fsrprintf(_("could not set ATTR\n"));
-			return -1;
+	size = sizeof(struct fsr_workq) + n * sizeof(struct fsr_wq);
+	workq_size = size;
+	workq = mmap(NULL, size, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (workq == MAP_FAILED) {
+		fsrprintf(_("could not map work queues: %s\n"),
+			strerror(errno));
+		workq = NULL;
+		return 0;
+	}
+	memset(workq, 0, size);
+	workq->nworkers = n;
+
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+	pthread_mutex_init(&workq->lock, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+	pthread_cond_init(&workq->work, &cattr);
+	pthread_cond_init(&workq->room, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	for (i = 0; i < n; i++) {
+		workq->pid[i] = fork();
+		switch (workq->pid[i]) {
+		case -1:
+			fsrprintf(_("couldn't fork worker %d: %s\n"),
+				i, strerror(errno));
+			if (i == 0) {
+				munmap(workq, workq_size);
+				workq = NULL;
+				return 0;
+			}
+			/* run with the workers we have */
+			workq->nworkers = i;
+			return i;
+		case 0:
+			fsr_worker(i, mntdir, fshandlep);
+			/* NOTREACHED */
+		default:
+			break;
 		}
-		goto out;
 	}
 
-	/* attr2 w/ fork offsets */
+	if (vflag)
+		fsrprintf(_("%s: started %d defrag workers\n"), mntdir, n);
+	return n;
+}
 
-	if (fstat64(tfd, &tstatbuf) < 0) {
-		fsrprintf(_("unable to stat temp file: %s\n"),
-					strerror(errno));
-		return -1;
-	}
+/*
+ * Let the workers drain their queues (or, if 'stop' is set, finish only
+ * the file they are on), reap them and tear down the queues.  Returns
+ * the inode to restart the walk from.
+ */
+static xfs_ino_t
+workq_finish(int stop, xfs_ino_t lastino)
+{
+	struct fsr_workq	*wqp = workq;
+	xfs_ino_t		ino;
+	int			i, status;
+
+	pthread_mutex_lock(&wqp->lock);
+	wqp->done = 1;
+	if (stop)
+		wqp->stop = 1;
+	pthread_cond_broadcast(&wqp->work);
+	pthread_cond_broadcast(&wqp->room);
+	pthread_mutex_unlock(&wqp->lock);
+
+	for (i = 0; i < wqp->nworkers; i++)
+		waitpid(wqp->pid[i], &status, 0);
+
+	ino = workq_leftoff(wqp, lastino);
+	workq = NULL;
+	munmap(wqp, workq_size);
+	return ino;
+}
 
-	i = 0;
-	do {
-		xfs_bstat_t	tbstat;
-		xfs_ino_t	ino;
-		char		name[64];
+/*
+ * Report what the per filesystem counters saved and release them.
+ */
+static void
+fsrfs_report(char *mntdir)
+{
+	if (!fsstats)
+		return;
+	if (fsstats->contig_files)
+		fsrprintf(_("%s: skipped %llu physically contiguous files, "
+			"%llu MB not copied\n"), mntdir,
+			(unsigned long long)fsstats->contig_files,
+			(unsigned long long)fsstats->contig_bytes >> 20);
+	munmap(fsstats, sizeof(*fsstats));
+	fsstats = NULL;
+}
 
-		/*
-		 * bulkstat the temp inode to see what the forkoff is.  Use
-		 * this to compare against the target and determine what we
-		 * need to do.
-		 */
-		ino = tstatbuf.st_ino;
-		if ((xfs_bulkstat_single(tfd, &ino, &tbstat)) < 0) {
-			fsrprintf(_("unable to get bstat on temp file: %s\n"),
-						strerror(errno));
-			return -1;
-		}
-		if (dflag)
-			fsrprintf(_("orig forkoff %d, temp forkoff %d\n"),
-					bstatp->bs_forkoff, tbstat.bs_forkoff);
-		diff = tbstat.bs_forkoff - bstatp->bs_forkoff;
+/*
+ * Scan pipeline.
+ *
+ * Enumerating a large filesystem takes long enough that the disks
+ * should not sit idle while it runs.  A producer thread streams
+ * bulkstat into a small ring of batches, growing the batch size while
+ * calls come back quickly and shrinking it when they don't.  A
+ * classifier thread drops what cannot or need not be defragmented,
+ * using only the bulkstat record (bs_xflags carries the same flags
+ * FSGETXATTR would), and ranks the rest.  Meanwhile fsrfs() hands the
+ * best candidate found so far to any worker that has nothing to do, as
+ * long as that stays within targetrange percent of the files seen.
+ */
+#define FSR_SCAN_NBATCH		4	/* bulkstat batches in flight */
+#define FSR_SCAN_MAXGRAB	8192	/* largest batch */
+#define FSR_SCAN_FASTCALL	20	/* ms, quicker calls grow the batch */
+#define FSR_SCAN_SLOWCALL	200	/* ms, slower calls shrink it */
+
+struct fsr_scanbatch {
+	xfs_bstat_t	*bs;
+	int		count;
+	xfs_ino_t	lastino;	/* bulkstat cursor after this batch */
+};
 
-		/* if they are equal, we are done */
-		if (!diff)
-			goto out;
+struct fsr_scan {
+	pthread_mutex_t	lock;		/* also protects the ranking */
+	pthread_cond_t	full;		/* a batch was produced */
+	pthread_cond_t	empty;		/* a batch was consumed */
+	pthread_cond_t	ranked;		/* candidates ranked, or scan over */
+	struct fsr_scanbatch batch[FSR_SCAN_NBATCH];
+	int		head;
+	int		count;		/* batches waiting to be classified */
+	int		eof;		/* producer finished */
+	int		done;		/* classifier finished */
+	int		stop;		/* out of time */
+	int		error;		/* errno of a failed bulkstat */
+	int		fsfd;
+	xfs_ino_t	cursor;		/* bulkstat cursor, producer only */
+	xfs_ino_t	ranked_ino;	/* everything before this is ranked */
+	struct fsr_rank	*rank;
+};
 
-		snprintf(name, sizeof(name), "user.%d", i);
+static long
+fsrscan_ms(void)
+{
+	struct timespec	ts;
 
-		/*
-		 * If there is no attribute, then we need to create one to get
-		 * an attribute fork at the default location.
-		 */
-		if (!tbstat.bs_forkoff) {
-			ASSERT(i == 0);
-			ret = fsetxattr(tfd, name, "XX", 2, XATTR_CREATE);
-			if (ret) {
-				fsrprintf(_("could not set ATTR\n"));
-				return -1;
-			}
-			continue;
-		} else if (i == 0) {
-			struct fsxattr	fsx;
-			/*
-			 * First pass, and temp file already has an inline
-			 * xattr, probably due to selinux.
-			 *
-			 * It's *possible* that the temp file attr area
-			 * is larger than the target file's, if the 
-			 * target file's attrs are not inline:
-			 *
-			 *  Target		 Temp
-			 * +-------+ 0		+-------+ 0
-			 * |	   |		|       |
-			 * |	   |		| Data  |
-			 * | Data  |		|       |
-			 * |	   |		v-------v forkoff
-			 * |	   |		|       |
-			 * v-------v forkoff	| Attr  | local
-			 * | Attr  | ext/btree	|       |
-			 * +-------+		+-------+
-			 *
-			 * FSGETXATTRA will tell us nr of attr extents in
-			 * target, if any.  If none, it's local:
-			 */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-			memset(&fsx, 0, sizeof(fsx));
-			if (ioctl(fd, XFS_IOC_FSGETXATTRA, &fsx)) {
-				fsrprintf(_("FSGETXATTRA failed on target\n"));
-				return -1;
-			}
+static void *
+fsrscan_producer(void *arg)
+{
+	struct fsr_scan	*sp = arg;
+	struct fsr_scanbatch *b;
+	__s32		buflenout;
+	long		t;
+	int		grab = GRABSZ;
+	int		waited;
+	int		ret;
 
-			/*
-			 * If target attr area is less than the temp's (diff < 0)
-			 * and the target is not local, write a big attr to
-			 * the temp file to knock the attr out of local format,
-			 * to match the target.  (This should actually *increase*
-			 * the temp file's forkoffset when the attr moves out
-			 * of the inode)
-			 */
- 			if (diff < 0 && fsx.fsx_nextents > 0) {
-				char val[2048];
-				memset(val, 'X', 2048);
-				if (fsetxattr(tfd, name, val, 2048, 0)) {
-					fsrprintf(_("big ATTR set failed\n"));
-					return -1;
-				}
-				/* Go back & see where we're at now */
-				continue;
-			}
+	for (;;) {
+		pthread_mutex_lock(&sp->lock);
+		waited = 0;
+		while (sp->count == FSR_SCAN_NBATCH && !sp->stop) {
+			pthread_cond_wait(&sp->empty, &sp->lock);
+			waited = 1;
 		}
+		if (sp->stop) {
+			pthread_mutex_unlock(&sp->lock);
+			break;
+		}
+		b = &sp->batch[(sp->head + sp->count) % FSR_SCAN_NBATCH];
+		pthread_mutex_unlock(&sp->lock);
 
 		/*
-		 * make a progress check so we don't get stuck trying to extend
-		 * a large btree form attribute fork.
+		 * Bigger batches save system calls, but only help while
+		 * the classifier keeps up with us.
 		 */
-		if (last_forkoff == tbstat.bs_forkoff) {
-			if (no_change_cnt++ > 10)
-				break;
-		} else /* progress! */
-			no_change_cnt = 0;
-		last_forkoff = tbstat.bs_forkoff;
-
-		/* work out which way to grow the fork */
-		if (abs(diff) > fsgeom.inodesize - sizeof(struct xfs_dinode)) {
-			fsrprintf(_("forkoff diff %d too large!\n"), diff);
-			return -1;
-		}
-
-		/*
-		 * if the temp inode fork offset is still smaller then we have
-		 * to grow the data fork
-		 */
-		if (diff < 0) {
-			/*
-			 * create some temporary extents in the inode to move
-			 * the fork in the direction we need. This can be done
-			 * by preallocating some single block extents at
-			 * non-contiguous offsets.
-			 */
-			/* XXX: unimplemented! */
-			if (dflag)
-				printf(_("data fork growth unimplemented\n"));
-			goto out;
+		t = fsrscan_ms();
+		ret = xfs_bulkstat(sp->fsfd, &sp->cursor, grab, b->bs,
+				   &buflenout);
+		t = fsrscan_ms() - t;
+		if (ret < 0) {
+			sp->error = errno;
+			break;
 		}
+		if (buflenout == 0)
+			break;
+		if (t < FSR_SCAN_FASTCALL && !waited)
+			grab = min(grab * 2, FSR_SCAN_MAXGRAB);
+		else if (t > FSR_SCAN_SLOWCALL)
+			grab = max(grab / 2, GRABSZ);
+
+		b->count = buflenout;
+		b->lastino = sp->cursor;
+		pthread_mutex_lock(&sp->lock);
+		sp->count++;
+		if (endtime && endtime < time(0))
+			sp->stop = 1;
+		pthread_cond_signal(&sp->full);
+		pthread_mutex_unlock(&sp->lock);
+	}
 
-		/* we need to grow the attr fork, so create another attr */
-		ret = fsetxattr(tfd, name, "XX", 2, XATTR_CREATE);
-		if (ret) {
-			fsrprintf(_("could not set ATTR\n"));
-			return -1;
-		}
+	pthread_mutex_lock(&sp->lock);
+	sp->eof = 1;
+	pthread_cond_signal(&sp->full);
+	pthread_mutex_unlock(&sp->lock);
+	return NULL;
+}
 
-	} while (++i < 100); /* don't go forever */
+static void *
+fsrscan_classifier(void *arg)
+{
+	struct fsr_scan	*sp = arg;
+	struct fsr_scanbatch *b;
+	xfs_bstat_t	*p, *endp;
+
+	pthread_mutex_lock(&sp->lock);
+	for (;;) {
+		while (!sp->count && !sp->eof)
+			pthread_cond_wait(&sp->full, &sp->lock);
+		if (!sp->count)
+			break;
+		b = &sp->batch[sp->head];
+		pthread_mutex_unlock(&sp->lock);
 
-out:
-	if (dflag)
-		fsrprintf(_("set temp attr\n"));
-	/* We failed to resolve the fork difference */
-	if (dflag && diff)
-		fsrprintf(_("failed to match fork offset\n"));;
+		for (p = b->bs, endp = b->bs + b->count; p < endp; p++) {
+			/* Do some obvious checks now */
+			if (((p->bs_mode & S_IFMT) != S_IFREG) ||
+			     !rank_candidate(p))
+				continue;
+			if (p->bs_xflags & (XFS_XFLAG_IMMUTABLE|
+					    XFS_XFLAG_APPEND|
+					    XFS_XFLAG_NODEFRAG))
+				continue;
+			if (cache_skip(p))
+				continue;
+			pthread_mutex_lock(&sp->lock);
+			rank_offer(sp->rank, p);
+			pthread_mutex_unlock(&sp->lock);
+		}
 
-	return 0;
+		pthread_mutex_lock(&sp->lock);
+		sp->head = (sp->head + 1) % FSR_SCAN_NBATCH;
+		sp->count--;
+		sp->ranked_ino = b->lastino;
+		if (ckpt)
+			ckpt->startino = b->lastino;
+		pthread_cond_signal(&sp->empty);
+		pthread_cond_broadcast(&sp->ranked);
+	}
+	sp->done = 1;
+	pthread_cond_broadcast(&sp->ranked);
+	pthread_mutex_unlock(&sp->lock);
+	return NULL;
 }
 
 /*
- * Do the defragmentation of a single file.
- * We already are pretty sure we can and want to
- * defragment the file.  Create the tmp file, copy
- * the data (maintaining holes) and call the kernel
- * extent swap routine.
- *
- * Return values:
- * -1: Some error was encountered
- *  0: Successfully defragmented the file
- *  1: No change / No Error
+ * Is there a worker with nothing to do?  Without workers, this process
+ * does the copying itself and is always free between files.
  */
 static int
-packfile(char *fname, char *tname, int fd,
-	 xfs_bstat_t *statp, struct fsxattr *fsxp)
+fsrscan_idle(void)
 {
-	int 		tfd = -1;
-	int		srval;
-	int		retval = -1;	/* Failure is the default */
-	int		nextents, extent, cur_nextents, new_nextents;
-	unsigned	blksz_dio;
-	unsigned	dio_min;
-	struct dioattr	dio;
-	static xfs_swapext_t   sx;
-	struct xfs_flock64  space;
-	off64_t 	cnt, pos;
-	void 		*fbuf = NULL;
-	int 		ct, wc, wc_b4;
-	char		ffname[SMBUFSZ];
-	int		ffd = -1;
-
-	struct fiemap_extent_list *physical_list_head = NULL;		
-	int ret,i;							
-	struct fiemap_extent_list *logical_list_head = NULL;	
-	struct fiemap_extent_list *temp_physical_list_head = NULL;	
-	struct fiemap_extent_list *temp_logical_list_head = NULL;
-
+	int	i, idle = 0;
 
-	/*
-	 * Work out the extent map - nextents will be set to the
-	 * minimum number of extents needed for the file (taking
-	 * into account holes), cur_nextents is the current number
-	 * of extents.
-	 */
-	nextents = read_fd_bmap(fd, statp, &cur_nextents);
+	if (!workq)
+		return 1;
+	pthread_mutex_lock(&workq->lock);
+	for (i = 0; i < workq->nworkers && !idle; i++)
+		if (!workq->wq[i].busy && !workq->wq[i].count)
+			idle = 1;
+	pthread_mutex_unlock(&workq->lock);
+	return idle;
+}
 
-	if(uflag)
-	{
-	 int number1 = 0;
-	 int number2 = 0;
-	 int bblock = 512;	// 1 block = 512 bytes
-		// Get file extents
-		ret = get_file_extents(bblock,fname,fd, &physical_list_head);
-		if (ret < 0) 
-		{
-			fsrprintf("*** ERROR occurred \n");
-		}
-		// Get the count of file's continuous physical region
-		number1 = get_physical_count(physical_list_head);
-		// Change list from physical to logical	
-		ret = change_physical_to_logical(&physical_list_head,&logical_list_head);
-		// Count file fragments before defrag
-		number2 = get_logical_count(logical_list_head);		
+/*
+ * Take the best candidate out of the ranking.  The heap keeps the
+ * weakest on top, so this has to look for it.
+ */
+static struct fsr_cand
+rank_takebest(struct fsr_rank *rp)
+{
+	struct fsr_cand	best;
+	int		i, b = 0;
+
+	for (i = 1; i < rp->count; i++)
+		if (rp->heap[i].benefit > rp->heap[b].benefit)
+			b = i;
+	best = rp->heap[b];
+	rp->heap[b] = rp->heap[--rp->count];
+	if (b < rp->count) {
+		rank_siftdown(rp, b);
+		rank_siftup(rp, b);
 	}
+	return best;
+}
 
-	if (cur_nextents == 1 || cur_nextents <= nextents) {
-		if (vflag)
-			fsrprintf(_("%s already fully defragmented.\n"), fname);
-		retval = 1; /* indicates no change/no error */
-		goto out;
-	} 
-
-	if (dflag)
-		fsrprintf(_("%s extents=%d can_save=%d tmp=%s\n"),
-		          fname, cur_nextents, (cur_nextents - nextents),
-		          tname);
+/*
+ * Defragment one candidate taken from the ranking while the scan is
+ * still running.  Returns 1 if it counts against the target.
+ */
+static int
+fsrscan_dispatch(int fsfd, jdm_fshandle_t *fshandlep, char *mntdir,
+		 struct fsr_cand *cp)
+{
+	xfs_bstat_t	bstat;
+	xfs_ino_t	ino = cp->ino;
 
-	if ((tfd = open(tname, openopts, 0666)) < 0) {
-		if (vflag)
-			fsrprintf(_("could not open tmp file: %s: %s\n"),
-				   tname, strerror(errno));
-		goto out;
+	if (xfs_bulkstat_single(fsfd, &ino, &bstat) < 0 ||
+	    ((bstat.bs_mode & S_IFMT) != S_IFREG) ||
+	    !rank_candidate(&bstat)) {
+		ckpt_done(cp->ino);
+		return 0;
 	}
-	unlink(tname);
+	if (workq)
+		return workq_put(workq, &bstat) == 0;
+	return fsrfs_one(fshandlep, mntdir, &bstat) == 0;
+}
 
-	/* Setup extended attributes */
-	if (fsr_setup_attr_fork(fd, tfd, statp) != 0) {
-		fsrprintf(_("failed to set ATTR fork on tmp: %s:\n"), tname);
-		goto out;
-	}
+/*
+ * Rank every candidate from '*cursorp' to the end of the filesystem,
+ * defragmenting the best ones found so far whenever there is a free
+ * worker.  Returns the number of files defragmented that way, or -1 if
+ * the scan could not be started.  '*completep' says whether the scan
+ * got to the end.  If time ran out first, '*cursorp' is left where the
+ * next scan should carry on, which is where it started if nothing was
+ * ranked; otherwise it is 0.
+ */
+static int
+fsrscan_run(int fsfd, jdm_fshandle_t *fshandlep, char *mntdir,
+	    struct fsr_rank *rp, int targetrange, xfs_ino_t *cursorp,
+	    int *completep)
+{
+	struct fsr_scan	scan, *sp = &scan;
+	struct fsr_cand	cand;
+	struct timespec	ts;
+	pthread_t	producer, classifier;
+	int		dispatched = 0;
+	int		budget;
+	int		i;
 
-	/* Setup extended inode flags, project identifier, etc */
-	if (fsxp->fsx_xflags || fsxp->fsx_projid) {
-		if (ioctl(tfd, XFS_IOC_FSSETXATTR, fsxp) < 0) {
-			fsrprintf(_("could not set inode attrs on tmp: %s\n"),
-				tname);
-			goto out;
+	*completep = 0;
+	memset(sp, 0, sizeof(*sp));
+	sp->fsfd = fsfd;
+	sp->cursor = sp->ranked_ino = *cursorp;
+	sp->rank = rp;
+	for (i = 0; i < FSR_SCAN_NBATCH; i++) {
+		sp->batch[i].bs = malloc(FSR_SCAN_MAXGRAB * sizeof(xfs_bstat_t));
+		if (!sp->batch[i].bs) {
+			fsrprintf(_("malloc failed: %s\n"), strerror(errno));
+			dispatched = -1;
+			goto out_free;
 		}
 	}
-
-	if ((ioctl(tfd, XFS_IOC_DIOINFO, &dio)) < 0 ) {
-		fsrprintf(_("could not get DirectIO info on tmp: %s\n"), tname);
+	pthread_mutex_init(&sp->lock, NULL);
+	pthread_cond_init(&sp->full, NULL);
+	pthread_cond_init(&sp->empty, NULL);
+	pthread_cond_init(&sp->ranked, NULL);
+
+	if (pthread_create(&producer, NULL, fsrscan_producer, sp)) {
+		fsrprintf(_("couldn't start scan: %s\n"), strerror(errno));
+		dispatched = -1;
 		goto out;
 	}
-
-	dio_min = dio.d_miniosz;
-	if (statp->bs_size <= dio_min) {
-		blksz_dio = dio_min;
-	} else {
-		blksz_dio = min(dio.d_maxiosz, BUFFER_MAX - pagesize);
-		if (argv_blksz_dio != 0)
-			blksz_dio = min(argv_blksz_dio, blksz_dio);
-		blksz_dio = (min(statp->bs_size, blksz_dio) / dio_min) * dio_min;
-	}
-
-	if (dflag) {
-		fsrprintf(_("DEBUG: "
-			"fsize=%lld blsz_dio=%d d_min=%d d_max=%d pgsz=%d\n"),
-			statp->bs_size, blksz_dio, dio.d_miniosz,
-			dio.d_maxiosz, pagesize);
-	}
-
-	if (!(fbuf = (char *)memalign(dio.d_mem, blksz_dio))) {
-		fsrprintf(_("could not allocate buf: %s\n"), tname);
+	if (pthread_create(&classifier, NULL, fsrscan_classifier, sp)) {
+		fsrprintf(_("couldn't start scan: %s\n"), strerror(errno));
+		pthread_mutex_lock(&sp->lock);
+		sp->stop = 1;
+		pthread_cond_broadcast(&sp->empty);
+		pthread_mutex_unlock(&sp->lock);
+		pthread_join(producer, NULL);
+		dispatched = -1;
 		goto out;
 	}
 
-	if (nfrags) {
-		/* Create new tmp file in same AG as first */
-		sprintf(ffname, "%s.frag", tname);
-
-		/* Open the new file for sync writes */
-		if ((ffd = open(ffname, openopts, 0666)) < 0) {
-			fsrprintf(_("could not open fragfile: %s : %s\n"),
-				   ffname, strerror(errno));
-			goto out;
+	pthread_mutex_lock(&sp->lock);
+	while (!sp->done) {
+		budget = (sp->rank->seen * targetrange) / 100 - dispatched;
+		if (budget > 0 && sp->rank->count && !sp->stop &&
+		    fsrscan_idle()) {
+			cand = rank_takebest(sp->rank);
+			pthread_mutex_unlock(&sp->lock);
+			dispatched += fsrscan_dispatch(sp->fsfd, fshandlep,
+						       mntdir, &cand);
+			pthread_mutex_lock(&sp->lock);
+		} else {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec++;
+			pthread_cond_timedwait(&sp->ranked, &sp->lock, &ts);
+		}
+		if (endtime && endtime < time(0) && !sp->stop) {
+			sp->stop = 1;
+			pthread_cond_broadcast(&sp->empty);
 		}
-		unlink(ffname);
 	}
+	pthread_mutex_unlock(&sp->lock);
+
+	pthread_join(producer, NULL);
+	pthread_join(classifier, NULL);
+	if (sp->error)
+		fsrprintf(_("%s: xfs_bulkstat: %s\n"), progname,
+			  strerror(sp->error));
+	*completep = !sp->stop && !sp->error;
+	*cursorp = sp->stop ? sp->ranked_ino : 0;
+out:
+	pthread_cond_destroy(&sp->ranked);
+	pthread_cond_destroy(&sp->empty);
+	pthread_cond_destroy(&sp->full);
+	pthread_mutex_destroy(&sp->lock);
+out_free:
+	for (i = 0; i < FSR_SCAN_NBATCH; i++)
+		free(sp->batch[i].bs);
+	return dispatched;
+}
 
-	/* Loop through block map allocating new extents */
-	for (extent = 0; extent < nextents; extent++) {
-		pos = outmap[extent].bmv_offset;
-		if (outmap[extent].bmv_block == -1) {
-			space.l_whence = SEEK_SET;
-			space.l_start = pos;
-			space.l_len = outmap[extent].bmv_length;
-			if (ioctl(tfd, XFS_IOC_UNRESVSP64, &space) < 0) {
-				fsrprintf(_("could not trunc tmp %s\n"),
-					   tname);
-			}
-			if (lseek64(tfd, outmap[extent].bmv_length, SEEK_CUR) < 0) {
-				fsrprintf(_("could not lseek in tmpfile: %s : %s\n"),
-				   tname, strerror(errno));
-				goto out;
-			}
+/*
+ * Defragment up to 'count' of the ranked candidates in 'rp', best
+ * first, handing them to the workers if -j asked for any.  Returns 1
+ * if time ran out first.
+ */
+static int
+rank_drain(int fsfd, jdm_fshandle_t *fshandlep, char *mntdir,
+	   struct fsr_rank *rp, int count)
+{
+	xfs_bstat_t	bstat;
+	xfs_ino_t	ino;
+	int		timedout = 0;
+	int		i;
+
+	if (nworkers > 1 && !workq)
+		workq_start(mntdir, fshandlep);
+
+	for (i = 0; i < rp->count && count > 0; i++) {
+		/* get a fresh stat, the file may have changed since */
+		ino = rp->heap[i].ino;
+		if (xfs_bulkstat_single(fsfd, &ino, &bstat) < 0) {
+			ckpt_done(rp->heap[i].ino);
 			continue;
-		} else if (outmap[extent].bmv_length == 0) {
-			/* to catch holes at the beginning of the file */
+		}
+		if (((bstat.bs_mode & S_IFMT) != S_IFREG) ||
+		     !rank_candidate(&bstat)) {
+			ckpt_done(rp->heap[i].ino);
 			continue;
 		}
-		if (! nfrags) {							// This iteration called always
-			space.l_whence = SEEK_CUR;
-			space.l_start = 0;
-			space.l_len = outmap[extent].bmv_length;
 
-			if (ioctl(tfd, XFS_IOC_RESVSP64, &space) < 0) {
-				fsrprintf(_("could not pre-allocate tmp space:"
-					" %s\n"), tname);
-				goto out;
-			}
-			if (lseek64(tfd, outmap[extent].bmv_length, SEEK_CUR) < 0) {
-				fsrprintf(_("could not lseek in tmpfile: %s : %s\n"),
-				   tname, strerror(errno));
-				goto out;
-			}
+		/*
+		 * With workers we can't wait to see whether a file was
+		 * improved, so count the candidates handed out instead.
+		 */
+		if (workq) {
+			if (workq_put(workq, &bstat) < 0)
+				break;
+			count--;
+		} else if (fsrfs_one(fshandlep, mntdir, &bstat) == 0) {
+			count--;
 		}
-	} /* end of space allocation loop */
-
-	if (lseek64(tfd, 0, SEEK_SET)) {
-		fsrprintf(_("Couldn't rewind on temporary file\n"));
-		goto out;
-	}
-
-	if(uflag)
-	{
-	 int number1 = 0;
-	 int number2 = 0;
-	 int bblock = 512;	// 1 block = 512 bytes
+		if (ckpt)
+			ckpt->target = count;
 
-		// Get file extents
-		ret = get_file_extents(bblock,fname,tfd, &temp_physical_list_head);
-		if (ret < 0) 
-		{
-			fsrprintf("*** ERROR occurred \n");
+		if (endtime && endtime < time(0)) {
+			timedout = 1;
+			break;
 		}
-
-		// Get the count of file's continuous physical region
-		number1 = get_physical_count(temp_physical_list_head);
-		// Change list from physical to logical	
-		ret = change_physical_to_logical(&temp_physical_list_head,&temp_logical_list_head);
-		// Count file fragments before defrag
-		number2 = get_logical_count(temp_logical_list_head);
 	}
 
+	if (workq)
+		workq_finish(timedout, 0);
+	return timedout;
+}
 
+/*
+ * fsrfs -- reorganize a file system
+ */
+static int
+fsrfs(char *mntdir, xfs_ino_t startino, int targetrange)
+{
 
-	/* Check if the temporary file has fewer extents */
-	new_nextents = getnextents(tfd);
-
-	if (dflag)
-		fsrprintf(_("Temporary file has %d extents (%d in original)\n"), new_nextents, cur_nextents);
-	if (cur_nextents <= new_nextents) {
+	int	fsfd;
+	int	count = 0;
+	int	dispatched;
+	int	complete = 0;
+	jdm_fshandle_t	*fshandlep;
+	xfs_ino_t	lastino = startino;
+	struct fsr_rank	rank;
+
+	fsrprintf(_("%s start inode=%llu\n"), mntdir,
+		(unsigned long long)startino);
+
+	fshandlep = jdm_getfshandle( mntdir );
+	if ( ! fshandlep ) {
+		fsrprintf(_("unable to get handle: %s: %s\n"),
+		          mntdir, strerror( errno ));
+		return -1;
+	}
+
+	if ((fsfd = open(mntdir, O_RDONLY)) < 0) {
+		fsrprintf(_("unable to open: %s: %s\n"),
+		          mntdir, strerror( errno ));
+		free(fshandlep);
+		return -1;
+	}
+
+	if (xfs_getgeom(fsfd, &fsgeom) < 0 ) {
+		fsrprintf(_("Skipping %s: could not get XFS geometry\n"),
+			  mntdir);
+		close(fsfd);
+		free(fshandlep);
+		return -1;
+	}
+
+	if (rank_init(&rank, FSR_RANKMAX) < 0) {
+		close(fsfd);
+		free(fshandlep);
+		return -1;
+	}
+
+	fsstats = mmap(NULL, sizeof(*fsstats), PROT_READ|PROT_WRITE,
+		       MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (fsstats == MAP_FAILED)
+		fsstats = NULL;
+
+	cache_open(mntdir);
+
+	tmp_init(mntdir);
+	tmp_freesum(fsfd);
+	swapbatch = 1;
+
+	/*
+	 * A pass cut short after ranking carries on with the candidates it
+	 * had left, ranked as they were.  One cut short while ranking
+	 * starts its scan with them.
+	 */
+	if ((count = ckpt_resume(&rank)) > 0) {
 		if (vflag)
-			fsrprintf(_("No improvement will be made (skipping): %s\n"), fname);
-		retval = 1; /* no change/no error */
-		goto out;
+			fsrprintf(_("%s: resuming with %d ranked candidates\n"),
+				  mntdir, rank.count);
+		leftoffino = 0;
+		goto drain;
 	}
 
-	if(uflag)
-	{
-  	 fsrprintf("New file will have %d extents (%d extents out of the %d in original were not selected for defrag)\n",
-			new_nextents + unselected, unselected, cur_nextents);
-	 if (cur_nextents <= (new_nextents + unselected)) {
-		fsrprintf(_("No improvement will be made (skip and exit): %s\n"), fname);
-		retval = 1; /* no change/no error */
-		goto out;
-	 }
-        }	
+	/*
+	 * First rank every candidate from the start inode to the end of
+	 * the filesystem, starting on the best ones as soon as there is a
+	 * worker free.  If we run out of time doing that, the next run
+	 * carries on ranking from where this one stopped.
+	 */
+	if (nworkers > 1)
+		workq_start(mntdir, fshandlep);
+	dispatched = fsrscan_run(fsfd, fshandlep, mntdir, &rank, targetrange,
+				 &lastino, &complete);
+	if (dispatched < 0) {
+		if (workq)
+			workq_finish(1, 0);
+		fsrfs_report(mntdir);
+		rank_free(&rank);
+		tmp_close(mntdir);
+		close(fsfd);
+		free(fshandlep);
+		return -1;
+	}
+	if (endtime && endtime < time(0) && !complete) {
+		leftoffino = lastino;
+		ckpt_save_partial(&rank, lastino);
+		goto timeout;
+	}
 
-	/* Loop through block map copying the file. */
-	for (extent = 0; extent < nextents; extent++) {
-		pos = outmap[extent].bmv_offset;
-		if (outmap[extent].bmv_block == -1) {				// Not executed	
-			fsrprintf("--- First if iteration %d",extent);
-			if (lseek64(tfd, outmap[extent].bmv_length, SEEK_CUR) < 0) {
-				fsrprintf(_("could not lseek in tmpfile: %s : %s\n"),
-				   tname, strerror(errno));
-				goto out;
-			}
-			if (lseek64(fd, outmap[extent].bmv_length, SEEK_CUR) < 0) {
-				fsrprintf(_("could not lseek in file: %s : %s\n"),
-				   fname, strerror(errno));
-				goto out;
+	/*
+	 * Now defrag the best targetrange percent of the candidates.  A
+	 * ranking is only good for one pass; once it is done, or time runs
+	 * out, the next run starts over with a fresh one.
+	 */
+	leftoffino = 0;
+	count = (rank.seen * targetrange) / 100;
+	if (count == 0 && rank.count && !dispatched)
+		count = 1;
+	if (vflag)
+		fsrprintf(_("%s: %llu candidates, defragmenting up to %d, "
+			  "%d of them during the scan\n"), mntdir,
+			  (unsigned long long)rank.seen, count, dispatched);
+	count = max(count - dispatched, 0);
+
+	qsort(rank.heap, rank.count, sizeof(struct fsr_cand), rank_cmp);
+	rank_rescore(fsfd, fshandlep, &rank, min(rank.count,
+		     max(FSR_RESCOREMIN, 4 * count)));
+	ckpt_save_rank(&rank, min(rank.count, max(FSR_RESCOREMIN, 4 * count)));
+	if (ckpt)
+		ckpt->target = count;
+
+drain:
+	if (rank_drain(fsfd, fshandlep, mntdir, &rank, count))
+		goto timeout;
+
+	fsrfs_report(mntdir);
+	/* only a scan of every inode knows which records are stale */
+	cache_save(startino == 0 && complete);
+	rank_free(&rank);
+	tmp_close(mntdir);
+	close(fsfd);
+	free(fshandlep);
+	return 0;
+
+timeout:
+	if (workq)
+		workq_finish(1, 0);
+	fsrfs_report(mntdir);
+	cache_save(0);
+	tmp_close(mntdir);
+	close(fsfd);
+	fsrall_cleanup(1);
+	exit(1);
+}
+
+/*
+ * Fragmentation statistics (-s).
+ *
+ * Nothing is changed and, apart from the worst few files, nothing is
+ * opened: bulkstat reports the extent count of every inode, which is
+ * enough for the histograms and for a seek estimate that assumes each
+ * extent boundary is a seek.  The AGs are shared out between threads,
+ * each streaming bulkstat over its AG in large batches.
+ */
+#define FSR_STATS_GRAB		4096	/* inodes per bulkstat call */
+#define FSR_STATS_NEXTHIST	24	/* extent count buckets, powers of 2 */
+#define FSR_STATS_NSCOREHIST	16	/* score buckets, powers of 2 */
+#define FSR_STATS_TOPN		20	/* worst files listed */
+
+struct fsr_stats {
+	__u64		inodes;
+	__u64		files;		/* regular files */
+	__u64		fragmented;	/* regular files with >1 extent */
+	__u64		extents;
+	__u64		bytes;		/* allocated to regular files */
+	__u64		nodefrag;	/* fragmented but marked nodefrag */
+	__u64		cost_files;	/* files a run would copy */
+	__u64		cost_bytes;	/* and the data it would copy */
+	__u64		cost_extents;	/* extents it could remove */
+	__u64		exthist[FSR_STATS_NEXTHIST];
+	__u64		scorehist[FSR_STATS_NSCOREHIST];
+	struct fsr_rank	worst;		/* highest scores */
+};
+
+struct fsr_statsthr {
+	pthread_t	tid;
+	int		fsfd;
+	xfs_agnumber_t	*nextag;	/* next AG to scan, shared */
+	int		error;
+	struct fsr_stats st;
+};
+
+/*
+ * Score a file from its bulkstat record alone, as if every extent
+ * boundary were a seek within the same AG.
+ */
+static double
+fsrstats_estimate(xfs_bstat_t *bs)
+{
+	struct fsr_layout	layout;
+
+	memset(&layout, 0, sizeof(layout));
+	layout.nextents = bs->bs_extents;
+	layout.ndisc = max(bs->bs_extents - 1, 0);
+	return fsr_score(&layout, bs->bs_size);
+}
+
+static int
+fsrstats_bucket(double v, int nbuckets)
+{
+	if (v < 2)
+		return v < 1 ? 0 : 1;
+	if (v >= (double)(1U << (nbuckets - 2)))
+		return nbuckets - 1;
+	return libxfs_highbit32((__u32)v) + 1;
+}
+
+static void
+fsrstats_add(struct fsr_stats *sp, xfs_bstat_t *bs)
+{
+	double	score;
+
+	sp->inodes++;
+	if ((bs->bs_mode & S_IFMT) != S_IFREG)
+		return;
+	sp->files++;
+	sp->extents += bs->bs_extents;
+	sp->bytes += (__u64)bs->bs_blocks * bs->bs_blksize;
+	sp->exthist[fsrstats_bucket(bs->bs_extents, FSR_STATS_NEXTHIST)]++;
+	if (bs->bs_extents < 2)
+		return;
+
+	sp->fragmented++;
+	score = fsrstats_estimate(bs);
+	sp->scorehist[fsrstats_bucket(score, FSR_STATS_NSCOREHIST)]++;
+	rank_insert(&sp->worst, bs->bs_ino, score);
+
+	if (bs->bs_xflags & XFS_XFLAG_NODEFRAG) {
+		sp->nodefrag++;
+		return;
+	}
+	if (score < minscore)
+		return;
+	sp->cost_files++;
+	sp->cost_bytes += (__u64)bs->bs_blocks * bs->bs_blksize;
+	sp->cost_extents += max(bs->bs_extents - 1, 0) +
+			    max(bs->bs_aextents - 1, 0);
+}
+
+/*
+ * Thread body: take AGs off the shared counter until there are none
+ * left, bulkstat'ing each from its first inode to its last.
+ */
+static void *
+fsrstats_ag(void *arg)
+{
+	struct fsr_statsthr *tp = arg;
+	xfs_bstat_t	*buf, *p, *endp;
+	xfs_agnumber_t	agno;
+	xfs_ino_t	lastino;
+	__s32		buflenout;
+	int		agshift = fsr_agino_log();
+	int		ret;
+
+	buf = malloc(FSR_STATS_GRAB * sizeof(*buf));
+	if (!buf) {
+		tp->error = errno;
+		return NULL;
+	}
+
+	while ((agno = __sync_fetch_and_add(tp->nextag, 1)) <
+	       fsgeom.agcount) {
+		/* bulkstat returns the inodes after lastino */
+		lastino = agno ? ((xfs_ino_t)agno << agshift) - 1 : 0;
+		while ((ret = xfs_bulkstat(tp->fsfd, &lastino, FSR_STATS_GRAB,
+					   buf, &buflenout)) == 0 &&
+		       buflenout > 0) {
+			endp = buf + buflenout;
+			for (p = buf; p < endp; p++) {
+				if ((p->bs_ino >> agshift) != agno)
+					break;
+				fsrstats_add(&tp->st, p);
 			}
+			if (p < endp)
+				break;
+		}
+		if (ret < 0) {
+			tp->error = errno;
+			break;
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+static void
+fsrstats_merge(struct fsr_stats *to, struct fsr_stats *from)
+{
+	int	i;
+
+	to->inodes += from->inodes;
+	to->files += from->files;
+	to->fragmented += from->fragmented;
+	to->extents += from->extents;
+	to->bytes += from->bytes;
+	to->nodefrag += from->nodefrag;
+	to->cost_files += from->cost_files;
+	to->cost_bytes += from->cost_bytes;
+	to->cost_extents += from->cost_extents;
+	for (i = 0; i < FSR_STATS_NEXTHIST; i++)
+		to->exthist[i] += from->exthist[i];
+	for (i = 0; i < FSR_STATS_NSCOREHIST; i++)
+		to->scorehist[i] += from->scorehist[i];
+	for (i = 0; i < from->worst.count; i++)
+		rank_insert(&to->worst, from->worst.heap[i].ino,
+			    from->worst.heap[i].benefit);
+}
+
+/*
+ * Print a histogram of fsrstats_bucket()s.  Buckets of whole numbers
+ * are shown inclusive ("to"), those of real numbers as "below".
+ */
+static void
+fsrstats_hist(char *title, __u64 *hist, int nbuckets, __u64 total, int real)
+{
+	__u64	lo, hi;
+	int	i;
+
+	fsrprintf("%s\n", title);
+	fsrprintf("%10s %10s %12s %7s\n", _("from"), real ? _("below") : _("to"),
+		_("files"), _("pct"));
+	for (i = 0; i < nbuckets; i++) {
+		if (!hist[i])
 			continue;
-		} else if (outmap[extent].bmv_length == 0) {			// Not executed
-				fsrprintf("--- Second if iteration %d",extent);
-			/* to catch holes at the beginning of the file */
+		lo = i ? 1ULL << (i - 1) : 0;
+		hi = real ? 1ULL << i : (1ULL << i) - 1;
+		if (i == nbuckets - 1)
+			fsrprintf("%10llu %10s %12llu %7.2f\n",
+				(unsigned long long)lo, "-",
+				(unsigned long long)hist[i],
+				hist[i] * 100.0 / total);
+		else
+			fsrprintf("%10llu %10llu %12llu %7.2f\n",
+				(unsigned long long)lo, (unsigned long long)hi,
+				(unsigned long long)hist[i],
+				hist[i] * 100.0 / total);
+	}
+}
+
+/*
+ * The worst files were scored from bulkstat alone.  There are few of
+ * them, so open them and score them from their block maps instead.
+ */
+static void
+fsrstats_worst(char *mntdir, int fsfd, struct fsr_rank *rp)
+{
+	jdm_fshandle_t		*fshandlep;
+	struct fsr_layout	layout;
+	xfs_bstat_t		bstat;
+	xfs_ino_t		ino;
+	int			fd;
+	int			i;
+
+	qsort(rp->heap, rp->count, sizeof(struct fsr_cand), rank_cmp);
+	if ((fshandlep = jdm_getfshandle(mntdir)) != NULL) {
+		for (i = 0; i < rp->count; i++) {
+			ino = rp->heap[i].ino;
+			if (xfs_bulkstat_single(fsfd, &ino, &bstat) < 0)
+				continue;
+			fd = jdm_open(fshandlep, &bstat, O_RDONLY);
+			if (fd < 0)
+				continue;
+			if (fsr_layout(fd, &layout) == 0)
+				rp->heap[i].benefit =
+					fsr_score(&layout, bstat.bs_size);
+			close(fd);
+		}
+		free(fshandlep);
+		qsort(rp->heap, rp->count, sizeof(struct fsr_cand), rank_cmp);
+	}
+
+	fsrprintf(_("worst %d files:\n"), rp->count);
+	fsrprintf("%20s %10s %12s %10s\n", _("inode"), _("extents"), _("MB"),
+		_("score"));
+	for (i = 0; i < rp->count; i++) {
+		ino = rp->heap[i].ino;
+		if (xfs_bulkstat_single(fsfd, &ino, &bstat) < 0)
+			continue;
+		fsrprintf("%20llu %10d %12llu %10.2f\n",
+			(unsigned long long)bstat.bs_ino, bstat.bs_extents,
+			(unsigned long long)bstat.bs_size >> 20,
+			rp->heap[i].benefit);
+	}
+}
+
+/*
+ * fsrstats -- report how fragmented a filesystem is
+ */
+static void
+fsrstats(char *mntdir)
+{
+	struct fsr_statsthr	*thr;
+	struct fsr_stats	total;
+	xfs_agnumber_t		nextag = 0;
+	time_t			started = time(0);
+	int			fsfd;
+	int			nthreads;
+	int			i, n;
+
+	if ((fsfd = open(mntdir, O_RDONLY)) < 0) {
+		fsrprintf(_("unable to open: %s: %s\n"),
+			  mntdir, strerror(errno));
+		return;
+	}
+	if (xfs_getgeom(fsfd, &fsgeom) < 0) {
+		fsrprintf(_("Skipping %s: could not get XFS geometry\n"),
+			  mntdir);
+		close(fsfd);
+		return;
+	}
+
+	nthreads = nworkers > 1 ? nworkers :
+		   max(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+	nthreads = min(nthreads, (int)fsgeom.agcount);
+	thr = calloc(nthreads, sizeof(*thr));
+	memset(&total, 0, sizeof(total));
+	if (!thr || rank_init(&total.worst, FSR_STATS_TOPN) < 0) {
+		fsrprintf(_("malloc failed: %s\n"), strerror(errno));
+		free(thr);
+		close(fsfd);
+		return;
+	}
+
+	for (n = 0; n < nthreads; n++) {
+		thr[n].fsfd = fsfd;
+		thr[n].nextag = &nextag;
+		if (rank_init(&thr[n].st.worst, FSR_STATS_TOPN) < 0)
+			break;
+		if (pthread_create(&thr[n].tid, NULL, fsrstats_ag, &thr[n])) {
+			rank_free(&thr[n].st.worst);
+			break;
+		}
+	}
+	/* without any threads, scan the lot from here */
+	if (n == 0 && rank_init(&thr[0].st.worst, FSR_STATS_TOPN) == 0) {
+		fsrstats_ag(&thr[0]);
+		n = -1;
+	}
+
+	for (i = 0; i < (n < 0 ? 1 : n); i++) {
+		if (n > 0)
+			pthread_join(thr[i].tid, NULL);
+		if (thr[i].error)
+			fsrprintf(_("%s: xfs_bulkstat: %s\n"), mntdir,
+				  strerror(thr[i].error));
+		fsrstats_merge(&total, &thr[i].st);
+		rank_free(&thr[i].st.worst);
+	}
+	free(thr);
+
+	fsrprintf(_("%s: %llu inodes, %llu regular files, %llu fragmented "
+		"(%.2f%%)\n"), mntdir,
+		(unsigned long long)total.inodes,
+		(unsigned long long)total.files,
+		(unsigned long long)total.fragmented,
+		total.files ? total.fragmented * 100.0 / total.files : 0.0);
+	fsrprintf(_("%llu extents, %.2f per file, %llu MB allocated\n"),
+		(unsigned long long)total.extents,
+		total.files ? (double)total.extents / total.files : 0.0,
+		(unsigned long long)total.bytes >> 20);
+	if (total.files)
+		fsrstats_hist(_("extents per file:"), total.exthist,
+			      FSR_STATS_NEXTHIST, total.files, 0);
+	if (total.fragmented)
+		fsrstats_hist(_("estimated fragmentation score:"),
+			      total.scorehist, FSR_STATS_NSCOREHIST,
+			      total.fragmented, 1);
+	if (total.worst.count)
+		fsrstats_worst(mntdir, fsfd, &total.worst);
+	fsrprintf(_("defrag would copy %llu MB in %llu files, removing up to "
+		"%llu extents\n"),
+		(unsigned long long)total.cost_bytes >> 20,
+		(unsigned long long)total.cost_files,
+		(unsigned long long)total.cost_extents);
+	if (total.nodefrag)
+		fsrprintf(_("%llu fragmented files are marked nodefrag\n"),
+			(unsigned long long)total.nodefrag);
+	if (vflag)
+		fsrprintf(_("%s: scanned in %d seconds with %d threads\n"),
+			mntdir, (int)(time(0) - started), max(n, 1));
+
+	rank_free(&total.worst);
+	close(fsfd);
+}
+
+/*
+ * Directory walk for fsrdir().  Directories still to be read are kept
+ * on a stack shared by the walker threads; a walker pushes the
+ * subdirectories it finds and offers the regular files to the ranking.
+ * The walk is over when the stack is empty and no walker is still
+ * reading a directory that might add to it.
+ */
+#define FSR_DIRWALKERS	4	/* walker threads unless -j asks for more */
+
+struct fsr_dirwalk {
+	pthread_mutex_t	lock;
+	pthread_cond_t	more;		/* stack grew or walk finished */
+	char		**stack;	/* directories still to read */
+	int		nstack;
+	int		maxstack;
+	int		busy;		/* walkers reading a directory */
+	int		stop;		/* out of time */
+	time_t		deadline;	/* when to stop, 0 for never */
+	dev_t		dev;		/* the walk stays on this device */
+	int		fsfd;
+	struct fsr_rank	*rank;
+	__u64		ndirs;
+};
+
+/* called with the walk locked */
+static int
+fsrdir_push(struct fsr_dirwalk *wp, char *path)
+{
+	char	**stack;
+
+	if (wp->nstack == wp->maxstack) {
+		stack = realloc(wp->stack,
+				2 * wp->maxstack * sizeof(*wp->stack));
+		if (!stack)
+			return -1;
+		wp->stack = stack;
+		wp->maxstack *= 2;
+	}
+	wp->stack[wp->nstack++] = path;
+	pthread_cond_signal(&wp->more);
+	return 0;
+}
+
+static void
+fsrdir_read(struct fsr_dirwalk *wp, char *dir)
+{
+	struct dirent	*dp;
+	struct stat64	sb;
+	xfs_bstat_t	bstat;
+	xfs_ino_t	ino;
+	DIR		*dirp;
+	char		*path;
+	int		type;
+
+	if ((dirp = opendir(dir)) == NULL) {
+		if (dflag)
+			fsrprintf(_("could not open: %s: %s\n"),
+				  dir, strerror(errno));
+		return;
+	}
+
+	while ((dp = readdir(dirp)) != NULL) {
+		if (strcmp(dp->d_name, ".") == 0 ||
+		    strcmp(dp->d_name, "..") == 0)
 			continue;
+
+		type = dp->d_type;
+		if (type == DT_UNKNOWN || type == DT_DIR) {
+			if (fstatat64(dirfd(dirp), dp->d_name, &sb,
+				      AT_SYMLINK_NOFOLLOW) < 0)
+				continue;
+			type = S_ISDIR(sb.st_mode) ? DT_DIR :
+			       S_ISREG(sb.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+
+		if (type == DT_DIR) {
+			/* don't wander into other mounts */
+			if (sb.st_dev != wp->dev)
+				continue;
+			path = malloc(strlen(dir) + strlen(dp->d_name) + 2);
+			if (!path)
+				continue;
+			sprintf(path, "%s/%s", dir, dp->d_name);
+			pthread_mutex_lock(&wp->lock);
+			if (fsrdir_push(wp, path) < 0)
+				free(path);
+			pthread_mutex_unlock(&wp->lock);
+		} else if (type == DT_REG) {
+			/*
+			 * readdir reports the inode in this directory's
+			 * filesystem even for a file mounted over, so the
+			 * inode number is always ours to bulkstat.
+			 */
+			ino = dp->d_ino;
+			if (xfs_bulkstat_single(wp->fsfd, &ino, &bstat) < 0)
+				continue;
+			if (((bstat.bs_mode & S_IFMT) != S_IFREG) ||
+			     !rank_candidate(&bstat))
+				continue;
+			if (cache_skip(&bstat))
+				continue;
+			pthread_mutex_lock(&wp->lock);
+			rank_offer(wp->rank, &bstat);
+			pthread_mutex_unlock(&wp->lock);
+		}
+	}
+	closedir(dirp);
+}
+
+static void *
+fsrdir_walker(void *arg)
+{
+	struct fsr_dirwalk *wp = arg;
+	char		*dir;
+
+	pthread_mutex_lock(&wp->lock);
+	for (;;) {
+		while (!wp->nstack && wp->busy && !wp->stop)
+			pthread_cond_wait(&wp->more, &wp->lock);
+		if (!wp->nstack || wp->stop)
+			break;
+		dir = wp->stack[--wp->nstack];
+		wp->busy++;
+		wp->ndirs++;
+		pthread_mutex_unlock(&wp->lock);
+
+		fsrdir_read(wp, dir);
+		free(dir);
+
+		pthread_mutex_lock(&wp->lock);
+		wp->busy--;
+		if (wp->deadline && wp->deadline < time(0))
+			wp->stop = 1;
+	}
+	/* wake the others, the walk is over for them too */
+	pthread_cond_broadcast(&wp->more);
+	pthread_mutex_unlock(&wp->lock);
+	return NULL;
+}
+
+/*
+ * Find the root of the filesystem 'path' is in, which is where the
+ * handles and the temporary files come from.
+ */
+static char *
+fsr_mountroot(char *path, dev_t dev)
+{
+	struct stat64	sb;
+	char		*root, *p;
+
+	if ((root = realpath(path, NULL)) == NULL)
+		return NULL;
+	while ((p = strrchr(root, '/')) != NULL) {
+		if (p == root) {
+			if (root[1] && stat64("/", &sb) == 0 &&
+			    sb.st_dev == dev)
+				root[1] = '\0';
+			break;
+		}
+		*p = '\0';
+		if (stat64(root, &sb) < 0 || sb.st_dev != dev) {
+			*p = '/';
+			break;
+		}
+	}
+	return root;
+}
+
+/*
+ * To drop hard links to the same file from the ranking.
+ */
+static int
+rank_inocmp(const void *s1, const void *s2)
+{
+	xfs_ino_t	i1 = ((struct fsr_cand *)s1)->ino;
+	xfs_ino_t	i2 = ((struct fsr_cand *)s2)->ino;
+
+	return (i1 > i2) - (i1 < i2);
+}
+
+/*
+ * reorganize by directory hierarchy.
+ *
+ * The tree is walked by parallel readers without leaving the device
+ * it is on, and every fragmented file in it is ranked and defragmented
+ * the same way fsrfs() does a whole filesystem, honouring -t and -j.
+ */
+static void
+fsrdir(char *dirname)
+{
+	struct fsr_dirwalk walk;
+	struct fsr_rank	rank;
+	struct stat64	sb;
+	jdm_fshandle_t	*fshandlep = NULL;
+	pthread_t	*tids = NULL;
+	char		*mntdir = NULL;
+	char		*top;
+	int		fsfd = -1;
+	int		nwalkers;
+	int		i, n;
+
+	memset(&walk, 0, sizeof(walk));
+	if (stat64(dirname, &sb) < 0 ||
+	    (mntdir = fsr_mountroot(dirname, sb.st_dev)) == NULL) {
+		fsrprintf(_("unable to find the filesystem of %s: %s\n"),
+			  dirname, strerror(errno));
+		return;
+	}
+
+	fshandlep = jdm_getfshandle(mntdir);
+	if (!fshandlep) {
+		fsrprintf(_("unable to get handle: %s: %s\n"),
+			  mntdir, strerror(errno));
+		goto out;
+	}
+	if ((fsfd = open(mntdir, O_RDONLY)) < 0) {
+		fsrprintf(_("unable to open: %s: %s\n"),
+			  mntdir, strerror(errno));
+		goto out;
+	}
+	if (xfs_getgeom(fsfd, &fsgeom) < 0) {
+		fsrprintf(_("Skipping %s: could not get XFS geometry\n"),
+			  mntdir);
+		goto out;
+	}
+	if (rank_init(&rank, FSR_RANKMAX) < 0)
+		goto out;
+
+	fsstats = mmap(NULL, sizeof(*fsstats), PROT_READ|PROT_WRITE,
+		       MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (fsstats == MAP_FAILED)
+		fsstats = NULL;
+	cache_open(mntdir);
+	endtime = starttime + howlong;
+
+	fsrprintf(_("%s start\n"), dirname);
+
+	nwalkers = max(nworkers, FSR_DIRWALKERS);
+	pthread_mutex_init(&walk.lock, NULL);
+	pthread_cond_init(&walk.more, NULL);
+	/* leave half of -t to defragment what the walk finds */
+	walk.deadline = howlong ? starttime + howlong / 2 : 0;
+	walk.dev = sb.st_dev;
+	walk.fsfd = fsfd;
+	walk.rank = &rank;
+	walk.maxstack = 64;
+	walk.stack = malloc(walk.maxstack * sizeof(*walk.stack));
+	tids = malloc(nwalkers * sizeof(*tids));
+	top = strdup(dirname);
+	if (!walk.stack || !tids || !top) {
+		fsrprintf(_("malloc failed: %s\n"), strerror(errno));
+		free(top);
+		goto out_walk;
+	}
+	walk.stack[walk.nstack++] = top;
+
+	for (n = 0; n < nwalkers; n++)
+		if (pthread_create(&tids[n], NULL, fsrdir_walker, &walk))
+			break;
+	if (n == 0)
+		fsrdir_walker(&walk);
+	for (i = 0; i < n; i++)
+		pthread_join(tids[i], NULL);
+	if (vflag)
+		fsrprintf(_("%s: %llu directories, %llu candidates\n"),
+			  dirname, (unsigned long long)walk.ndirs,
+			  (unsigned long long)rank.seen);
+
+	/* still do the best of what was found, as fsrfs() does */
+	if (walk.stop)
+		fsrprintf(_("%s: out of time walking the tree, %d "
+			  "candidates ranked\n"), dirname, rank.count);
+
+	/* a file linked in twice is only ranked once */
+	qsort(rank.heap, rank.count, sizeof(struct fsr_cand), rank_inocmp);
+	for (i = n = 0; i < rank.count; i++)
+		if (n == 0 || rank.heap[i].ino != rank.heap[n - 1].ino)
+			rank.heap[n++] = rank.heap[i];
+	rank.count = n;
+
+	qsort(rank.heap, rank.count, sizeof(struct fsr_cand), rank_cmp);
+	rank_rescore(fsfd, fshandlep, &rank, min(rank.count, FSR_RESCOREMIN));
+
+	tmp_init(mntdir);
+	tmp_freesum(fsfd);
+	swapbatch = 1;
+	if (rank_drain(fsfd, fshandlep, mntdir, &rank, rank.count))
+		fsrprintf(_("%s: out of time\n"), dirname);
+	tmp_close(mntdir);
+	fsrfs_report(dirname);
+
+out_walk:
+	while (walk.nstack)
+		free(walk.stack[--walk.nstack]);
+	free(walk.stack);
+	free(tids);
+	pthread_mutex_destroy(&walk.lock);
+	pthread_cond_destroy(&walk.more);
+	if (fsstats) {
+		munmap(fsstats, sizeof(*fsstats));
+		fsstats = NULL;
+	}
+	cache_save(0);
+	rank_free(&rank);
+out:
+	if (fsfd >= 0)
+		close(fsfd);
+	free(fshandlep);
+	free(mntdir);
+}
+
+/*
+ * Sets up the defragmentation of a file based on the
+ * filepath.  It collects the bstat information, does
+ * an open on the file and passes this all to fsrfile_common.
+ */
+static int
+fsrfile(char *fname, xfs_ino_t ino)
+{
+	xfs_bstat_t	statbuf;
+	jdm_fshandle_t	*fshandlep;
+	int	fd = -1, fsfd = -1;
+	int	error = -1;
+	char	*tname;
+
+	fshandlep = jdm_getfshandle(getparent (fname) );
+	if (!fshandlep) {
+		fsrprintf(_("unable to construct sys handle for %s: %s\n"),
+			fname, strerror(errno));
+		goto out;
+	}
+
+	/*
+	 * Need to open something on the same filesystem as the
+	 * file.  Open the parent.
+	 */
+	fsfd = open(getparent(fname), O_RDONLY);
+	if (fsfd < 0) {
+		fsrprintf(_("unable to open sys handle for %s: %s\n"),
+			fname, strerror(errno));
+		goto out;
+	}
+
+	if ((xfs_bulkstat_single(fsfd, &ino, &statbuf)) < 0) {
+		fsrprintf(_("unable to get bstat on %s: %s\n"),
+			fname, strerror(errno));
+		goto out;
+	}
+
+	fd = jdm_open(fshandlep, &statbuf, O_RDWR|O_DIRECT);
+	if (fd < 0) {
+		fsrprintf(_("unable to open handle %s: %s\n"),
+			fname, strerror(errno));
+		goto out;
+	}
+
+	/* Get the fs geometry */
+	if (xfs_getgeom(fsfd, &fsgeom) < 0 ) {
+		fsrprintf(_("Unable to get geom on fs for: %s\n"), fname);
+		goto out;
+	}
+
+	tname = gettmpname(fname);
+
+	if (tname)
+		error = fsrfile_common(fname, tname, NULL, fd, &statbuf,
+				       NULL);
+
+out:
+	if (fsfd >= 0)
+		close(fsfd);
+	if (fd >= 0)
+		close(fd);
+	free(fshandlep);
+
+	return error;
+}
+
+
+/*
+ * This is the common defrag code for either a full fs
+ * defragmentation or a single file.  Check as much as
+ * possible with the file, fork a process to setuid to the
+ * target file owner's uid and defragment the file.
+ * This is done so the new extents created in a tmp file are
+ * reflected in the owners' quota without having to do any
+ * special code in the kernel.  When the existing extents
+ * are removed, the quotas will be correct.  It's ugly but
+ * it saves us from doing some quota  re-construction in
+ * the extent swap.  The price is that the defragmentation
+ * will fail if the owner of the target file is already at
+ * their quota limit.
+ *
+ * Both a defragmented file and most errors return -1, so callers that
+ * need to know what happened get packfile()'s result in *packedp.  It
+ * is left alone if the file was skipped before packfile() was called.
+ */
+static int
+fsrfile_common(
+	char		*fname,
+	char		*tname,
+	char		*fsname,
+	int		fd,
+	xfs_bstat_t	*statp,
+	int		*packedp)
+{
+	int		error;
+	struct statvfs64 vfss;
+	struct fsxattr	fsx;
+	unsigned long	bsize;
+
+	if(uflag)
+		fsrprintf("User has forced partial defragmentation on %s\n",fname);
+
+	if (vflag)
+		fsrprintf("%s\n", fname);
+
+	if (fsync(fd) < 0) {
+		fsrprintf(_("sync failed: %s: %s\n"), fname, strerror(errno));
+		return -1;
+	}
+
+	if (statp->bs_size == 0 && statp->bs_aextents < FSR_AFORK_MIN) {
+		if (vflag)
+			fsrprintf(_("%s: zero size, ignoring\n"), fname);
+		return(0);
+	}
+
+	/* Check if a mandatory lock is set on the file to try and
+	 * avoid blocking indefinitely on the reads later. Note that
+	 * someone could still set a mandatory lock after this check
+	 * but before all reads have completed to block fsr reads.
+	 * This change just closes the window a bit.
+	 */
+	if ( (statp->bs_mode & S_ISGID) && ( ! (statp->bs_mode&S_IXGRP) ) ) {
+		struct flock fl;
+
+		fl.l_type = F_RDLCK;
+		fl.l_whence = SEEK_SET;
+		fl.l_start = (off_t)0;
+		fl.l_len = 0;
+		if ((fcntl(fd, F_GETLK, &fl)) < 0 ) {
+			if (vflag)
+				fsrprintf(_("locking check failed: %s\n"),
+					fname);
+			return(-1);
+		}
+		if (fl.l_type != F_UNLCK) {
+			/* Mandatory lock is set */
+			if (vflag)
+				fsrprintf(_("mandatory lock: %s: ignoring\n"),
+					fname);
+			return(-1);
+		}
+	}
+
+	/*
+	 * Check if there is room to copy the file.
+	 *
+	 * Note that xfs_bstat.bs_blksize returns the filesystem blocksize,
+	 * not the optimal I/O size as struct stat.
+	 */
+	if (statvfs64(fsname ? fsname : fname, &vfss) < 0) {
+		fsrprintf(_("unable to get fs stat on %s: %s\n"),
+			fname, strerror(errno));
+		return -1;
+	}
+	bsize = vfss.f_frsize ? vfss.f_frsize : vfss.f_bsize;
+	
+	freesp = vfss.f_bfree * bsize - minimumfree;
+
+	if (statp->bs_blksize * statp->bs_blocks >
+	    vfss.f_bfree * bsize - minimumfree) {
+		if(uflag)								
+		{	
+		 fsrprintf("Free Space: freesp = %lld bytes\n",freesp);							
+		 fsrprintf("File Size: statp->bs_size = %lld bytes\n",statp->bs_size);	
+		 fsrprintf("Insufficent free space to defragment ENTIRE file: %s\n", fname);
+		}										
+		else
+		{										
+		fsrprintf(_("insufficient freespace for: %s: "
+			    "size=%lld: ignoring\n"), fname,
+			    statp->bs_blksize * statp->bs_blocks);
+		return 1;
+		}									
+	}
+
+	if ((ioctl(fd, XFS_IOC_FSGETXATTR, &fsx)) < 0) {
+		fsrprintf(_("failed to get inode attrs: %s\n"), fname);
+		return(-1);
+	}
+	if (fsx.fsx_xflags & (XFS_XFLAG_IMMUTABLE|XFS_XFLAG_APPEND)) {
+		if (vflag)
+			fsrprintf(_("%s: immutable/append, ignoring\n"), fname);
+		return(0);
+	}
+	if (fsx.fsx_xflags & XFS_XFLAG_NODEFRAG) {
+		if (vflag)
+			fsrprintf(_("%s: marked as don't defrag, ignoring\n"),
+			    fname);
+		return(0);
+	}
+	if (fsx.fsx_xflags & XFS_XFLAG_REALTIME) {
+		if (xfs_getrt(fd, &vfss) < 0) {
+			fsrprintf(_("cannot get realtime geometry for: %s\n"),
+				fname);
+			return(-1);
+		}
+		if (statp->bs_size > ((vfss.f_bfree * bsize) - minimumfree)) {
+			fsrprintf(_("low on realtime free space: %s: "
+				"ignoring file\n"), fname);
+			return(-1);
+		}
+	}
+
+	if ((RealUid != ROOT) && (RealUid != statp->bs_uid)) {
+		fsrprintf(_("cannot open: %s: Permission denied\n"), fname);
+		return -1;
+	}
+
+	/*
+	 * Previously the code forked here, & the child changed it's uid to
+	 * that of the file's owner and then called packfile(), to keep
+	 * quota counts correct.  (defragged files could use fewer blocks).
+	 *
+	 * Instead, just fchown() the temp file to the uid,gid of the
+	 * file we're defragging, in packfile().
+	 */
+
+	error = packfile(fname, tname, fd, statp, &fsx);
+
+	/* the attribute fork is rebuilt on its own, the data left alone */
+	if (!uflag && statp->bs_aextents >= FSR_AFORK_MIN &&
+	    packfile_attr(fname, tname, fd, statp) == 0 && error == 1)
+		error = 0;
+	if (packedp)
+		*packedp = error;
+	if (error)
+		return error;
+	return -1; /* no error */
+}
+
+/*
+ * Attempt to set the attr fork up correctly. This is simple for attr1
+ * filesystems as they have a fixed inode fork offset. In that case
+ * just create an attribute and that's all we need to do.
+ *
+ * For attr2 filesystems, see if we have the actual fork offset in
+ * the bstat structure. If so, just create additional attributes on
+ * the temporary inode until the offset matches.
+ *
+ * If it doesn't exist, we can only do best effort. Add an attribute at a time
+ * to move the inode fork around, but take into account that the attribute
+ * might be too small to move the fork every time we add one.  This should
+ * hopefully put the fork offset in the right place. It's not a big deal if we
+ * don't get it right - the kernel will reject it when we try to swap extents.
+ */
+static int
+fsr_setup_attr_fork(
+	int		fd,
+	int		tfd,
+	xfs_bstat_t	*bstatp)
+{
+	struct stat64	tstatbuf;
+	int		i;
+	int		diff = 0;
+	int		last_forkoff = 0;
+	int		no_change_cnt = 0;
+	int		ret;
+
+	if (!(bstatp->bs_xflags & XFS_XFLAG_HASATTR))
+		return 0;
+
+	/*
+	 * use the old method if we have attr1 or the kernel does not yet
+	 * support passing the fork offset in the bulkstat data.
+	 */
+	if (!(fsgeom.flags & XFS_FSOP_GEOM_FLAGS_ATTR2) ||
+	    bstatp->bs_forkoff == 0) {
+		/* attr1 */
+		ret = fsetxattr(tfd, "user.X", "X", 1, XATTR_CREATE);
+		if (ret) {
+			fsrprintf(_("could not set ATTR\n"));
+			return -1;
+		}
+		goto out;
+	}
+
+	/* attr2 w/ fork offsets */
+
+	if (fstat64(tfd, &tstatbuf) < 0) {
+		fsrprintf(_("unable to stat temp file: %s\n"),
+					strerror(errno));
+		return -1;
+	}
+
+	i = 0;
+	do {
+		xfs_bstat_t	tbstat;
+		xfs_ino_t	ino;
+		char		name[64];
+
+		/*
+		 * bulkstat the temp inode to see what the forkoff is.  Use
+		 * this to compare against the target and determine what we
+		 * need to do.
+		 */
+		ino = tstatbuf.st_ino;
+		if ((xfs_bulkstat_single(tfd, &ino, &tbstat)) < 0) {
+			fsrprintf(_("unable to get bstat on temp file: %s\n"),
+						strerror(errno));
+			return -1;
+		}
+		if (dflag)
+			fsrprintf(_("orig forkoff %d, temp forkoff %d\n"),
+					bstatp->bs_forkoff, tbstat.bs_forkoff);
+		diff = tbstat.bs_forkoff - bstatp->bs_forkoff;
+
+		/* if they are equal, we are done */
+		if (!diff)
+			goto out;
+
+		snprintf(name, sizeof(name), "user.%d", i);
+
+		/*
+		 * If there is no attribute, then we need to create one to get
+		 * an attribute fork at the default location.
+		 */
+		if (!tbstat.bs_forkoff) {
+			ASSERT(i == 0);
+			ret = fsetxattr(tfd, name, "XX", 2, XATTR_CREATE);
+			if (ret) {
+				fsrprintf(_("could not set ATTR\n"));
+				return -1;
+			}
+			continue;
+		} else if (i == 0) {
+			struct fsxattr	fsx;
+			/*
+			 * First pass, and temp file already has an inline
+			 * xattr, probably due to selinux.
+			 *
+			 * It's *possible* that the temp file attr area
+			 * is larger than the target file's, if the 
+			 * target file's attrs are not inline:
+			 *
+			 *  Target		 Temp
+			 * +-------+ 0		+-------+ 0
+			 * |	   |		|       |
+			 * |	   |		| Data  |
+			 * | Data  |		|       |
+			 * |	   |		v-------v forkoff
+			 * |	   |		|       |
+			 * v-------v forkoff	| Attr  | local
+			 * | Attr  | ext/btree	|       |
+			 * +-------+		+-------+
+			 *
+			 * FSGETXATTRA will tell us nr of attr extents in
+			 * target, if any.  If none, it's local:
+			 */
+
+			memset(&fsx, 0, sizeof(fsx));
+			if (ioctl(fd, XFS_IOC_FSGETXATTRA, &fsx)) {
+				fsrprintf(_("FSGETXATTRA failed on target\n"));
+				return -1;
+			}
+
+			/*
+			 * If target attr area is less than the temp's (diff < 0)
+			 * and the target is not local, write a big attr to
+			 * the temp file to knock the attr out of local format,
+			 * to match the target.  (This should actually *increase*
+			 * the temp file's forkoffset when the attr moves out
+			 * of the inode)
+			 */
+ 			if (diff < 0 && fsx.fsx_nextents > 0) {
+				char val[2048];
+				memset(val, 'X', 2048);
+				if (fsetxattr(tfd, name, val, 2048, 0)) {
+					fsrprintf(_("big ATTR set failed\n"));
+					return -1;
+				}
+				/* Go back & see where we're at now */
+				continue;
+			}
+		}
+
+		/*
+		 * make a progress check so we don't get stuck trying to extend
+		 * a large btree form attribute fork.
+		 */
+		if (last_forkoff == tbstat.bs_forkoff) {
+			if (no_change_cnt++ > 10)
+				break;
+		} else /* progress! */
+			no_change_cnt = 0;
+		last_forkoff = tbstat.bs_forkoff;
+
+		/* work out which way to grow the fork */
+		if (abs(diff) > fsgeom.inodesize - sizeof(struct xfs_dinode)) {
+			fsrprintf(_("forkoff diff %d too large!\n"), diff);
+			return -1;
+		}
+
+		/*
+		 * if the temp inode fork offset is still smaller then we have
+		 * to grow the data fork
+		 */
+		if (diff < 0) {
+			/*
+			 * create some temporary extents in the inode to move
+			 * the fork in the direction we need. This can be done
+			 * by preallocating some single block extents at
+			 * non-contiguous offsets.
+			 */
+			/* XXX: unimplemented! */
+			if (dflag)
+				printf(_("data fork growth unimplemented\n"));
+			goto out;
+		}
+
+		/* we need to grow the attr fork, so create another attr */
+		ret = fsetxattr(tfd, name, "XX", 2, XATTR_CREATE);
+		if (ret) {
+			fsrprintf(_("could not set ATTR\n"));
+			return -1;
+		}
+
+	} while (++i < 100); /* don't go forever */
+
+out:
+	if (dflag)
+		fsrprintf(_("set temp attr\n"));
+	/* We failed to resolve the fork difference */
+	if (dflag && diff)
+		fsrprintf(_("failed to match fork offset\n"));;
+
+	return 0;
+}
+
+/*
+ * Attribute forks.
+ *
+ * Files with many or large extended attributes keep them in extents of
+ * their own, which fragment just like data and cost a seek each on every
+ * lookup.  Attribute space can't be preallocated, but writing all the
+ * attributes in one go to a new inode lays them out about as well as
+ * free space allows.  So the attributes are copied to a temporary file
+ * without data and the kernel swaps the two attribute forks
+ * (XFS_SX_VERSION_ATTR), leaving the data where it is.
+ */
+#define FSR_AMAPSIZE	64
+#define FSR_XATTR_MAX	65536		/* largest attribute value */
+
+/*
+ * Count the extents of the attribute fork and the discontiguities
+ * between them.
+ */
+static int
+fsr_attr_layout(int fd, int *nextents, int *ndisc)
+{
+	struct getbmap	map[FSR_AMAPSIZE];
+	__s64		next = -1;
+	int		i;
+
+	*nextents = *ndisc = 0;
+	memset(map, 0, sizeof(map[0]));
+	map[0].bmv_count = FSR_AMAPSIZE;
+	map[0].bmv_length = -1;
+	do {
+		if (ioctl(fd, XFS_IOC_GETBMAPA, map) < 0)
+			return -1;
+		for (i = 1; i <= map[0].bmv_entries; i++) {
+			if (map[i].bmv_block < 0)
+				continue;
+			if (next >= 0 && map[i].bmv_block != next)
+				(*ndisc)++;
+			next = map[i].bmv_block + map[i].bmv_length;
+			(*nextents)++;
+		}
+	} while (map[0].bmv_entries == FSR_AMAPSIZE - 1);
+	return 0;
+}
+
+/*
+ * Is 'name' in the flistxattr() list 'names' of 'len' bytes?
+ */
+static int
+attr_listed(char *names, ssize_t len, char *name)
+{
+	char	*p;
+
+	for (p = names; p < names + len; p += strlen(p) + 1)
+		if (strcmp(p, name) == 0)
+			return 1;
+	return 0;
+}
+
+/*
+ * Rebuild the attribute fork of fd.  Returns like packfile().
+ */
+static int
+packfile_attr(char *fname, char *tname, int fd, xfs_bstat_t *statp)
+{
+	xfs_swapext_t	sx;
+	char		*names = NULL, *tnames = NULL, *value = NULL;
+	char		*name;
+	ssize_t		nlen, tlen, vlen;
+	int		cur_nextents, cur_ndisc, new_nextents, new_ndisc;
+	int		tfd = -1;
+	int		retval = -1;
+
+	if (fsr_attr_layout(fd, &cur_nextents, &cur_ndisc) < 0) {
+		fsrprintf(_("failed reading attribute extents: %s\n"), fname);
+		return -1;
+	}
+	if (cur_ndisc == 0) {
+		if (vflag)
+			fsrprintf(_("%s: %d attribute extents, physically "
+				"contiguous\n"), fname, cur_nextents);
+		return 1;
+	}
+
+	if ((nlen = flistxattr(fd, NULL, 0)) <= 0)
+		return nlen < 0 ? -1 : 1;
+	if (!(names = malloc(nlen)) || !(value = malloc(FSR_XATTR_MAX))) {
+		fsrprintf(_("malloc failed: %s\n"), strerror(errno));
+		goto out;
+	}
+	if ((nlen = flistxattr(fd, names, nlen)) < 0) {
+		fsrprintf(_("could not list attributes: %s: %s\n"),
+			  fname, strerror(errno));
+		goto out;
+	}
+
+	if ((tfd = open(tname, O_CREAT|O_EXCL|O_RDWR, 0600)) < 0) {
+		if (vflag)
+			fsrprintf(_("could not open tmp file: %s: %s\n"),
+				   tname, strerror(errno));
+		goto out;
+	}
+	unlink(tname);
+
+	for (name = names; name < names + nlen; name += strlen(name) + 1) {
+		vlen = fgetxattr(fd, name, value, FSR_XATTR_MAX);
+		if (vlen < 0 && errno == ENODATA)
+			continue;	/* removed since */
+		if (vlen < 0 || fsetxattr(tfd, name, value, vlen, 0) < 0) {
+			fsrprintf(_("could not copy attribute %s: %s: %s\n"),
+				  name, fname, strerror(errno));
+			goto out;
+		}
+	}
+
+	/* the temporary file may have been given attributes of its own */
+	if ((tlen = flistxattr(tfd, NULL, 0)) > 0 &&
+	    (tnames = malloc(tlen)) &&
+	    (tlen = flistxattr(tfd, tnames, tlen)) > 0) {
+		for (name = tnames; name < tnames + tlen;
+		     name += strlen(name) + 1) {
+			if (attr_listed(names, nlen, name))
+				continue;
+			if (fremovexattr(tfd, name) < 0) {
+				if (vflag)
+					fsrprintf(_("%s: could not remove "
+						"attribute %s from tmp\n"),
+						fname, name);
+				retval = 1;
+				goto out;
+			}
+		}
+	}
+
+	if (fsr_attr_layout(tfd, &new_nextents, &new_ndisc) < 0)
+		goto out;
+	if (dflag)
+		fsrprintf(_("Temporary file has %d attribute extents "
+			"(%d in original)\n"), new_nextents, cur_nextents);
+	if (new_ndisc >= cur_ndisc) {
+		if (vflag)
+			fsrprintf(_("No improvement to attributes will be made "
+				"(skipping): %s\n"), fname);
+		retval = 1;
+		goto out;
+	}
+
+	/* switch to the owner's id, to keep quota in line */
+	if (fchown(tfd, statp->bs_uid, statp->bs_gid) < 0) {
+		if (vflag)
+			fsrprintf(_("failed to fchown tmpfile %s: %s\n"),
+				  tname, strerror(errno));
+		goto out;
+	}
+
+	/*
+	 * A zero length makes kernels that don't know XFS_SX_VERSION_ATTR
+	 * refuse the swap as a data swap of the wrong size.
+	 */
+	memset(&sx, 0, sizeof(sx));
+	sx.sx_stat     = *statp; /* struct copy */
+	sx.sx_version  = XFS_SX_VERSION_ATTR;
+	sx.sx_fdtarget = fd;
+	sx.sx_fdtmp    = tfd;
+	sx.sx_offset   = 0;
+	sx.sx_length   = 0;
+	if (xfs_swapext(fd, &sx) < 0) {
+		if (errno == EBUSY) {
+			if (vflag || dflag)
+			   fsrprintf(_("%s: file busy\n"), fname);
+		} else if (errno == EINVAL) {
+			if (vflag || dflag)
+			   fsrprintf(_("%s: attribute forks don't fit\n"),
+				     fname);
+		} else {
+			fsrprintf(_("XFS_IOC_SWAPEXT (attr) failed: %s: %s\n"),
+				  fname, strerror(errno));
+		}
+		goto out;
+	}
+
+	fsr_attr_layout(fd, &new_nextents, &new_ndisc);
+	if (vflag)
+		fsrprintf(_("attribute extents before:%d after:%d %s %s\n"),
+			  cur_nextents, new_nextents,
+			  new_ndisc < cur_ndisc ? "DONE" : "    ", fname);
+	retval = new_ndisc < cur_ndisc ? 0 : 1;
+
+out:
+	if (tfd != -1)
+		close(tfd);
+	free(tnames);
+	free(value);
+	free(names);
+	return retval;
+}
+
+/*
+ * Busy files.
+ *
+ * XFS_IOC_SWAPEXT refuses a file that is mapped or whose timestamps
+ * moved since it was bulkstat'ed, but only after all of it has been
+ * copied.  Look for that before and during the copy instead:
+ *  - before copying a large file, look for it in every process' maps;
+ *  - hold a write lease on it while copying.  Anyone else opening or
+ *    truncating it breaks the lease; we let go straight away so they
+ *    don't wait on us, and give up on the copy if they want to write;
+ *  - between chunks, check its timestamps are still those of the
+ *    bstat the swap will be checked against.
+ */
+#define FSR_BUSY_MAPCHECK	(64LL * 1024 * 1024)	/* scan maps above */
+
+static volatile sig_atomic_t	lease_broken;
+static int			lease_fd = -1;
+
+static void
+busy_sigio(int sig)
+{
+	lease_broken = 1;
+}
+
+/*
+ * Is the file open on fd mapped by any process?
+ */
+static int
+busy_mapped(int fd)
+{
+	struct stat64		st;
+	struct dirent		*de;
+	DIR			*dp;
+	FILE			*mp;
+	char			path[64];
+	char			line[PATH_MAX + 128];
+	unsigned int		maj, mnr;
+	unsigned long long	ino;
+	int			mapped = 0;
+
+	if (fstat64(fd, &st) < 0 || !(dp = opendir("/proc")))
+		return 0;
+	while (!mapped && (de = readdir(dp)) != NULL) {
+		if (de->d_name[0] < '0' || de->d_name[0] > '9')
+			continue;
+		snprintf(path, sizeof(path), "/proc/%s/maps", de->d_name);
+		if (!(mp = fopen(path, "r")))
+			continue;	/* gone, or not ours to look at */
+		while (fgets(line, sizeof(line), mp)) {
+			if (sscanf(line, "%*s %*s %*s %x:%x %llu",
+				   &maj, &mnr, &ino) == 3 &&
+			    ino == st.st_ino &&
+			    makedev(maj, mnr) == st.st_dev) {
+				mapped = 1;
+				break;
+			}
+		}
+		fclose(mp);
+	}
+	closedir(dp);
+	return mapped;
+}
+
+/*
+ * Take a write lease on the file open on fd.  Failing to is no reason
+ * not to defrag it; EAGAIN only means someone else has it open.
+ */
+static void
+busy_lease(int fd)
+{
+	static int		nolease;
+	static int		handler;
+	struct sigaction	sa;
+
+	if (nolease)
+		return;
+	if (!handler) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = busy_sigio;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGIO, &sa, NULL);
+		handler = 1;
+	}
+	lease_broken = 0;
+	if (fcntl(fd, F_SETLEASE, F_WRLCK) < 0) {
+		if (errno == EINVAL || errno == EACCES) {
+			if (dflag)
+				fsrprintf(_("no file leases: %s\n"),
+					  strerror(errno));
+			nolease = 1;
+		}
+		return;
+	}
+	lease_fd = fd;
+}
+
+static void
+busy_unlease(void)
+{
+	if (lease_fd < 0)
+		return;
+	fcntl(lease_fd, F_SETLEASE, F_UNLCK);
+	lease_fd = -1;
+}
+
+/*
+ * Called between copy chunks.  Returns 1 if the file has been, or is
+ * about to be, changed and the copy is wasted.
+ */
+static int
+busy_check(char *fname, int fd, xfs_bstat_t *statp)
+{
+	struct stat64	st;
+	int		type;
+
+	if (lease_broken && lease_fd >= 0) {
+		/* what the breaker needs the lease brought down to */
+		type = fcntl(lease_fd, F_GETLEASE);
+		busy_unlease();
+		if (type == F_UNLCK) {
+			if (vflag || dflag)
+				fsrprintf(_("%s: opened for writing, "
+					"defrag aborted\n"), fname);
+			return 1;
+		}
+	}
+	if (fstat64(fd, &st) < 0)
+		return 0;
+	if (st.st_mtim.tv_sec != statp->bs_mtime.tv_sec ||
+	    st.st_mtim.tv_nsec != statp->bs_mtime.tv_nsec ||
+	    st.st_ctim.tv_sec != statp->bs_ctime.tv_sec ||
+	    st.st_ctim.tv_nsec != statp->bs_ctime.tv_nsec) {
+		if (vflag || dflag)
+			fsrprintf(_("%s: file modified defrag aborted\n"),
+				  fname);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Copy the extents in outmap from fd to tfd with plain read() and
+ * write(), one buffer at a time.  This is what the -C debug option
+ * needs, and what we fall back to if no asynchronous I/O is available.
+ */
+static int
+packfile_copy_sync(char *fname, char *tname, int fd, int tfd, void *fbuf,
+		   unsigned blksz_dio, unsigned dio_min, int nextents,
+		   char *ffname, int ffd, xfs_bstat_t *statp)
+{
+	int		extent;
+	off64_t		cnt, pos;
+	int		ct, wc, wc_b4;
+
+	for (extent = 0; extent < nextents; extent++) {
+		pos = outmap[extent].bmv_offset;
+		/* holes, and preallocated space, are left as they are */
+		if (outmap[extent].bmv_block == -1 ||
+		    outmap[extent].bmv_block == FSR_BMV_UNWRITTEN) {
+			if (lseek64(tfd, outmap[extent].bmv_length, SEEK_CUR) < 0) {
+				fsrprintf(_("could not lseek in tmpfile: %s : %s\n"),
+				   tname, strerror(errno));
+				return -1;
+			}
+			if (lseek64(fd, outmap[extent].bmv_length, SEEK_CUR) < 0) {
+				fsrprintf(_("could not lseek in file: %s : %s\n"),
+				   fname, strerror(errno));
+				return -1;
+			}
+			continue;
+		} else if (outmap[extent].bmv_length == 0) {
+			/* to catch holes at the beginning of the file */
+			continue;
+		}
+		for (cnt = outmap[extent].bmv_length; cnt > 0;
+		     cnt -= ct, pos += ct) {
+			if (busy_check(fname, fd, statp))
+				return -1;
+			if (nfrags && --nfrags) {
+				ct = min(cnt, dio_min);
+			} else if (cnt % dio_min == 0) {
+				ct = min(cnt, blksz_dio);
+			} else {
+				ct = min(cnt + dio_min - (cnt % dio_min),
+					blksz_dio);
+			}
+			ct = read(fd, fbuf, ct);
+			if (ct == 0) {
+				/* EOF, stop trying to read */
+				return 0;
+			}
+			/* Ensure we do direct I/O to correct block
+			 * boundaries.
+			 */
+			if (ct % dio_min != 0) {
+				wc = ct + dio_min - (ct % dio_min);
+			} else {
+				wc = ct;
+			}
+			wc_b4 = wc;
+			if (ct < 0 || ((wc = write(tfd, fbuf, wc)) != wc_b4)) {
+				if (ct < 0)
+					fsrprintf(_("bad read of %d bytes "
+						"from %s: %s\n"), wc_b4,
+						fname, strerror(errno));
+				else if (wc < 0)
+					fsrprintf(_("bad write of %d bytes "
+						"to %s: %s\n"), wc_b4,
+						tname, strerror(errno));
+				else {
+					/*
+					 * Might be out of space
+					 *
+					 * Try to finish write
+					 */
+					int resid = ct-wc;
+
+					if ((wc = write(tfd, ((char *)fbuf)+wc,
+							resid)) == resid) {
+						/* worked on second attempt? */
+						continue;
+					}
+					else if (wc < 0) {
+						fsrprintf(_("bad write2 of %d "
+							"bytes to %s: %s\n"),
+							resid, tname,
+							strerror(errno));
+					} else {
+						fsrprintf(_("bad copy to %s\n"),
+							tname);
+					}
+				}
+				return -1;
+			}
+			if (nfrags) {
+				/* Do a matching write to the tmp file */
+				wc_b4 = wc;
+				if (((wc = write(ffd, fbuf, wc)) != wc_b4)) {
+					fsrprintf(_("bad write of %d bytes "
+						"to %s: %s\n"),
+						wc_b4, ffname, strerror(errno));
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Asynchronous copy engine for packfile().
+ *
+ * The extents are copied in blksz_dio sized chunks through aio_depth
+ * aligned buffers.  Each buffer goes read -> write -> free, so while
+ * chunk N is being written the following chunks are already being
+ * read.  Chunks are read and written at the same offset in both files,
+ * so they may complete in any order.
+ *
+ * aio_probe() picks the backend once at startup: io_uring if fsr was
+ * built with liburing and the kernel allows it, libaio after that, and
+ * plain pread/pwrite if neither works.  The ring and buffers are then
+ * kept for the rest of the run; forked workers set up their own on
+ * first use since neither kind of context survives fork().
+ */
+#define AIO_FREE	0
+#define AIO_READ	1
+#define AIO_WRITE	2
+
+struct fsr_aiobuf {
+	void		*buf;
+	off64_t		off;		/* file offset of this chunk */
+	int		len;		/* bytes read, or being written */
+	int		state;
+#ifdef HAVE_LIBAIO
+	struct iocb	iocb;
+#endif
+};
+
+struct fsr_aio {
+	int			backend;
+	pid_t			pid;		/* process the context belongs to */
+	int			depth;
+	unsigned		bufsz;
+	unsigned		align;
+	struct fsr_aiobuf	*bufs;
+#ifdef HAVE_LIBURING
+	struct io_uring		ring;
+#endif
+#ifdef HAVE_LIBAIO
+	io_context_t		ctx;
+#endif
+};
+
+static struct fsr_aio aio_eng;
+
+/*
+ * Set up a context for one backend.  Returns 0 or a negative errno.
+ */
+static int
+aio_open(struct fsr_aio *ap, int backend, int depth)
+{
+	int	error = -ENOSYS;
+
+	switch (backend) {
+#ifdef HAVE_LIBURING
+	case AIO_URING:
+		error = io_uring_queue_init(depth, &ap->ring, 0);
+		break;
+#endif
+#ifdef HAVE_LIBAIO
+	case AIO_LIBAIO:
+		memset(&ap->ctx, 0, sizeof(ap->ctx));
+		error = io_setup(depth, &ap->ctx);
+		break;
+#endif
+	}
+	if (error)
+		return error;
+	ap->backend = backend;
+	ap->pid = getpid();
+	ap->depth = depth;
+	return 0;
+}
+
+static void
+aio_close(struct fsr_aio *ap)
+{
+	int	i;
+
+	switch (ap->backend) {
+#ifdef HAVE_LIBURING
+	case AIO_URING:
+		io_uring_queue_exit(&ap->ring);
+		break;
+#endif
+#ifdef HAVE_LIBAIO
+	case AIO_LIBAIO:
+		io_destroy(ap->ctx);
+		break;
+#endif
+	}
+	if (ap->bufs) {
+		for (i = 0; i < ap->depth; i++)
+			free(ap->bufs[i].buf);
+		free(ap->bufs);
+	}
+	memset(ap, 0, sizeof(*ap));
+}
+
+/*
+ * Pick the copy backend, trying io_uring, then libaio, then falling
+ * back to synchronous copies.  Any setup failure moves on to the next
+ * one: io_uring may be missing (ENOSYS), disabled by sysctl (EPERM) or
+ * short of locked memory (ENOMEM) on kernels where libaio still works.
+ */
+static void
+aio_probe(void)
+{
+	int	backend;
+	int	error;
+
+	if (aio_backend >= 0)
+		return;
+	aio_backend = AIO_SYNC;
+	if (aio_depth < 2)
+		return;
+	for (backend = AIO_URING; backend <= AIO_LIBAIO; backend++) {
+		error = aio_open(&aio_eng, backend, aio_depth);
+		if (!error) {
+			aio_backend = backend;
+			break;
+		}
+		if (dflag && error != -ENOSYS)
+			fsrprintf(_("%s unavailable: %s\n"),
+				aio_names[backend], strerror(-error));
+	}
+	if (vflag)
+		fsrprintf(_("copying with %s, %d I/Os in flight\n"),
+			aio_names[aio_backend],
+			aio_backend == AIO_SYNC ? 1 : aio_depth);
+}
+
+/*
+ * Return this process' copy context with at least depth buffers of
+ * bufsz bytes, or NULL to copy synchronously.
+ */
+static struct fsr_aio *
+aio_get(unsigned bufsz, unsigned align)
+{
+	struct fsr_aio	*ap = &aio_eng;
+	int		i;
+
+	if (aio_backend == AIO_SYNC)
+		return NULL;
+
+	/* inherited from the parent across fork(), not usable here */
+	if (ap->pid != getpid()) {
+		aio_close(ap);
+		if (aio_open(ap, aio_backend, aio_depth) < 0) {
+			aio_backend = AIO_SYNC;
+			return NULL;
+		}
+	}
+
+	if (ap->bufs && bufsz <= ap->bufsz && align <= ap->align)
+		return ap;
+
+	if (ap->bufs) {
+		for (i = 0; i < ap->depth; i++)
+			free(ap->bufs[i].buf);
+		free(ap->bufs);
+	}
+	ap->bufsz = 0;
+	ap->bufs = calloc(ap->depth, sizeof(struct fsr_aiobuf));
+	if (!ap->bufs)
+		return NULL;
+	for (i = 0; i < ap->depth; i++) {
+		ap->bufs[i].buf = memalign(align, bufsz);
+		if (!ap->bufs[i].buf) {
+			while (--i >= 0)
+				free(ap->bufs[i].buf);
+			free(ap->bufs);
+			ap->bufs = NULL;
+			return NULL;
+		}
+	}
+	ap->bufsz = bufsz;
+	ap->align = align;
+	return ap;
+}
+
+/*
+ * Queue a read or write of bp->len bytes at bp->off.
+ */
+static int
+aio_submit(struct fsr_aio *ap, struct fsr_aiobuf *bp, int fd, int state)
+{
+	bp->state = state;
+	switch (ap->backend) {
+#ifdef HAVE_LIBURING
+	case AIO_URING: {
+		struct io_uring_sqe	*sqe = io_uring_get_sqe(&ap->ring);
+		int			error;
+
+		if (!sqe) {
+			errno = EBUSY;
+			return -1;
+		}
+		if (state == AIO_READ)
+			io_uring_prep_read(sqe, fd, bp->buf, bp->len, bp->off);
+		else
+			io_uring_prep_write(sqe, fd, bp->buf, bp->len, bp->off);
+		io_uring_sqe_set_data(sqe, bp);
+		if ((error = io_uring_submit(&ap->ring)) < 0) {
+			errno = -error;
+			return -1;
+		}
+		return 0;
+	}
+#endif
+#ifdef HAVE_LIBAIO
+	case AIO_LIBAIO: {
+		struct iocb	*cb = &bp->iocb;
+		int		error;
+
+		if (state == AIO_READ)
+			io_prep_pread(cb, fd, bp->buf, bp->len, bp->off);
+		else
+			io_prep_pwrite(cb, fd, bp->buf, bp->len, bp->off);
+		cb->data = bp;
+		if ((error = io_submit(ap->ctx, 1, &cb)) != 1) {
+			errno = error < 0 ? -error : EAGAIN;
+			return -1;
+		}
+		return 0;
+	}
+#endif
+	}
+	errno = ENOSYS;
+	return -1;
+}
+
+/*
+ * Wait for the next I/O to complete.  Returns the buffer it was for
+ * and sets *res to the byte count or -errno.
+ */
+static struct fsr_aiobuf *
+aio_reap(struct fsr_aio *ap, long *res)
+{
+	struct fsr_aiobuf	*bp = NULL;
+	int			error;
+
+	switch (ap->backend) {
+#ifdef HAVE_LIBURING
+	case AIO_URING: {
+		struct io_uring_cqe	*cqe;
+
+		if ((error = io_uring_wait_cqe(&ap->ring, &cqe)) < 0) {
+			errno = -error;
+			return NULL;
+		}
+		bp = io_uring_cqe_get_data(cqe);
+		*res = cqe->res;
+		io_uring_cqe_seen(&ap->ring, cqe);
+		break;
+	}
+#endif
+#ifdef HAVE_LIBAIO
+	case AIO_LIBAIO: {
+		struct io_event		ev;
+
+		if ((error = io_getevents(ap->ctx, 1, 1, &ev, NULL)) != 1) {
+			errno = error < 0 ? -error : EINTR;
+			return NULL;
+		}
+		bp = ev.data;
+		*res = (long)ev.res;
+		break;
+	}
+#endif
+	default:
+		(void)error;
+		errno = ENOSYS;
+	}
+	return bp;
+}
+
+/*
+ * Copy the extents in outmap from fd to tfd with aio_depth reads and
+ * writes in flight.  Chunk sizes and short write handling follow
+ * packfile_copy_sync().
+ */
+static int
+packfile_copy(char *fname, char *tname, int fd, int tfd, void *fbuf,
+	      unsigned blksz_dio, unsigned dio_min, unsigned d_mem,
+	      int nextents, xfs_bstat_t *statp)
+{
+	struct fsr_aio		*ap;
+	struct fsr_aiobuf	*bp;
+	int			extent = 0;
+	off64_t			pos = 0, cnt = 0;
+	int			inflight = 0;
+	int			eof = 0;
+	int			error = 0;
+	int			i, ct, resid;
+	long			res;
+
+	ap = aio_get(blksz_dio, d_mem);
+	if (!ap) {
+		if (dflag && aio_backend != AIO_SYNC)
+			fsrprintf(_("no async I/O buffers, copying "
+				"synchronously\n"));
+		return packfile_copy_sync(fname, tname, fd, tfd, fbuf,
+				blksz_dio, dio_min, nextents, NULL, -1,
+				statp);
+	}
+	for (i = 0; i < ap->depth; i++)
+		ap->bufs[i].state = AIO_FREE;
+
+	for (;;) {
+		if (!error && busy_check(fname, fd, statp))
+			error = -1;
+
+		/* fill every free buffer with a read of the next chunk */
+		for (i = 0; i < ap->depth && !eof && !error; i++) {
+			bp = &ap->bufs[i];
+			if (bp->state != AIO_FREE)
+				continue;
+			while (cnt == 0 && extent < nextents) {
+				if (outmap[extent].bmv_block != -1 &&
+				    outmap[extent].bmv_block != FSR_BMV_UNWRITTEN) {
+					pos = outmap[extent].bmv_offset;
+					cnt = outmap[extent].bmv_length;
+				}
+				extent++;
+			}
+			if (cnt == 0)
+				break;
+			if (cnt % dio_min == 0)
+				ct = min(cnt, blksz_dio);
+			else
+				ct = min(cnt + dio_min - (cnt % dio_min),
+					 blksz_dio);
+			bp->off = pos;
+			bp->len = ct;
+			if (aio_submit(ap, bp, fd, AIO_READ) < 0) {
+				fsrprintf(_("could not queue read of %d bytes "
+					"from %s: %s\n"), ct, fname,
+					strerror(errno));
+				bp->state = AIO_FREE;
+				error = -1;
+				break;
+			}
+			inflight++;
+			pos += ct;
+			cnt = (ct < cnt) ? cnt - ct : 0;
+		}
+		if (!inflight)
+			break;
+
+		bp = aio_reap(ap, &res);
+		if (!bp) {
+			fsrprintf(_("async I/O failed on %s: %s\n"),
+				fname, strerror(errno));
+			/*
+			 * Can't tell what is still in flight, so drop the
+			 * context; the next file sets up a fresh one.
+			 */
+			aio_close(ap);
+			return -1;
+		}
+		inflight--;
+
+		if (bp->state == AIO_READ) {
+			if (res < 0) {
+				fsrprintf(_("bad read of %d bytes from %s: %s\n"),
+					bp->len, fname, strerror(-res));
+				error = -1;
+			} else if (res == 0) {
+				/* EOF, stop trying to read */
+				eof = 1;
+			}
+			if (res <= 0 || error) {
+				bp->state = AIO_FREE;
+				continue;
+			}
+			/* Ensure we do direct I/O to correct block boundaries */
+			ct = res;
+			if (ct % dio_min != 0)
+				ct += dio_min - (ct % dio_min);
+			if (ct < bp->len)
+				eof = 1;
+			bp->len = ct;
+			if (aio_submit(ap, bp, tfd, AIO_WRITE) < 0) {
+				fsrprintf(_("bad write of %d bytes to %s: %s\n"),
+					ct, tname, strerror(errno));
+				bp->state = AIO_FREE;
+				error = -1;
+				continue;
+			}
+			inflight++;
+			continue;
+		}
+
+		/* write completion */
+		bp->state = AIO_FREE;
+		if (res == bp->len)
+			continue;
+		if (res < 0) {
+			fsrprintf(_("bad write of %d bytes to %s: %s\n"),
+				bp->len, tname, strerror(-res));
+			error = -1;
+			continue;
+		}
+
+		/*
+		 * Might be out of space
+		 *
+		 * Try to finish write
+		 */
+		resid = bp->len - res;
+		ct = pwrite64(tfd, (char *)bp->buf + res, resid, bp->off + res);
+		if (ct == resid)
+			continue;
+		if (ct < 0)
+			fsrprintf(_("bad write2 of %d bytes to %s: %s\n"),
+				resid, tname, strerror(errno));
+		else
+			fsrprintf(_("bad copy to %s\n"), tname);
+		error = -1;
+	}
+
+	return error;
+}
+
+/*
+ * Extents that are already back to back on disk, split only by an
+ * allocation or unwritten conversion boundary, can be merged in place.
+ * That is a metadata update, so do it before deciding to copy.
+ */
+static void
+packfile_merge(char *fname, int fd)
+{
+	static int	supported = 1;
+	__uint32_t	merged = 0;
+
+	if (!supported)
+		return;
+
+	if (ioctl(fd, XFS_IOC_MERGE_EXTENTS, &merged) < 0) {
+		if (errno == ENOTTY) {
+			/* old kernel, don't ask again */
+			supported = 0;
+			return;
+		}
+		if (vflag || dflag)
+			fsrprintf(_("XFS_IOC_MERGE_EXTENTS failed: %s: %s\n"),
+				  fname, strerror(errno));
+		return;
+	}
+	if (merged && (vflag || dflag))
+		fsrprintf(_("%s: merged %u contiguous extents\n"),
+			  fname, merged);
+}
+
+/*
+ * Partial defragmentation: extent_map() has narrowed outmap down to the
+ * window of extents that fits in free space.  Have the kernel move just
+ * that range, so the rest of the file is neither copied nor swapped.
+ */
+static int
+packfile_relocate(char *fname, int fd, int nextents, int cur_nextents)
+{
+	xfs_relocate_range_t	rr;
+	int			new_nextents;
+
+	memset(&rr, 0, sizeof(rr));
+	rr.rr_version = XFS_RR_VERSION;
+	rr.rr_offset = outmap[0].bmv_offset;
+	rr.rr_length = outmap[nextents - 1].bmv_offset +
+		       outmap[nextents - 1].bmv_length - rr.rr_offset;
+
+	if (dflag)
+		fsrprintf(_("relocating %s offset=%lld length=%lld\n"),
+			fname, (long long)rr.rr_offset,
+			(long long)rr.rr_length);
+
+	if (ioctl(fd, XFS_IOC_RELOCATE_RANGE, &rr) < 0) {
+		if (errno == ENOTTY) {
+			fsrprintf(_("%s: kernel does not support "
+				"XFS_IOC_RELOCATE_RANGE\n"), fname);
+		} else if (errno == EBUSY) {
+			/* mmap'ed file */
+			if (vflag || dflag)
+			   fsrprintf(_("%s: file busy\n"), fname);
+		} else if (errno == ENOSPC) {
+			if (vflag || dflag)
+			   fsrprintf(_("%s: no room to relocate range\n"),
+				     fname);
+		} else {
+			fsrprintf(_("XFS_IOC_RELOCATE_RANGE failed: %s: %s\n"),
+				  fname, strerror(errno));
+		}
+		return -1;
+	}
+
+	new_nextents = getnextents(fd);
+	if (vflag)
+		fsrprintf(_("extents before:%d after:%d moved:%lld %s\n"),
+			  cur_nextents, new_nextents,
+			  (long long)rr.rr_moved, fname);
+	return new_nextents < cur_nextents ? 0 : 1;
+}
+
+/*
+ * Files being appended to, logs mostly, change under any copy of them,
+ * but only at the end.  If a file has grown since the last run recorded
+ * it and the block map up to the size it had then is the same as then,
+ * that prefix has been left alone, so move just the prefix, a chunk at
+ * a time so that the writer is held up by one chunk's copy at most, and
+ * leave the tail to a later run.  A recently modified file that has not
+ * grown is copied the usual way.
+ */
+#define FSR_APPEND_ACTIVE	300			/* mtime age, secs */
+#define FSR_APPEND_SLACK	(16LL * 1024 * 1024)	/* never below EOF */
+#define FSR_APPEND_CHUNK	(64LL * 1024 * 1024)	/* per relocation */
+#define FSR_APPEND_MIN		(1LL * 1024 * 1024)	/* smallest prefix */
+
+/*
+ * The last record of a file, whether or not it still matches it.
+ */
+static struct fsr_cache_ent *
+cache_prev(xfs_bstat_t *bs)
+{
+	struct fsr_cache_ent key, *ce;
+
+	if (!cache.hdr)
+		return NULL;
+	key.ino = bs->bs_ino;
+	ce = bsearch(&key, cache.ents, cache.hdr->count,
+		     sizeof(struct fsr_cache_ent), cache_entcmp);
+	if (!ce || ce->gen != bs->bs_gen)
+		return NULL;
+	if (cache.seen)
+		cache.seen[ce - cache.ents] = 1;
+	return ce;
+}
+
+/*
+ * Hash the block map of the first 'len' bytes of the file, unwritten
+ * state included, to tell later whether that range has been written.
+ * Returns 0 if the map can't be read.
+ */
+static __u32
+fsr_maphash(int fd, __s64 len)
+{
+	struct getbmapx	map[64];
+	__u32		hash = 2166136261U;	/* FNV-1a */
+	__s64		v[4];
+	unsigned char	*p;
+	int		i, j;
+
+	memset(map, 0, sizeof(map[0]));
+	map[0].bmv_length = (len + (1 << BBSHIFT) - 1) >> BBSHIFT;
+	map[0].bmv_count = 64;
+	map[0].bmv_iflags = BMV_IF_PREALLOC;
+	do {
+		if (ioctl(fd, XFS_IOC_GETBMAPX, map) < 0)
+			return 0;
+		for (i = 1; i <= map[0].bmv_entries; i++) {
+			v[0] = map[i].bmv_offset;
+			v[1] = map[i].bmv_block;
+			v[2] = map[i].bmv_length;
+			v[3] = map[i].bmv_oflags & BMV_OF_PREALLOC;
+			for (p = (unsigned char *)v, j = 0; j < sizeof(v); j++)
+				hash = (hash ^ p[j]) * 16777619U;
+		}
+	} while (map[0].bmv_entries == 63);
+	return hash ? hash : 1;
+}
+
+/*
+ * Record a file being appended to with the hash of its block map, for
+ * packfile_prefix() to compare against next time.
+ */
+static void
+prefix_note(int fd, xfs_bstat_t *statp, double score)
+{
+	struct fsr_cache_ent	*ce;
+
+	if ((ce = cache_note(statp, FSR_CACHE_SCORED, score)) != NULL)
+		ce->maphash = fsr_maphash(fd, statp->bs_size);
+}
+
+/*
+ * The filesystem block backing byte 'offset' of the file, or -1.
+ */
+static __s64
+packfile_offset_fsb(int fd, __s64 offset)
+{
+	struct getbmap	map[2];
+
+	memset(map, 0, sizeof(map));
+	map[0].bmv_offset = offset >> BBSHIFT;
+	map[0].bmv_length = 1;
+	map[0].bmv_count = 2;
+	if (ioctl(fd, XFS_IOC_GETBMAP, map) < 0 || map[0].bmv_entries < 1 ||
+	    map[1].bmv_block < 0)
+		return -1;
+	return fsr_daddr_to_fsb(map[1].bmv_block +
+				(offset >> BBSHIFT) - map[1].bmv_offset);
+}
+
+/*
+ * Is [offset, offset + len) one extent that carries straight on from
+ * the block before it?  Then there is nothing to gain from moving it.
+ */
+static int
+packfile_range_contig(int fd, __s64 offset, __s64 len)
+{
+	struct getbmap	map[3];
+	__s64		fsb;
+
+	memset(map, 0, sizeof(map));
+	map[0].bmv_offset = offset >> BBSHIFT;
+	map[0].bmv_length = len >> BBSHIFT;
+	map[0].bmv_count = 3;
+	if (ioctl(fd, XFS_IOC_GETBMAP, map) < 0 || map[0].bmv_entries != 1 ||
+	    map[1].bmv_block < 0)
+		return 0;
+	if (!offset)
+		return 1;
+	fsb = packfile_offset_fsb(fd, offset - 1);
+	return fsb >= 0 && fsb + 1 == fsr_daddr_to_fsb(map[1].bmv_block);
+}
+
+/*
+ * Relocate [*offsetp, end) a chunk at a time, allocating each chunk
+ * just after the one before so that they end up contiguous.  *offsetp
+ * follows the chunks done and is left at the first byte not done, which
+ * is short of end if an error or the end of the run got in the way.
+ * Returns -1 if an error stopped the first chunk, else 0.
+ */
+static int
+packfile_range(char *fname, int fd, __s64 *offsetp, __s64 end, __s64 chunk)
+{
+	xfs_relocate_range_t	rr;
+	__s64			start = *offsetp, fsb;
+
+	while (*offsetp < end) {
+		if (*offsetp > start && endtime && endtime < time(0))
+			break;
+		memset(&rr, 0, sizeof(rr));
+		rr.rr_version = XFS_RR_VERSION;
+		rr.rr_offset = *offsetp;
+		rr.rr_length = min(end - *offsetp, chunk);
+		if (packfile_range_contig(fd, rr.rr_offset, rr.rr_length)) {
+			*offsetp += rr.rr_length;
+			continue;
+		}
+
+		/* follow on from where the last chunk went */
+		fsb = *offsetp ? packfile_offset_fsb(fd, *offsetp - 1) : -1;
+		if (fsb >= 0) {
+			rr.rr_flags = XFS_RR_BNO;
+			rr.rr_bno = fsb + 1;
+		} else if (tmp_hint.valid) {
+			rr.rr_flags = XFS_RR_AGNO;
+			rr.rr_agno = tmp_hint.agno;
+		}
+
+		if (dflag)
+			fsrprintf(_("relocating %s offset=%lld length=%lld\n"),
+				  fname, (long long)rr.rr_offset,
+				  (long long)rr.rr_length);
+		if (ioctl(fd, XFS_IOC_RELOCATE_RANGE, &rr) < 0) {
+			if (errno == ENOTTY) {
+				/* old kernel, don't ask again */
+				if (vflag || dflag)
+				   fsrprintf(_("no XFS_IOC_RELOCATE_RANGE, "
+					     "copying files whole\n"));
+				norelocate = 1;
+			} else if (errno == EBUSY) {
+				if (vflag || dflag)
+				   fsrprintf(_("%s: file busy\n"), fname);
+			} else if (errno == ENOSPC) {
+				if (vflag || dflag)
+				   fsrprintf(_("%s: no room to relocate "
+					     "range\n"), fname);
+			} else {
+				fsrprintf(_("XFS_IOC_RELOCATE_RANGE failed: "
+					"%s: %s\n"), fname, strerror(errno));
+			}
+			return *offsetp > start ? 0 : -1;
+		}
+		*offsetp += rr.rr_length;
+	}
+	return 0;
+}
+
+/*
+ * Returns packfile()'s result, or FSR_PREFIX_COPY if the file has not
+ * grown since the last record and should be copied as usual.
+ */
+#define FSR_PREFIX_COPY		2
+
+static int
+packfile_prefix(char *fname, int fd, xfs_bstat_t *statp, int cur_nextents,
+		double score)
+{
+	struct fsr_cache_ent	*ce = cache_prev(statp);
+	__s64			stable, offset = 0;
+	int			new_nextents;
+
+	if (ce && statp->bs_size <= ce->size)
+		return FSR_PREFIX_COPY;
+	if (!ce || !ce->maphash ||
+	    fsr_maphash(fd, ce->size) != ce->maphash) {
+		/* nothing to go on yet, or the prefix was written to */
+		if (vflag)
+			fsrprintf(_("%s: being written, block map noted\n"),
+				  fname);
+		prefix_note(fd, statp, score);
+		return 1;
+	}
+	stable = min(ce->size, statp->bs_size - FSR_APPEND_SLACK);
+	stable -= stable % statp->bs_blksize;
+	if (stable < FSR_APPEND_MIN) {
+		if (vflag)
+			fsrprintf(_("%s: being written, no stable prefix\n"),
+				  fname);
+		prefix_note(fd, statp, score);
+		return 1;
+	}
+	if (vflag)
+		fsrprintf(_("%s: being written, moving first %lld bytes\n"),
+			  fname, (long long)stable);
+
+	if (packfile_range(fname, fd, &offset, stable, FSR_APPEND_CHUNK) < 0)
+		return -1;
+
+	new_nextents = getnextents(fd);
+	if (vflag)
+		fsrprintf(_("extents before:%d after:%d prefix:%lld %s\n"),
+			  cur_nextents, new_nextents, (long long)offset,
+			  fname);
+	if (new_nextents >= cur_nextents) {
+		prefix_note(fd, statp, score);
+		return 1;
+	}
+	/* counted as done, but the record has to describe the new map */
+	packfile_done(fd, statp, cur_nextents - new_nextents);
+	prefix_note(fd, statp, score);
+	return 0;
+}
+
+/*
+ * Files too big to copy in one go are relocated in fixed size chunks
+ * instead, each one moved and swapped in by the kernel on its own.  How
+ * far a file has got is kept in the checkpoint, so a run that stops
+ * part way through leaves the next one to carry on from that chunk.
+ * On a kernel that can't relocate ranges they are copied whole.
+ */
+#define FSR_CHUNK_HUGE		(64LL << 30)	/* chunk files above this */
+#define FSR_CHUNK_SIZE		(1LL << 30)	/* one unit of work */
+
+/*
+ * Find the checkpoint cursor of a file, taking a free slot if it has
+ * none.  NULL without a checkpoint or when all slots are in use.
+ */
+static struct fsr_chunk_cursor *
+chunk_cursor(xfs_bstat_t *bs)
+{
+	struct fsr_chunk_cursor	*cc;
+	int			i;
+
+	if (!ckpt)
+		return NULL;
+	for (i = 0; i < FSR_CKPT_CHUNKS; i++) {
+		cc = &ckpt->chunks[i];
+		if (cc->ino != bs->bs_ino)
+			continue;
+		if (cc->gen != bs->bs_gen) {
+			/* the inode has been reused */
+			cc->gen = bs->bs_gen;
+			cc->offset = 0;
+		}
+		return cc;
+	}
+	for (i = 0; i < FSR_CKPT_CHUNKS; i++) {
+		cc = &ckpt->chunks[i];
+		if (__sync_bool_compare_and_swap(&cc->ino, 0, bs->bs_ino)) {
+			cc->gen = bs->bs_gen;
+			cc->offset = 0;
+			return cc;
+		}
+	}
+	return NULL;
+}
+
+static int
+packfile_chunked(char *fname, int fd, xfs_bstat_t *statp, int cur_nextents)
+{
+	struct fsr_chunk_cursor	*cc = chunk_cursor(statp);
+	__s64			offset = 0, *offsetp = cc ? &cc->offset : &offset;
+	__s64			end;
+	int			new_nextents;
+
+	end = (statp->bs_size + statp->bs_blksize - 1) /
+	      statp->bs_blksize * statp->bs_blksize;
+	if (*offsetp >= end)
+		*offsetp = 0;		/* it was truncated */
+	if (vflag)
+		fsrprintf(_("%s: %lld bytes, chunked from %lld\n"),
+			  fname, (long long)end, (long long)*offsetp);
+
+	if (packfile_range(fname, fd, offsetp, end, FSR_CHUNK_SIZE) < 0) {
+		/* don't hold a slot for a file we got nowhere with */
+		if (cc && !*offsetp)
+			cc->ino = 0;
+		return -1;
+	}
+
+	new_nextents = getnextents(fd);
+	if (vflag)
+		fsrprintf(_("extents before:%d after:%d done:%lld %s\n"),
+			  cur_nextents, new_nextents, (long long)*offsetp,
+			  fname);
+	if (*offsetp < end) {
+		/* the rest next time */
+		return new_nextents < cur_nextents ? 0 : 1;
+	}
+	if (cc) {
+		cc->offset = 0;
+		cc->ino = 0;
+	}
+	if (new_nextents >= cur_nextents) {
+		packfile_note(statp, FSR_CACHE_NOGAIN, 0);
+		return 1;
+	}
+	packfile_done(fd, statp, cur_nextents - new_nextents);
+	return 0;
+}
+
+/*
+ * Report how swapping fname, open on fd, with its defragmented copy
+ * went; 'error' is 0 or the errno of the swap.  Returns packfile()'s
+ * result.
+ */
+static int
+packfile_swapped(char *fname, int fd, xfs_bstat_t *statp, int error,
+		 int cur_nextents, int new_nextents, int nextents)
+{
+	if (error) {
+		if (error == ENOTSUP) {
+			if (vflag || dflag)
+			   fsrprintf(_("%s: file type not supported\n"), fname);
+		} else if (error == EFAULT) {
+			/* The file has changed since we started the copy */
+			if (vflag || dflag)
+			   fsrprintf(_("%s: file modified defrag aborted\n"),
+				     fname);
+		} else if (error == EBUSY) {
+			/* Timestamp has changed or mmap'ed file */
+			if (vflag || dflag)
+			   fsrprintf(_("%s: file busy\n"), fname);
+		} else {
+			fsrprintf(_("XFS_IOC_SWAPEXT failed: %s: %s\n"),
+				  fname, strerror(error));
+		}
+		return -1;
+	}
+
+	/* Report progress */
+	if (vflag)
+		fsrprintf(_("extents before:%d after:%d %s %s\n"),
+			  cur_nextents, new_nextents,
+			  (new_nextents <= nextents ? "DONE" : "    " ),
+		          fname);
+	packfile_done(fd, statp, cur_nextents - new_nextents);
+	return 0;
+}
+
+/*
+ * Batched extent swaps.
+ *
+ * Copying a small file is cheap; the swap, with its transaction and log
+ * force, is most of the work.  Small files whose copy is done are
+ * queued with both files held open and swapped FSR_SWAPQ_MAX at a time
+ * with XFS_IOC_SWAPEXT_BATCH, which forces the log once for all of
+ * them.  The kernel still checks each file's bstat, so one that changed
+ * while it waited just fails with EBUSY.  The queue is flushed when it
+ * fills, when a worker runs out of work and in tmp_close().
+ */
+#define FSR_SWAPQ_MAX		64
+#define FSR_SWAPQ_SMALL		(1024 * 1024)	/* largest file queued */
+
+struct fsr_swapq_ent {
+	xfs_swapext_t	sx;
+	char		*fname;
+	int		cur_nextents;
+	int		new_nextents;
+	int		nextents;
+};
+
+static struct fsr_swapq_ent swapq[FSR_SWAPQ_MAX];
+static int		swapq_n;
+static int		swapq_nobatch;		/* kernel can't batch */
+
+static void
+swapq_flush(void)
+{
+	struct xfs_swapext_batch xb;
+	struct fsr_swapq_ent	*e;
+	xfs_swapext_t		sxv[FSR_SWAPQ_MAX];
+	__s32			results[FSR_SWAPQ_MAX];
+	int			i;
+
+	if (!swapq_n)
+		return;
+
+	for (i = 0; i < swapq_n; i++)
+		sxv[i] = swapq[i].sx;
+	memset(&xb, 0, sizeof(xb));
+	xb.xb_version = XFS_XB_VERSION;
+	xb.xb_count = swapq_n;
+	xb.xb_swaps = (__u64)(unsigned long)sxv;
+	xb.xb_results = (__u64)(unsigned long)results;
+	if (swapq_nobatch ||
+	    ioctl(swapq[0].sx.sx_fdtarget, XFS_IOC_SWAPEXT_BATCH, &xb) < 0) {
+		if (!swapq_nobatch && errno == ENOTTY) {
+			if (dflag)
+				fsrprintf(_("no XFS_IOC_SWAPEXT_BATCH, "
+					"swapping one at a time\n"));
+			swapq_nobatch = 1;
+		}
+		/* one at a time, the way packfile() would have */
+		for (i = 0; i < swapq_n; i++) {
+			e = &swapq[i];
+			if (fsync(e->sx.sx_fdtmp) < 0)
+				results[i] = -errno;
+			else if (xfs_swapext(e->sx.sx_fdtarget, &e->sx) < 0)
+				results[i] = -errno;
+			else
+				results[i] = 0;
+		}
+	}
+
+	for (i = 0; i < swapq_n; i++) {
+		e = &swapq[i];
+		packfile_swapped(e->fname, e->sx.sx_fdtarget, &e->sx.sx_stat,
+				 -results[i], e->cur_nextents,
+				 e->new_nextents, e->nextents);
+		close(e->sx.sx_fdtarget);
+		close(e->sx.sx_fdtmp);
+		free(e->fname);
+	}
+	swapq_n = 0;
+}
+
+/*
+ * Queue the swap in 'sx'.  The queue takes over tfd and a duplicate of
+ * fd.  Returns -1 if the caller has to do the swap itself.
+ */
+static int
+swapq_add(char *fname, int fd, int tfd, xfs_swapext_t *sx,
+	  int cur_nextents, int new_nextents, int nextents)
+{
+	struct fsr_swapq_ent	*e = &swapq[swapq_n];
+	int			dfd;
+
+	if ((dfd = dup(fd)) < 0)
+		return -1;
+	if (!(e->fname = strdup(fname))) {
+		close(dfd);
+		return -1;
+	}
+	e->sx = *sx;
+	e->sx.sx_fdtarget = dfd;
+	e->sx.sx_fdtmp = tfd;
+	e->cur_nextents = cur_nextents;
+	e->new_nextents = new_nextents;
+	e->nextents = nextents;
+	if (++swapq_n == FSR_SWAPQ_MAX)
+		swapq_flush();
+	return 0;
+}
+
+/*
+ * Reserve the first 'len' bytes of the temporary file as one extent,
+ * in the AG tmp_place() picked for it.  Returns 0 if we got it, 1 if
+ * there's no free extent that big and -1 if the kernel can't tell us.
+ */
+static int
+packfile_resvsp_contig(int tfd, __s64 len)
+{
+	static int		nocontig;
+	struct xfs_flock64	space;
+
+	if (nocontig)
+		return -1;
+
+	memset(&space, 0, sizeof(space));
+	space.l_whence = SEEK_SET;
+	space.l_start = 0;
+	space.l_len = len;
+	if (tmp_hint.valid) {
+		space.l_pad[0] = XFS_RC_AGNO;
+		space.l_pad[1] = tmp_hint.agno;
+	}
+	if (ioctl(tfd, XFS_IOC_RESVSP_CONTIG, &space) == 0)
+		return 0;
+	if (errno == ENOSPC)
+		return 1;
+	if (errno == ENOTTY) {
+		if (dflag)
+			fsrprintf(_("no XFS_IOC_RESVSP_CONTIG, "
+				"preallocating by extent\n"));
+		nocontig = 1;
+	}
+	return -1;
+}
+
+/*
+ * Preallocate the data extents of outmap in the temporary file with
+ * XFS_IOC_SPACE_VEC, a few calls instead of one RESVSP and one lseek
+ * per extent.  The kernel merges adjacent ranges.  Holes need nothing,
+ * the temporary file starts out empty.  Returns 0 if the space was
+ * reserved, 1 if the kernel can't do this and -1 on error.
+ */
+static int
+packfile_resvsp_vec(int tfd, int nextents)
+{
+	static int		novec;
+	struct xfs_space_vec	*vec;
+	struct xfs_space_vec_req req;
+	__s64			pos = 0;
+	int			extent, n = 0, done;
+
+	if (novec)
+		return 1;
+	if (!(vec = malloc(nextents * sizeof(*vec))))
+		return 1;
+
+	for (extent = 0; extent < nextents; extent++) {
+		if (outmap[extent].bmv_block != -1 &&
+		    outmap[extent].bmv_length) {
+			memset(&vec[n], 0, sizeof(vec[n]));
+			vec[n].sv_offset = pos;
+			vec[n].sv_length = outmap[extent].bmv_length;
+			vec[n].sv_op = XFS_SV_RESVSP;
+			n++;
+		}
+		pos += outmap[extent].bmv_length;
+	}
+
+	for (done = 0; done < n; done += req.sr_count) {
+		memset(&req, 0, sizeof(req));
+		req.sr_version = XFS_SPACE_VEC_VERSION;
+		req.sr_count = min(n - done, XFS_SPACE_VEC_MAX);
+		req.sr_vec = (__u64)(unsigned long)&vec[done];
+		if (ioctl(tfd, XFS_IOC_SPACE_VEC, &req) == 0)
+			continue;
+		if (errno == ENOTTY && done == 0) {
+			if (dflag)
+				fsrprintf(_("no XFS_IOC_SPACE_VEC, "
+					"preallocating by extent\n"));
+			novec = 1;
+			free(vec);
+			return 1;
+		}
+		free(vec);
+		return -1;
+	}
+	free(vec);
+	return 0;
+}
+
+/*
+ * Do the defragmentation of a single file.
+ * We already are pretty sure we can and want to
+ * defragment the file.  Create the tmp file, copy
+ * the data (maintaining holes) and call the kernel
+ * extent swap routine.
+ *
+ * Return values:
+ * -1: Some error was encountered
+ *  0: Successfully defragmented the file
+ *  1: No change / No Error
+ */
+static int
+packfile(char *fname, char *tname, int fd,
+	 xfs_bstat_t *statp, struct fsxattr *fsxp)
+{
+	int 		tfd = -1;
+	int		srval;
+	int		retval = -1;	/* Failure is the default */
+	int		nextents, extent, cur_nextents, new_nextents;
+	unsigned	blksz_dio;
+	unsigned	dio_min;
+	struct dioattr	dio;
+	static xfs_swapext_t   sx;
+	struct xfs_flock64  space;
+	off64_t 	pos;
+	void 		*fbuf = NULL;
+	char		ffname[SMBUFSZ];
+	int		ffd = -1;
+
+	struct fiemap_extent_list *physical_list_head = NULL;		
+	int ret,i;							
+	struct fiemap_extent_list *logical_list_head = NULL;	
+	int		error;
+	int		ndata, nholes, reserved = 0;
+	int		queued;
+	struct fsr_layout layout;
+	double		score = 0;
+
+
+	/*
+	 * Work out the extent map - nextents will be set to the
+	 * minimum number of extents needed for the file (taking
+	 * into account holes), cur_nextents is the current number
+	 * of extents.
+	 */
+	if (!nfrags && fsr_layout(fd, &layout) == 0) {
+		/*
+		 * GETBMAPX already reports back to back records as one
+		 * extent, so more records on disk than extents reported
+		 * is what says some can be merged.
+		 */
+		if (layout.nmerge || statp->bs_extents > layout.nextents)
+			packfile_merge(fname, fd);
+
+		/*
+		 * Extents that follow each other on disk read back without
+		 * a seek, however many of them GETBMAP reports.  Copying
+		 * such a file costs a full read and write for no gain.
+		 */
+		if (layout.ndisc == 0 && !relocating) {
+			if (vflag)
+				fsrprintf(_("%s: %d extents, physically "
+					"contiguous\n"), fname,
+					layout.nextents);
+			if (fsstats) {
+				__sync_fetch_and_add(&fsstats->contig_files, 1);
+				__sync_fetch_and_add(&fsstats->contig_bytes,
+					(__u64)statp->bs_blocks *
+					statp->bs_blksize);
+			}
+			packfile_note(statp, FSR_CACHE_CLEAN, 0);
+			retval = 1; /* indicates no change/no error */
+			goto out;
+		}
+		score = fsr_score(&layout, statp->bs_size);
+		if (vflag)
+			fsrprintf(_("%s: score %.2f\n"), fname, score);
+		if (dflag)
+			fsrprintf(_("%s: %d extents, %d discontiguous, "
+				"%d AG jumps, seek distance %lld blocks\n"),
+				fname, layout.nextents, layout.ndisc,
+				layout.agjumps,
+				(long long)BBTOB(layout.seekdist) /
+				statp->bs_blksize);
+	}
+	nextents = read_fd_bmap(fd, statp, &cur_nextents);
+
+	if(uflag)
+	{
+	 int number1 = 0;
+	 int number2 = 0;
+	 int bblock = 512;	// 1 block = 512 bytes
+		// Get file extents
+		ret = get_file_extents(bblock,fname,fd, &physical_list_head);
+		if (ret < 0) 
+		{
+			fsrprintf("*** ERROR occurred \n");
+		}
+		// Get the count of file's continuous physical region
+		number1 = get_physical_count(physical_list_head);
+		// Change list from physical to logical	
+		ret = change_physical_to_logical(&physical_list_head,&logical_list_head);
+		// Count file fragments before defrag
+		number2 = get_logical_count(logical_list_head);		
+		if (dflag)
+			fsrprintf(_("%s: %d extents in %d physical runs\n"),
+				  fname, number2, number1);
+	}
+
+	if (!relocating && (cur_nextents == 1 || cur_nextents <= nextents)) {
+		if (vflag)
+			fsrprintf(_("%s already fully defragmented.\n"), fname);
+		packfile_note(statp, FSR_CACHE_CLEAN, 0);
+		retval = 1; /* indicates no change/no error */
+		goto out;
+	} 
+
+	if (dflag)
+		fsrprintf(_("%s extents=%d can_save=%d tmp=%s\n"),
+		          fname, cur_nextents, (cur_nextents - nextents),
+		          tname);
+
+	if (uflag) {
+		retval = packfile_relocate(fname, fd, nextents, cur_nextents);
+		goto out;
+	}
+
+	/* the swap would fail with EBUSY after the whole copy */
+	if (statp->bs_size >= FSR_BUSY_MAPCHECK && busy_mapped(fd)) {
+		if (vflag || dflag)
+			fsrprintf(_("%s: file is mapped (skipping)\n"), fname);
+		retval = 1;
+		goto out;
+	}
+
+	/* a file being appended to would change under the copy */
+	if (!relocating && !norelocate &&
+	    time(0) - statp->bs_mtime.tv_sec < FSR_APPEND_ACTIVE) {
+		retval = packfile_prefix(fname, fd, statp, cur_nextents, score);
+		/* not growing after all, or the kernel can't relocate */
+		if (retval != FSR_PREFIX_COPY && !(retval < 0 && norelocate))
+			goto out;
+		retval = -1;
+	}
+
+	if (!relocating && !norelocate && statp->bs_size > FSR_CHUNK_HUGE) {
+		retval = packfile_chunked(fname, fd, statp, cur_nextents);
+		/* without kernel support, copy it whole */
+		if (!(retval < 0 && norelocate))
+			goto out;
+		retval = -1;
+	}
+
+	if ((tfd = open(tname, openopts, 0666)) < 0) {
+		if (vflag)
+			fsrprintf(_("could not open tmp file: %s: %s\n"),
+				   tname, strerror(errno));
+		goto out;
+	}
+	unlink(tname);
+
+	/* Setup extended attributes */
+	if (fsr_setup_attr_fork(fd, tfd, statp) != 0) {
+		fsrprintf(_("failed to set ATTR fork on tmp: %s:\n"), tname);
+		goto out;
+	}
+
+	/* Setup extended inode flags, project identifier, etc */
+	if (fsxp->fsx_xflags || fsxp->fsx_projid) {
+		if (ioctl(tfd, XFS_IOC_FSSETXATTR, fsxp) < 0) {
+			fsrprintf(_("could not set inode attrs on tmp: %s\n"),
+				tname);
+			goto out;
+		}
+	}
+
+	if ((ioctl(tfd, XFS_IOC_DIOINFO, &dio)) < 0 ) {
+		fsrprintf(_("could not get DirectIO info on tmp: %s\n"), tname);
+		goto out;
+	}
+
+	dio_min = dio.d_miniosz;
+	if (statp->bs_size <= dio_min) {
+		blksz_dio = dio_min;
+	} else {
+		blksz_dio = min(dio.d_maxiosz, BUFFER_MAX - pagesize);
+		if (argv_blksz_dio != 0)
+			blksz_dio = min(argv_blksz_dio, blksz_dio);
+		blksz_dio = (min(statp->bs_size, blksz_dio) / dio_min) * dio_min;
+	}
+
+	if (dflag) {
+		fsrprintf(_("DEBUG: "
+			"fsize=%lld blsz_dio=%d d_min=%d d_max=%d pgsz=%d\n"),
+			statp->bs_size, blksz_dio, dio.d_miniosz,
+			dio.d_maxiosz, pagesize);
+	}
+
+	if (!(fbuf = (char *)memalign(dio.d_mem, blksz_dio))) {
+		fsrprintf(_("could not allocate buf: %s\n"), tname);
+		goto out;
+	}
+
+	if (nfrags) {
+		/* Create new tmp file in same AG as first */
+		sprintf(ffname, "%s.frag", tname);
+
+		/* Open the new file for sync writes */
+		if ((ffd = open(ffname, openopts, 0666)) < 0) {
+			fsrprintf(_("could not open fragfile: %s : %s\n"),
+				   ffname, strerror(errno));
+			goto out;
+		}
+		unlink(ffname);
+	}
+
+	/*
+	 * A file without holes can ask for all its space as one extent,
+	 * and if there isn't one, we know now rather than after building
+	 * the temporary file.  Piecing it together is then only worth it
+	 * if free space promises fewer extents than the file has.
+	 */
+	ndata = nholes = 0;
+	for (extent = 0; extent < nextents; extent++) {
+		if (outmap[extent].bmv_block == -1)
+			nholes++;
+		else if (outmap[extent].bmv_length)
+			ndata++;
+	}
+	if (!nfrags && ndata == 1 && !nholes) {
+		for (extent = 0; !outmap[extent].bmv_length; extent++)
+			;
+		switch (packfile_resvsp_contig(tfd,
+				outmap[extent].bmv_length)) {
+		case 0:
+			reserved = 1;
+			break;
+		case 1:
+			if (tmp_hint.valid &&
+			    tmp_hint.nextents >= cur_nextents) {
+				if (vflag)
+					fsrprintf(_("No contiguous space for "
+						"%s (skipping)\n"), fname);
+				packfile_note(statp, FSR_CACHE_NOGAIN, 0);
+				retval = 1;
+				goto out;
+			}
+			break;
+		}
+	}
+
+	if (!reserved && !nfrags) {
+		switch (packfile_resvsp_vec(tfd, nextents)) {
+		case 0:
+			reserved = 1;
+			break;
+		case -1:
+			fsrprintf(_("could not pre-allocate tmp space: %s\n"),
+				  tname);
+			goto out;
+		}
+	}
+
+	/* Loop through block map allocating new extents */
+	for (extent = 0; !reserved && extent < nextents; extent++) {
+		pos = outmap[extent].bmv_offset;
+		if (outmap[extent].bmv_block == -1) {
+			space.l_whence = SEEK_SET;
+			space.l_start = pos;
+			space.l_len = outmap[extent].bmv_length;
+			if (ioctl(tfd, XFS_IOC_UNRESVSP64, &space) < 0) {
+				fsrprintf(_("could not trunc tmp %s\n"),
+					   tname);
+			}
+			if (lseek64(tfd, outmap[extent].bmv_length, SEEK_CUR) < 0) {
+				fsrprintf(_("could not lseek in tmpfile: %s : %s\n"),
+				   tname, strerror(errno));
+				goto out;
+			}
+			continue;
+		} else if (outmap[extent].bmv_length == 0) {
+			/* to catch holes at the beginning of the file */
+			continue;
+		}
+		/*
+		 * -C leaves the data to be allocated by the copy, but
+		 * unwritten ranges aren't copied and would become holes.
+		 */
+		if (!nfrags ||
+		    outmap[extent].bmv_block == FSR_BMV_UNWRITTEN) {
+			space.l_whence = SEEK_SET;
+			space.l_start = pos;
+			space.l_len = outmap[extent].bmv_length;
+
+			if (ioctl(tfd, XFS_IOC_RESVSP64, &space) < 0) {
+				fsrprintf(_("could not pre-allocate tmp space:"
+					" %s\n"), tname);
+				goto out;
+			}
+			if (lseek64(tfd, outmap[extent].bmv_length, SEEK_CUR) < 0) {
+				fsrprintf(_("could not lseek in tmpfile: %s : %s\n"),
+				   tname, strerror(errno));
+				goto out;
+			}
+		}
+	} /* end of space allocation loop */
+
+	if (lseek64(tfd, 0, SEEK_SET)) {
+		fsrprintf(_("Couldn't rewind on temporary file\n"));
+		goto out;
+	}
+
+	/* Check if the temporary file has fewer extents */
+	new_nextents = getnextents(tfd);
+
+	if (dflag)
+		fsrprintf(_("Temporary file has %d extents (%d in original)\n"), new_nextents, cur_nextents);
+	/* when relocating, the file just mustn't get worse */
+	if (relocating ? cur_nextents < new_nextents :
+			 cur_nextents <= new_nextents) {
+		if (vflag)
+			fsrprintf(_("No improvement will be made (skipping): %s\n"), fname);
+		packfile_note(statp, FSR_CACHE_NOGAIN, 0);
+		retval = 1; /* no change/no error */
+		goto out;
+	}
+
+	/* Copy the data, holes and unwritten extents are left alone */
+	busy_lease(fd);
+	if (nfrags)
+		error = packfile_copy_sync(fname, tname, fd, tfd, fbuf,
+				blksz_dio, dio_min, nextents, ffname, ffd,
+				statp);
+	else
+		error = packfile_copy(fname, tname, fd, tfd, fbuf,
+				blksz_dio, dio_min, dio.d_mem, nextents,
+				statp);
+	if (error)
+		goto out;
+
+	if (ftruncate64(tfd, statp->bs_size) < 0) {
+		fsrprintf(_("could not truncate tmpfile: %s : %s\n"),
+				fname, strerror(errno));
+		goto out;
+	}
+	/* the swap writes back a queued temporary file itself */
+	queued = swapbatch && !nfrags && statp->bs_size <= FSR_SWAPQ_SMALL;
+	if (!queued && fsync(tfd) < 0) {
+		fsrprintf(_("could not fsync tmpfile: %s : %s\n"),
+				fname, strerror(errno));
+		goto out;
+	}
+
+	sx.sx_stat     = *statp; /* struct copy */	// stat of target before copy
+	sx.sx_version  = XFS_SX_VERSION;		// version
+	sx.sx_fdtarget = fd;				// fd of target file
+	sx.sx_fdtmp    = tfd;				// fd of temp file
+	sx.sx_offset   = 0;				// offset into file
+	sx.sx_length   = statp->bs_size;		// length from offset
+
+	/* switch to the owner's id, to keep quota in line */
+        if (fchown(tfd, statp->bs_uid, statp->bs_gid) < 0) {
+                if (vflag)
+                        fsrprintf(_("failed to fchown tmpfile %s: %s\n"),
+                                   tname, strerror(errno));
+		goto out;
+        }
+
+	/* Small files are swapped later, many at a time */
+	if (queued)
+		busy_unlease();
+	if (queued && swapq_add(fname, fd, tfd, &sx, cur_nextents,
+				new_nextents, nextents) == 0) {
+		tfd = -1;	/* the queue closes it */
+		retval = 0;
+		goto out;
+	}
+
+	/* Swap the extents */
+	srval = xfs_swapext(fd, &sx);
+	retval = packfile_swapped(fname, fd, statp, srval < 0 ? errno : 0,
+				  cur_nextents, new_nextents, nextents);
+
+out:
+	busy_unlease();
+	free(fbuf);
+	if (tfd != -1)
+		close(tfd);
+	if (ffd != -1)
+		close(ffd);
+	return retval;
+}
+
+char *
+gettmpname(char *fname)
+{
+	static char	buf[PATH_MAX+1];
+	char		sbuf[SMBUFSZ];
+	char		*ptr;
+
+	sprintf(sbuf, "/.fsr%d", getpid());
+
+	strncpy(buf, fname, PATH_MAX);
+	buf[PATH_MAX] = '\0';
+	ptr = strrchr(buf, '/');
+	if (ptr) {
+		*ptr = '\0';
+	} else {
+		strcpy(buf, ".");
+	}
+
+	if ((strlen(buf) + strlen (sbuf)) > PATH_MAX) {
+		fsrprintf(_("tmp file name too long: %s\n"), fname);
+		return(NULL);
+	}
+
+	strcat(buf, sbuf);
+
+	return(buf);
+}
+
+char *
+getparent(char *fname)
+{
+	static char	buf[PATH_MAX+1];
+	char		*ptr;
+
+	strncpy(buf, fname, PATH_MAX);
+	buf[PATH_MAX] = '\0';
+	ptr = strrchr(buf, '/');
+	if (ptr) {
+		if (ptr == &buf[0])
+			++ptr;
+		*ptr = '\0';
+	} else {
+		strcpy(buf, ".");
+	}
+
+	return(buf);
+}
+
+
+/*
+ * Read in block map of the input file, coalesce contiguous
+ * extents into a single range, keep all holes. Convert from 512 byte
+ * blocks to bytes.
+ *
+ * Unwritten extents, preallocated but never written, get ranges of
+ * their own marked FSR_BMV_UNWRITTEN instead of a disk address.  They
+ * are preallocated in the temporary file like data but not copied, so
+ * they stay unwritten and cost no I/O.  cur_nextents counts extents the
+ * way GETBMAP without BMV_IF_PREALLOC does, ignoring their state.
+ *
+ * This code was borrowed from mv.c with some minor mods.
+ */
+#define MAPSIZE	128
+#define	OUTMAP_SIZE_INCREMENT	MAPSIZE
+
+/*
+ * Is an unwritten range really free of data?  Data written into it may
+ * still be sitting in the page cache, which SEEK_DATA knows about.
+ */
+static int
+bmap_unwritten(int fd, struct getbmapx *bmv)
+{
+	off64_t		start = BBTOB(bmv->bmv_offset);
+	off64_t		data;
+
+	if (!(bmv->bmv_oflags & BMV_OF_PREALLOC))
+		return 0;
+	data = lseek64(fd, start, SEEK_DATA);
+	if (data < 0)
+		return errno == ENXIO;
+	return data >= start + BBTOB(bmv->bmv_length);
+}
+
+int	read_fd_bmap(int fd, xfs_bstat_t *sin, int *cur_nextents)
+{
+	int		i, cnt, n;
+	struct getbmap	map[MAPSIZE];
+	struct getbmapx	xmap[MAPSIZE];
+	struct getbmapx	*bmv, prev;
+	__s64		kind;
+
+#define	BUMP_CNT	\
+	if (++cnt >= outmap_size) { \
+		outmap_size += OUTMAP_SIZE_INCREMENT; \
+		outmap = (struct getbmap *)realloc(outmap, \
+		                           outmap_size*sizeof(*outmap)); \
+		if (outmap == NULL) { \
+			fsrprintf(_("realloc failed: %s\n"), \
+				strerror(errno)); \
+			exit(1); \
+		} \
+	}
+
+	/*	Initialize the outmap array.  It always grows - never shrinks.
+	 *	Left-over memory allocation is saved for the next files.
+	 */
+	if (outmap_size == 0) {
+		outmap_size = OUTMAP_SIZE_INCREMENT; /* Initial size */
+		outmap = (struct getbmap *)malloc(outmap_size*sizeof(*outmap));
+		if (!outmap) {
+			fsrprintf(_("malloc failed: %s\n"),
+				strerror(errno));
+			exit(1);
+		}
+	}
+
+	outmap[0].bmv_block = 0;
+	outmap[0].bmv_offset = 0;
+	outmap[0].bmv_length = sin->bs_size;
+
+	/*
+	 * If a non regular file is involved then forget holes
+	 */
+
+	if (!S_ISREG(sin->bs_mode))
+		return(1);
+
+	outmap[0].bmv_length = 0;
+
+	map[0].bmv_offset = 0;
+	map[0].bmv_block = 0;
+	map[0].bmv_entries = 0;
+	map[0].bmv_count = MAPSIZE;
+	map[0].bmv_length = -1;
+
+	memset(xmap, 0, sizeof(xmap[0]));
+	xmap[0].bmv_count = MAPSIZE;
+	xmap[0].bmv_length = -1;
+	xmap[0].bmv_iflags = BMV_IF_PREALLOC;
+
+	cnt = 0;
+	*cur_nextents = 0;
+	prev.bmv_block = -1;
+
+	do {
+		if (uflag) {
+			/* extent_map() works on a plain getbmap array */
+			if (ioctl(fd, XFS_IOC_GETBMAP, map) < 0) {
+				fsrprintf(_("failed reading extents: inode %llu"),
+					 (unsigned long long)sin->bs_ino);
+				exit(1);
+			}
+			*cur_nextents += map[0].bmv_entries;
+			extent_map(&map);
+			for (i = 1; i <= map[0].bmv_entries; i++) {
+				memset(&xmap[i], 0, sizeof(xmap[i]));
+				xmap[i].bmv_offset = map[i].bmv_offset;
+				xmap[i].bmv_block = map[i].bmv_block;
+				xmap[i].bmv_length = map[i].bmv_length;
+			}
+			n = map[0].bmv_entries;
+		} else {
+			if (ioctl(fd, XFS_IOC_GETBMAPX, xmap) < 0) {
+				fsrprintf(_("failed reading extents: inode %llu"),
+					 (unsigned long long)sin->bs_ino);
+				exit(1);
+			}
+			n = xmap[0].bmv_entries;
+		}
+
+		/* Concatenate extents together and replicate holes into
+		 * the output map.
+		 */
+		for (i = 1; i <= n; i++) {
+			bmv = &xmap[i];
+			if (!uflag && BBTOB(bmv->bmv_offset) < sin->bs_size &&
+			    (bmv->bmv_block < 0 || prev.bmv_block < 0 ||
+			     bmv->bmv_block != prev.bmv_block + prev.bmv_length))
+				(*cur_nextents)++;
+			prev = *bmv;
+
+			if (bmv->bmv_block == -1)
+				kind = -1;
+			else if (bmap_unwritten(fd, bmv))
+				kind = FSR_BMV_UNWRITTEN;
+			else
+				kind = 0;
+			if (kind == -1 || kind != min(outmap[cnt].bmv_block, 0)) {
+				BUMP_CNT;
+				outmap[cnt].bmv_offset = bmv->bmv_offset;
+				outmap[cnt].bmv_block = kind ? kind : bmv->bmv_block;
+				outmap[cnt].bmv_length = bmv->bmv_length;
+			} else {
+				outmap[cnt].bmv_length += bmv->bmv_length;
+			}
+		}
+	} while (n == (MAPSIZE-1));
+
+	for (i = 0; i <= cnt; i++) {
+		outmap[i].bmv_offset = BBTOB(outmap[i].bmv_offset);
+		outmap[i].bmv_length = BBTOB(outmap[i].bmv_length);
+
+	}
+	
+	if (!uflag) {
+		/*
+		 * With BMV_IF_PREALLOC, GETBMAPX also reports preallocation
+		 * past EOF, e.g. from fallocate(FALLOC_FL_KEEP_SIZE).  It is
+		 * not part of the file; the last extent ends at bs_size.
+		 */
+		while (cnt > 0 && outmap[cnt].bmv_offset >= sin->bs_size)
+			cnt--;
+		outmap[cnt].bmv_length = sin->bs_size - outmap[cnt].bmv_offset;
+	}
+
+	return(cnt+1);
+}
+
+
+/*
+ * extent_map() -	Select and mark extents for defrag
+ * AUTHOR: Amey
+ * @tmp_map[]:		outmap for temp file		
+ */
+int
+extent_map(struct getbmap *tmp_map) 
+{
+	struct cumulative_exts exts[MAPSIZE];
+	int i, k, j;
+	int index, m=0;		
+	int flag;
+	int marker = 0;
+	int sum = 0;					
+	int block_size = 512;		// The XFS block size is 4KB but map and outmap are filled considreing it as 512bytes
+
+	int counter = 0;						
+
+	if(fp==NULL)
+	{
+	 fsrprintf("\nFILE open error\n");
+	}	
+
+	for(i = 1 ; i <= tmp_map[0].bmv_entries ; i++)		
+	{
+	 sum += tmp_map[i].bmv_length;
+	}							
+
+	m++;							
+	exts[m].size = sum;
+	exts[m].start = 1;
+	exts[m].last = tmp_map[0].bmv_entries;			
+
+	for ( i = 1 ; i <= (tmp_map[0].bmv_entries - 2) ; i++)
+	{
+		for ( k = 1 ; ; k++)		
+		{
+			m++;		
+			exts[m].size = tmp_map[k].bmv_length;
+			exts[m].start = k;
+			for (j = 1 ; j <= i; j++)
+			{
+				index = k + j;		
+				exts[m].size += tmp_map[index].bmv_length;
+				if (index == tmp_map[0].bmv_entries) 
+				{	
+					flag = 1;
+				}
+			}
+			exts[m].last = index;			
+			if ( flag )
+			{
+				flag = 0;			
+				break;
+			}
+		}
+	}
+
+	fsrprintf("\nThe cumulative extents data structure:\n");
+	fsrprintf("\nfrom\tto\tblocks\t\t\tlength(bytes)\tindex\n");
+
+	for (i = 1 ; i <= m  ; i++)
+	{
+		fsrprintf(" %d \t %d \t %d \t\t %lld \t %d \n", exts[i].start, exts[i].last, exts[i].size, exts[i].size * block_size, i );
+		if ( (exts[i].size * block_size) <= freesp)
+		{
+			//if(exts[marker].size < exts[i].size)	
+				marker = i;
+		}
+	}
+
+	if(marker == 0) 
+	{		
+		fsrprintf("\nNO SELECTION DONE: Insufficent free space to perform partial defragmentation (exit)\n");
+		exit(1);	
+	}
+
+	fsrprintf("\nThe marker value chosen from above index is :%d\n",marker);
+	
+
+	for(i = 1 ; i <= tmp_map[0].bmv_entries ; i++)
+	{
+	 if( (i < exts[marker].start) || (i > exts[marker].last))
+	 { 
+	  counter++;
+	 }
+	}						
+	fprintf(fp,"%d\n",counter);
+	unselected = counter;
+
+
+	k = exts[marker].start;
+
+	for ( i = 0 ; i<= tmp_map[0].bmv_entries ; i++ )
+	{
+		tmp_map[k - exts[marker].start + 1] = tmp_map[k];
+		k++;
+	}
+
+	m = exts[marker].last -exts[marker].start + 2;
+	tmp_map[m].bmv_length= tmp_map[m].bmv_offset = tmp_map[m].bmv_block = tmp_map[m].bmv_entries =  0;
+	tmp_map[0].bmv_offset = exts[marker].size;
+	tmp_map[0].bmv_entries =  (exts[marker].last - exts[marker].start) + 1; 
+
+	return 1;
+}
+
+
+/*
+ * Read the block map and return the number of extents.
+ */
+int
+getnextents(int fd)
+{
+	int		nextents;
+	struct getbmap	map[MAPSIZE];
+
+	map[0].bmv_offset = 0;
+	map[0].bmv_block = 0;
+	map[0].bmv_entries = 0;
+	map[0].bmv_count = MAPSIZE;
+	map[0].bmv_length = -1;
+
+	nextents = 0;
+
+	do {
+		if (ioctl(fd,XFS_IOC_GETBMAP, map) < 0) {
+			fsrprintf(_("failed reading extents"));
+			exit(1);
 		}
-		for (cnt = outmap[extent].bmv_length; cnt > 0;
-		     cnt -= ct, pos += ct) {
-			if (nfrags && --nfrags) {
-				ct = min(cnt, dio_min);
-			} else if (cnt % dio_min == 0) {
-				ct = min(cnt, blksz_dio);
-			} else {
-				ct = min(cnt + dio_min - (cnt % dio_min),
-					blksz_dio);
-			}
-			ct = read(fd, fbuf, ct);
-			if (ct == 0) {
-				/* EOF, stop trying to read */
-				extent = nextents;
-				break;
-			}
-			/* Ensure we do direct I/O to correct block
-			 * boundaries.
-			 */
-			if (ct % dio_min != 0) {
-				wc = ct + dio_min - (ct % dio_min);
-			} else {
-				wc = ct;
-			}
-			wc_b4 = wc;
-			if (ct < 0 || ((wc = write(tfd, fbuf, wc)) != wc_b4)) {
-				if (ct < 0)
-					fsrprintf(_("bad read of %d bytes "
-						"from %s: %s\n"), wc_b4,
-						fname, strerror(errno));
-				else if (wc < 0)
-					fsrprintf(_("bad write of %d bytes "
-						"to %s: %s\n"), wc_b4,
-						tname, strerror(errno));
-				else {
-					/*
-					 * Might be out of space
-					 *
-					 * Try to finish write
-					 */
-					int resid = ct-wc;
 
-					if ((wc = write(tfd, ((char *)fbuf)+wc,
-							resid)) == resid) {
-						/* worked on second attempt? */
-						continue;
-					}
-					else if (wc < 0) {
-						fsrprintf(_("bad write2 of %d "
-							"bytes to %s: %s\n"),
-							resid, tname,
-							strerror(errno));
-					} else {
-						fsrprintf(_("bad copy to %s\n"),
-							tname);
-					}
-				}
-				goto out;
-			}
-			if (nfrags) {
-				/* Do a matching write to the tmp file */
-				wc_b4 = wc;
-				if (((wc = write(ffd, fbuf, wc)) != wc_b4)) {
-					fsrprintf(_("bad write of %d bytes "
-						"to %s: %s\n"),
-						wc_b4, ffname, strerror(errno));
+		nextents += map[0].bmv_entries;
+	} while (map[0].bmv_entries == (MAPSIZE-1));
+
+	return(nextents);
+}
+
+/*
+ * Walk the block map and describe how the data extents sit on disk:
+ * how many times a read has to seek, how far in total, how often it
+ * crosses into another AG, and how many neighbours could be merged in
+ * place (contiguous on disk and in the same unwritten state).  The
+ * kernel merges such records before reporting them, so the only ones
+ * seen here are split across GETBMAPX calls; compare bs_extents with
+ * nextents for the rest.  Distances are in 512 byte blocks.
+ */
+static int
+fsr_layout(int fd, struct fsr_layout *lp)
+{
+	struct getbmapx	map[MAPSIZE];
+	struct getbmapx	prev;
+	__s64		gap;
+	__s64		agbb;
+	int		i;
+
+	/* AG size in 512 byte blocks, as GETBMAPX reports addresses */
+	agbb = (__s64)fsgeom.agblocks * fsgeom.blocksize >> BBSHIFT;
+	memset(lp, 0, sizeof(*lp));
+	memset(map, 0, sizeof(map[0]));
+	map[0].bmv_count = MAPSIZE;
+	map[0].bmv_length = -1;
+	map[0].bmv_iflags = BMV_IF_PREALLOC;
+	prev.bmv_block = -1;
+
+	do {
+		if (ioctl(fd, XFS_IOC_GETBMAPX, map) < 0)
+			return -1;
+
+		for (i = 1; i <= map[0].bmv_entries; i++) {
+			if (map[i].bmv_block == -1)
+				continue;
+			lp->nextents++;
+			if (prev.bmv_block != -1) {
+				gap = map[i].bmv_block -
+				      (prev.bmv_block + prev.bmv_length);
+				if (gap) {
+					lp->ndisc++;
+					lp->seekdist += gap < 0 ? -gap : gap;
+					if (agbb && prev.bmv_block / agbb !=
+						    map[i].bmv_block / agbb)
+						lp->agjumps++;
+				} else if (prev.bmv_offset + prev.bmv_length ==
+						map[i].bmv_offset &&
+					   (prev.bmv_oflags & BMV_OF_PREALLOC) ==
+					   (map[i].bmv_oflags & BMV_OF_PREALLOC)) {
+					lp->nmerge++;
 				}
 			}
+			prev = map[i];
 		}
+	} while (map[0].bmv_entries == (MAPSIZE-1));
+
+	return 0;
+}
+
+/*
+ * Get the fs geometry
+ */
+int
+xfs_getgeom(int fd, xfs_fsop_geom_v1_t * fsgeom)
+{
+	if (xfs_fsgeometry(fd, fsgeom) < 0) {
+		return -1;
 	}
-	if (ftruncate64(tfd, statp->bs_size) < 0) {
-		fsrprintf(_("could not truncate tmpfile: %s : %s\n"),
-				fname, strerror(errno));
-		goto out;
-	}
-	if (fsync(tfd) < 0) {
-		fsrprintf(_("could not fsync tmpfile: %s : %s\n"),
-				fname, strerror(errno));
-		goto out;
-	}
+	return 0;
+}
 
-	sx.sx_stat     = *statp; /* struct copy */	// stat of target before copy
-	sx.sx_version  = XFS_SX_VERSION;		// version
-	sx.sx_fdtarget = fd;				// fd of target file
-	sx.sx_fdtmp    = tfd;				// fd of temp file
-	sx.sx_offset   = 0;				// offset into file
-	sx.sx_length   = statp->bs_size;		// length from offset
+/*
+ * Work out which AG an inode lives in from the geometry of the
+ * filesystem being reorganized (see XFS_INO_TO_AGNO).
+ */
+static int
+fsr_agino_log(void)
+{
+	int	agblklog = libxfs_highbit32(fsgeom.agblocks - 1) + 1;
+	int	inopblog = libxfs_highbit32(fsgeom.blocksize / fsgeom.inodesize);
 
-	/* switch to the owner's id, to keep quota in line */
-        if (fchown(tfd, statp->bs_uid, statp->bs_gid) < 0) {
-                if (vflag)
-                        fsrprintf(_("failed to fchown tmpfile %s: %s\n"),
-                                   tname, strerror(errno));
-		goto out;
-        }
+	return agblklog + inopblog;
+}
 
-	/* Swap the extents */
-	srval = xfs_swapext(fd, &sx);
-	if (srval < 0) {
-		if (errno == ENOTSUP) {
-			if (vflag || dflag)
-			   fsrprintf(_("%s: file type not supported\n"), fname);
-		} else if (errno == EFAULT) {
-			/* The file has changed since we started the copy */
-			if (vflag || dflag)
-			   fsrprintf(_("%s: file modified defrag aborted\n"),
-				     fname);
-		} else if (errno == EBUSY) {
-			/* Timestamp has changed or mmap'ed file */
-			if (vflag || dflag)
-			   fsrprintf(_("%s: file busy\n"), fname);
-		} else {
-			fsrprintf(_("XFS_IOC_SWAPEXT failed: %s: %s\n"),
-				  fname, strerror(errno));
+static xfs_agnumber_t
+fsr_ino_to_agno(xfs_ino_t ino)
+{
+	return ino >> fsr_agino_log();
+}
+
+/*
+ * Convert a disk address from GETBMAP into the filesystem block number
+ * the allocation hints take (see XFS_DADDR_TO_FSB).
+ */
+static __s64
+fsr_daddr_to_fsb(__s64 daddr)
+{
+	__s64	bno = daddr / (fsgeom.blocksize >> BBSHIFT);
+	int	agblklog = libxfs_highbit32(fsgeom.agblocks - 1) + 1;
+
+	return ((bno / fsgeom.agblocks) << agblklog) |
+	       (bno % fsgeom.agblocks);
+}
+
+/*
+ * Reverse map: which inodes own the blocks in a physical range.
+ *
+ * The kernel can't tell us, so the map is built by walking the block
+ * map of every inode.  Threads share out the AGs' inodes as in -s and
+ * collect one record per extent into a buffer of their own.  A full
+ * buffer is sorted by physical block and appended to a run file, so
+ * memory stays at FSR_RMAP_BUFRECS records per thread however large
+ * the filesystem.  The runs are then merged into the index file, which
+ * is mmap'ed and searched with a binary search.  Extents don't overlap,
+ * so the records covering [x, y) are the one containing x, if any, and
+ * those that follow it up to y.
+ *
+ * The index is kept next to the cache and reused while it is younger
+ * than FSR_RMAP_MAXAGE; anything that moves data invalidates it.
+ */
+#define FSR_RMAP_MAGIC		"XFSRRMAP"
+#define FSR_RMAP_VERSION	1
+#define FSR_RMAP_BUFRECS	(1 << 20)	/* records per thread buffer */
+#define FSR_RMAP_MAXTHREADS	16
+#define FSR_RMAP_MAXAGE		3600		/* seconds an index is reused */
+
+#define FSR_RMAP_ATTR		0x1	/* attribute fork */
+#define FSR_RMAP_PREALLOC	0x2	/* unwritten extent */
+#define FSR_RMAP_REG		0x4	/* owner is a regular file */
+
+struct fsr_rmap_hdr {
+	char		magic[8];
+	__u32		version;
+	__u32		recsize;
+	__u64		count;
+	__s64		built;		/* when the walk started */
+	__u32		agcount;
+	__u32		agblocks;
+	unsigned char	uuid[16];
+};
+
+struct fsr_rmap_rec {
+	__u64		pblk;		/* agno * agblocks + agbno */
+	__u64		ino;
+	__u64		offset;		/* in the file, in fs blocks */
+	__u32		len;
+	__u32		flags;		/* FSR_RMAP_* */
+};
+
+struct fsr_rmap {
+	char		path[PATH_MAX];
+	struct fsr_rmap_hdr *hdr;
+	struct fsr_rmap_rec *recs;
+	size_t		maplen;
+};
+
+struct fsr_rmap_run {
+	off64_t		start;		/* record index in the run file */
+	__u64		count;
+};
+
+struct fsr_rmap_build {
+	pthread_mutex_t	lock;		/* run file and runs[] */
+	int		fsfd;
+	int		runfd;
+	jdm_fshandle_t	*fshandlep;
+	xfs_agnumber_t	nextag;		/* next AG to walk */
+	struct fsr_rmap_run *runs;
+	int		nruns;
+	int		maxruns;
+	__u64		nrecs;
+	int		error;
+};
+
+static int
+rmap_reccmp(const void *s1, const void *s2)
+{
+	__u64	b1 = ((struct fsr_rmap_rec *)s1)->pblk;
+	__u64	b2 = ((struct fsr_rmap_rec *)s2)->pblk;
+
+	return (b1 > b2) - (b1 < b2);
+}
+
+/*
+ * Sort a full buffer and append it to the run file as one run.
+ */
+static int
+rmap_spill(struct fsr_rmap_build *bp, struct fsr_rmap_rec *buf, int n)
+{
+	struct fsr_rmap_run *runs;
+	ssize_t		len = n * sizeof(*buf);
+	int		error = 0;
+
+	if (n == 0)
+		return 0;
+	qsort(buf, n, sizeof(*buf), rmap_reccmp);
+
+	pthread_mutex_lock(&bp->lock);
+	if (bp->nruns == bp->maxruns) {
+		bp->maxruns = bp->maxruns ? 2 * bp->maxruns : 64;
+		runs = realloc(bp->runs, bp->maxruns * sizeof(*runs));
+		if (!runs) {
+			error = ENOMEM;
+			goto out;
 		}
+		bp->runs = runs;
+	}
+	if (pwrite64(bp->runfd, buf, len, bp->nrecs * sizeof(*buf)) != len) {
+		error = errno ? errno : EIO;
 		goto out;
 	}
+	bp->runs[bp->nruns].start = bp->nrecs;
+	bp->runs[bp->nruns].count = n;
+	bp->nruns++;
+	bp->nrecs += n;
+out:
+	pthread_mutex_unlock(&bp->lock);
+	return error;
+}
 
+/*
+ * Add the extents of one fork of an open inode to the buffer.
+ */
+static int
+rmap_addfork(struct fsr_rmap_build *bp, struct fsr_rmap_rec *buf, int *np,
+	     int fd, xfs_bstat_t *bs, int attr)
+{
+	struct getbmapx		map[MAPSIZE];
+	struct fsr_rmap_rec	*rp;
+	__s64			bbperblk = fsgeom.blocksize >> BBSHIFT;
+	int			i, error;
 
-     /* Loop through block map allocating existing extents */
-	for (extent = 0; extent < nextents; extent++) {
-		pos = outmap[extent].bmv_offset;
-			space.l_whence = SEEK_CUR;
-			space.l_start = outmap[extent].bmv_offset;
-			space.l_len = outmap[extent].bmv_length;
-
-			if (ioctl(tfd, XFS_IOC_UNRESVSP64, &space) < 0) {
-				fsrprintf(_("could not removespace:"
-					" %s\n"), tname);
-				goto out;
-			}
-			if (lseek64(tfd, outmap[extent].bmv_length, SEEK_CUR) < 0) {
-				fsrprintf(_("could not lseek in tmpfile: %s : %s\n"),
-				   tname, strerror(errno));
-				goto out;
-			}
-			space.l_whence = SEEK_CUR;
-			space.l_start = outmap[extent].bmv_offset + outmap[extent].bmv_length;
-			space.l_len = map[unselected].bmv_length;
-			if (ioctl(tfd, XFS_IOC_RESVSP64, &space) < 0) {
-				fsrprintf(_("could not removespace:"
-					" %s\n"), tname);
-				goto out;
+	memset(map, 0, sizeof(map[0]));
+	map[0].bmv_count = MAPSIZE;
+	map[0].bmv_length = -1;
+	map[0].bmv_iflags = BMV_IF_PREALLOC | (attr ? BMV_IF_ATTRFORK : 0);
+	do {
+		if (ioctl(fd, XFS_IOC_GETBMAPX, map) < 0)
+			return 0;	/* the inode went away, most likely */
+		for (i = 1; i <= map[0].bmv_entries; i++) {
+			if (map[i].bmv_block < 0)
+				continue;
+			if (*np == FSR_RMAP_BUFRECS) {
+				if ((error = rmap_spill(bp, buf, *np)) != 0)
+					return error;
+				*np = 0;
 			}
-			if (lseek64(tfd, map[unselected].bmv_length, SEEK_CUR) < 0) {
-				fsrprintf(_("could not lseek in tmpfile: %s : %s\n"),
-				   tname, strerror(errno));
-				goto out;
+			rp = &buf[(*np)++];
+			rp->pblk = map[i].bmv_block / bbperblk;
+			rp->ino = bs->bs_ino;
+			rp->offset = map[i].bmv_offset / bbperblk;
+			rp->len = map[i].bmv_length / bbperblk;
+			rp->flags = attr ? FSR_RMAP_ATTR : 0;
+			if (map[i].bmv_oflags & BMV_OF_PREALLOC)
+				rp->flags |= FSR_RMAP_PREALLOC;
+			if ((bs->bs_mode & S_IFMT) == S_IFREG)
+				rp->flags |= FSR_RMAP_REG;
+		}
+	} while (map[0].bmv_entries == (MAPSIZE-1));
+	return 0;
+}
+
+/*
+ * Thread body: walk the inodes of whole AGs at a time.  Symlinks and
+ * special files can't be opened by handle; their blocks, and those of
+ * the filesystem's own metadata, show up as owned by nobody.
+ */
+static void *
+rmap_walk(void *arg)
+{
+	struct fsr_rmap_build *bp = arg;
+	struct fsr_rmap_rec *buf;
+	xfs_bstat_t	bstat[GRABSZ], *p, *endp;
+	xfs_agnumber_t	agno;
+	xfs_ino_t	lastino;
+	__s32		buflenout;
+	int		agshift = fsr_agino_log();
+	int		n = 0;
+	int		fd, error = 0;
+
+	if ((buf = malloc(FSR_RMAP_BUFRECS * sizeof(*buf))) == NULL) {
+		bp->error = ENOMEM;
+		return NULL;
+	}
+
+	while (!error && !bp->error &&
+	       (agno = __sync_fetch_and_add(&bp->nextag, 1)) <
+	       fsgeom.agcount) {
+		lastino = agno ? ((xfs_ino_t)agno << agshift) - 1 : 0;
+		while (!error && xfs_bulkstat(bp->fsfd, &lastino, GRABSZ,
+				bstat, &buflenout) == 0 && buflenout > 0) {
+			endp = bstat + buflenout;
+			for (p = bstat; p < endp && !error; p++) {
+				if ((p->bs_ino >> agshift) != agno)
+					break;
+				if (!p->bs_blocks ||
+				    ((p->bs_mode & S_IFMT) != S_IFREG &&
+				     (p->bs_mode & S_IFMT) != S_IFDIR))
+					continue;
+				fd = jdm_open(bp->fshandlep, p, O_RDONLY);
+				if (fd < 0)
+					continue;
+				error = rmap_addfork(bp, buf, &n, fd, p, 0);
+				if (!error && (p->bs_xflags & XFS_XFLAG_HASATTR))
+					error = rmap_addfork(bp, buf, &n,
+							     fd, p, 1);
+				close(fd);
 			}
-			
-	} /* end of space allocation loop */
+			if (p < endp)
+				break;
+		}
+	}
+	if (!error)
+		error = rmap_spill(bp, buf, n);
+	if (error)
+		bp->error = error;
+	free(buf);
+	return NULL;
+}
 
-// Swap the existsing extents
+/*
+ * Merge the sorted runs into the index file.  The run file is mmap'ed
+ * so only the pages being merged need to be in memory.
+ */
+static int
+rmap_merge(struct fsr_rmap_build *bp, FILE *fp)
+{
+	struct fsr_rmap_rec *recs;
+	__u64		*pos;
+	int		*heap;
+	int		nheap = 0;
+	int		i, c, tmp;
+	int		error = 0;
 
-       ext_list_tmp = ext_list_head;
-	do {
-		move_data.orig_start = ext_list_tmp->data.logical;   // Set logical start offset for orig to first start logical blck number of 1st ext
-		/* Logical offset of orig and donor should be same */
-		move_data.donor_start = move_data.orig_start;
-		move_data.len = ext_list_tmp->data.len;		     // Set block length to be moved, to be blocks count of 1st ext
-		move_data.moved_len = 0;
+#define RMAP_HEAD(r)	(&recs[bp->runs[r].start + pos[r]])
+#define RMAP_LESS(a, b)	(RMAP_HEAD(heap[a])->pblk < RMAP_HEAD(heap[b])->pblk)
 
-		ret = page_in_core(fd, move_data, &vec, &page_num);
-		if (ret < 0) {
-			if (mode_flag & DETAIL) {
-				printf("\n");
-				PRINT_ERR_MSG_WITH_ERRNO(
-						"Failed to get file map");
-			} else {
-				printf("\t[ NG ]\n");
-			}
-			return -1;
+	if (bp->nrecs == 0)
+		return 0;
+	recs = mmap(NULL, bp->nrecs * sizeof(*recs), PROT_READ, MAP_SHARED,
+		    bp->runfd, 0);
+	if (recs == MAP_FAILED)
+		return errno;
+	madvise(recs, bp->nrecs * sizeof(*recs), MADV_SEQUENTIAL);
+	pos = calloc(bp->nruns, sizeof(*pos));
+	heap = malloc(bp->nruns * sizeof(*heap));
+	if (!pos || !heap) {
+		error = ENOMEM;
+		goto out;
+	}
+
+	/* a min-heap of run numbers, keyed by each run's next record */
+	for (; nheap < bp->nruns; nheap++) {
+		heap[nheap] = nheap;
+		for (i = nheap; i > 0 && RMAP_LESS(i, (i - 1) / 2);
+		     i = (i - 1) / 2) {
+			tmp = heap[i];
+			heap[i] = heap[(i - 1) / 2];
+			heap[(i - 1) / 2] = tmp;
+		}
+	}
+	while (nheap) {
+		if (fwrite(RMAP_HEAD(heap[0]), sizeof(*recs), 1, fp) != 1) {
+			error = errno ? errno : EIO;
+			goto out;
+		}
+		if (++pos[heap[0]] == bp->runs[heap[0]].count)
+			heap[0] = heap[--nheap];
+		for (i = 0; (c = 2 * i + 1) < nheap; i = c) {
+			if (c + 1 < nheap && RMAP_LESS(c + 1, c))
+				c++;
+			if (!RMAP_LESS(c, i))
+				break;
+			tmp = heap[i];
+			heap[i] = heap[c];
+			heap[c] = tmp;
 		}
+	}
+#undef RMAP_LESS
+#undef RMAP_HEAD
+out:
+	free(heap);
+	free(pos);
+	munmap(recs, bp->nrecs * sizeof(*recs));
+	return error;
+}
+
+/*
+ * Walk the filesystem and write a new index to 'path'.
+ */
+static int
+rmap_build(char *path, int fsfd, jdm_fshandle_t *fshandlep)
+{
+	struct fsr_rmap_build	build, *bp = &build;
+	struct fsr_rmap_hdr	hdr;
+	pthread_t		tids[FSR_RMAP_MAXTHREADS];
+	char			runpath[PATH_MAX];
+	char			tmppath[PATH_MAX];
+	FILE			*fp = NULL;
+	int			nthreads;
+	int			i, n;
+	int			error;
+
+	memset(bp, 0, sizeof(*bp));
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, FSR_RMAP_MAGIC, sizeof(hdr.magic));
+	hdr.version = FSR_RMAP_VERSION;
+	hdr.recsize = sizeof(struct fsr_rmap_rec);
+	hdr.built = time(0);
+	hdr.agcount = fsgeom.agcount;
+	hdr.agblocks = fsgeom.agblocks;
+	memcpy(hdr.uuid, fsgeom.uuid, sizeof(hdr.uuid));
+
+	snprintf(runpath, sizeof(runpath), "%s.runs", path);
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	bp->runfd = open(runpath, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (bp->runfd < 0)
+		return errno;
+	unlink(runpath);
+	pthread_mutex_init(&bp->lock, NULL);
+	bp->fsfd = fsfd;
+	bp->fshandlep = fshandlep;
+
+	nthreads = nworkers > 1 ? nworkers :
+		   max(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+	nthreads = min(nthreads, min((int)fsgeom.agcount,
+				     FSR_RMAP_MAXTHREADS));
+	for (n = 0; n < nthreads; n++)
+		if (pthread_create(&tids[n], NULL, rmap_walk, bp))
+			break;
+	if (n == 0)
+		rmap_walk(bp);
+	for (i = 0; i < n; i++)
+		pthread_join(tids[i], NULL);
+	if ((error = bp->error) != 0)
+		goto out;
 
-		/* XFS_IOC_MOVE_EXT */
-		defraged_ret =						// IOCTL call
-			ioctl(fd, XFS_IOC_MOVE_EXT, &move_data);
+	hdr.count = bp->nrecs;
+	unlink(tmppath);
+	if ((fp = fopen(tmppath, "w")) == NULL) {
+		error = errno;
+		goto out;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+		error = errno ? errno : EIO;
+		goto out;
+	}
+	if ((error = rmap_merge(bp, fp)) != 0)
+		goto out;
+	if (fflush(fp) != 0 || fsync(fileno(fp)) < 0) {
+		error = errno;
+		goto out;
+	}
+	if (rename(tmppath, path) < 0)
+		error = errno;
+	if (vflag)
+		fsrprintf(_("reverse map: %llu extents in %d runs, "
+			"%d threads, %d seconds\n"),
+			(unsigned long long)bp->nrecs, bp->nruns, max(n, 1),
+			(int)(time(0) - hdr.built));
+out:
+	if (fp)
+		fclose(fp);
+	if (error)
+		unlink(tmppath);
+	close(bp->runfd);
+	free(bp->runs);
+	pthread_mutex_destroy(&bp->lock);
+	return error;
+}
 
-		/* Free pages */
-		ret = defrag_fadvise(fd, move_data, vec, page_num);
-		if (vec) {
-			free(vec);
-			vec = NULL;
-		}
-		if (ret < 0) {
-			if (mode_flag & DETAIL) {
-				printf("\n");
-				PRINT_ERR_MSG_WITH_ERRNO(
-					"Failed to free page");
-			} else {
-				printf("\t[ NG ]\n");
-			}
-			return -1;
+/*
+ * Map the index of the filesystem open on 'fsfd', building it first
+ * unless a recent enough one was saved.
+ */
+static int
+rmap_open(struct fsr_rmap *rm, int fsfd, jdm_fshandle_t *fshandlep)
+{
+	struct fsr_rmap_hdr *hdr;
+	struct stat64	sb;
+	char		*p;
+	int		built = 0;
+	int		fd, i;
+
+	memset(rm, 0, sizeof(*rm));
+	p = rm->path + sprintf(rm->path, "%s.", _PATH_FSRRMAP);
+	for (i = 0; i < sizeof(fsgeom.uuid); i++)
+		p += sprintf(p, "%02x", fsgeom.uuid[i]);
+
+again:
+	if ((fd = open(rm->path, O_RDONLY)) >= 0) {
+		if (fstat64(fd, &sb) < 0 || sb.st_size < sizeof(*hdr)) {
+			close(fd);
+			fd = -1;
 		}
-
-		if (defraged_ret < 0) {
-			if (mode_flag & DETAIL) {
-				printf("\n");
-				PRINT_ERR_MSG_WITH_ERRNO(
-					"Failed to defrag with "
-					"XFS_IOC_MOVE_EXT ioctl");
-				if (errno == ENOTTY)
-					printf("\tAt least 2.6.31-rc1 of "
-						"vanilla kernel is required\n");
-			} else {
-				printf("\t[ NG ]\n");
-			}
-			return -1;
+	}
+	if (fd >= 0) {
+		hdr = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (hdr == MAP_FAILED)
+			return errno;
+		if (memcmp(hdr->magic, FSR_RMAP_MAGIC, sizeof(hdr->magic)) == 0 &&
+		    hdr->version == FSR_RMAP_VERSION &&
+		    hdr->recsize == sizeof(struct fsr_rmap_rec) &&
+		    hdr->agcount == fsgeom.agcount &&
+		    hdr->agblocks == fsgeom.agblocks &&
+		    sizeof(*hdr) + hdr->count * hdr->recsize <= sb.st_size &&
+		    (built || time(0) - hdr->built < FSR_RMAP_MAXAGE)) {
+			rm->hdr = hdr;
+			rm->recs = (struct fsr_rmap_rec *)(hdr + 1);
+			rm->maplen = sb.st_size;
+			if (vflag && !built)
+				fsrprintf(_("using reverse map from %d "
+					"seconds ago\n"),
+					(int)(time(0) - hdr->built));
+			return 0;
 		}
-		/* Adjust logical offset for next ioctl */
-		move_data.orig_start += move_data.moved_len;		// Increment logical start offset
-		move_data.donor_start = move_data.orig_start;		// Set donor start
+		munmap(hdr, sb.st_size);
+	}
+	if (built)
+		return EINVAL;
 
-		start = move_data.orig_start * buf->st_blksize;
+	if ((i = rmap_build(rm->path, fsfd, fshandlep)) != 0)
+		return i;
+	built = 1;
+	goto again;
+}
 
-		/* Print defrag progress */
-		print_progress(file, start, buf->st_size);	// The above adjusting gets overwritten in next iteration and is
-								// just there for printing progress
-		/* End of file */
-		if (start >= buf->st_size)			// Check for end of file
-			break;
+static void
+rmap_close(struct fsr_rmap *rm)
+{
+	if (rm->hdr)
+		munmap(rm->hdr, rm->maplen);
+	rm->hdr = NULL;
+}
 
-		ext_list_tmp = ext_list_tmp->next;		// Get next extent from link list
-	} while (ext_list_tmp != ext_list_head);
+/*
+ * The data moved, so a saved index no longer describes the filesystem.
+ */
+static void
+rmap_invalidate(struct fsr_rmap *rm)
+{
+	unlink(rm->path);
+}
 
+/*
+ * Find the records covering blocks [bno, bno + len) of AG 'agno'.
+ * Returns the first of them and sets '*countp' to how many there are.
+ */
+static struct fsr_rmap_rec *
+rmap_lookup(struct fsr_rmap *rm, xfs_agnumber_t agno, xfs_agblock_t bno,
+	    xfs_extlen_t len, __u64 *countp)
+{
+	struct fsr_rmap_rec *recs = rm->recs;
+	__u64		start = (__u64)agno * fsgeom.agblocks + bno;
+	__u64		end = start + len;
+	__u64		lo = 0, hi = rm->hdr->count, mid, first;
+
+	/* first record starting at or after 'start' */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (recs[mid].pblk < start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	/* the one before may reach into the range */
+	if (lo > 0 && recs[lo - 1].pblk + recs[lo - 1].len > start)
+		lo--;
+	first = lo;
+	while (lo < rm->hdr->count && recs[lo].pblk < end)
+		lo++;
+	*countp = lo - first;
+	return &recs[first];
+}
 
-	/* Report progress */
-	if (vflag)
-		fsrprintf(_("extents before:%d after:%d %s %s\n"),
-			  cur_nextents, new_nextents,
-			  (new_nextents <= nextents ? "DONE" : "    " ),
-		          fname);
-	retval = 0;
+/*
+ * Free space compaction (-z).
+ *
+ * Large new files come out fragmented when free space is in small
+ * pieces, whatever fsr does to the files already there.  Compaction
+ * picks the window of an AG that is cheapest to turn into one free
+ * extent -- the one with the most free space already in it, spread
+ * over several free extents -- and moves the file data pinning it
+ * to another AG.  Small files are moved whole, larger ones only by
+ * the ranges inside the window.  Data is moved with
+ * XFS_IOC_RELOCATE_RANGE, which lets us choose the AG it goes to.
+ */
+#define FSR_COMPACT_WINDOW	(256ULL << 20)	/* bytes cleared at a time */
+#define FSR_COMPACT_SMALL	(1ULL << 20)	/* files moved whole */
+#define FSR_COMPACT_NFREE	128		/* free extents per call */
 
-	fsrprintf("\nPartial defragmenetation was sucessfull...\n");
+struct fsr_freeext {
+	xfs_agblock_t	bno;
+	xfs_extlen_t	len;
+};
 
+struct fsr_agfree {
+	__u64		free;		/* free blocks */
+	__u64		nfree;		/* free extents */
+	xfs_extlen_t	longest;	/* longest free extent */
+};
 
-out:
-	free(fbuf);
-	if (tfd != -1)
-		close(tfd);
-	if (ffd != -1)
-		close(ffd);
-	return retval;
-}
+/* a file range inside the window */
+struct fsr_pin {
+	xfs_ino_t	ino;
+	__s64		offset;		/* bytes */
+	__s64		length;
+	__s64		size;		/* of the whole file */
+};
 
-char *
-gettmpname(char *fname)
+/*
+ * Read the free space of an AG in block order with FIEMAPFS.  Fills in
+ * '*afp' and, if 'extp' isn't NULL, returns the free extents in it.
+ */
+static int
+fsr_freesp(int fsfd, xfs_agnumber_t agno, struct fsr_agfree *afp,
+	   struct fsr_freeext **extp, int *nextp)
 {
-	static char	buf[PATH_MAX+1];
-	char		sbuf[SMBUFSZ];
-	char		*ptr;
+	struct fiemap		*fiemap;
+	struct fiemap_extent	*fe;
+	struct fsr_freeext	*ext = NULL, *e;
+	__u64			agbytes = (__u64)fsgeom.agblocks *
+					  fsgeom.blocksize;
+	__u64			start = agbytes * agno;
+	__u64			end = start + agbytes;
+	xfs_extlen_t		len;
+	int			n = 0, max = 0;
+	int			last = 0;
+	int			i;
+
+	memset(afp, 0, sizeof(*afp));
+	fiemap = malloc(sizeof(struct fiemap) +
+			FSR_COMPACT_NFREE * sizeof(struct fiemap_extent));
+	if (!fiemap)
+		return -1;
 
-	sprintf(sbuf, "/.fsr%d", getpid());
+	while (!last && start < end) {
+		memset(fiemap, 0, sizeof(*fiemap));
+		fiemap->fm_flags = FIEMAPFS_FLAG_FREESP;
+		fiemap->fm_start = start;
+		fiemap->fm_length = end - start;
+		fiemap->fm_extent_count = FSR_COMPACT_NFREE;
+		if (ioctl(fsfd, XFS_IOC_FIEMAPFS, fiemap) < 0) {
+			free(fiemap);
+			free(ext);
+			return -1;
+		}
+		if (!fiemap->fm_mapped_extents)
+			break;
 
-	strncpy(buf, fname, PATH_MAX);
-	buf[PATH_MAX] = '\0';
-	ptr = strrchr(buf, '/');
-	if (ptr) {
-		*ptr = '\0';
-	} else {
-		strcpy(buf, ".");
+		for (i = 0; i < fiemap->fm_mapped_extents; i++) {
+			fe = &fiemap->fm_extents[i];
+			len = fe->fe_length / fsgeom.blocksize;
+			afp->free += len;
+			afp->nfree++;
+			afp->longest = max(afp->longest, len);
+			if (extp) {
+				if (n == max) {
+					max = max ? 2 * max : 1024;
+					e = realloc(ext, max * sizeof(*ext));
+					if (!e) {
+						free(fiemap);
+						free(ext);
+						return -1;
+					}
+					ext = e;
+				}
+				ext[n].bno = (fe->fe_physical -
+					      agbytes * agno) / fsgeom.blocksize;
+				ext[n].len = len;
+				n++;
+			}
+			if (fe->fe_flags & FIEMAP_EXTENT_LAST)
+				last = 1;
+		}
+		fe = &fiemap->fm_extents[fiemap->fm_mapped_extents - 1];
+		start = max(start, fe->fe_logical + fe->fe_length);
 	}
-
-	if ((strlen(buf) + strlen (sbuf)) > PATH_MAX) {
-		fsrprintf(_("tmp file name too long: %s\n"), fname);
-		return(NULL);
+	free(fiemap);
+	if (extp) {
+		*extp = ext;
+		*nextp = n;
 	}
+	return 0;
+}
 
-	strcat(buf, sbuf);
+/*
+ * Find the window of 'w' blocks with the most free space in it, spread
+ * over at least two free extents.  Returns the free blocks in it.
+ */
+static __u64
+compact_window(struct fsr_freeext *ext, int n, xfs_extlen_t w,
+	       xfs_agblock_t *startp)
+{
+	__u64		sum = 0, nfree, best = 0;
+	xfs_agblock_t	end;
+	int		i, j = 0;
 
-	return(buf);
+	for (i = 0; i < n; i++) {
+		if (ext[i].bno + (__u64)w > fsgeom.agblocks)
+			break;
+		end = ext[i].bno + w;
+		if (j < i) {
+			j = i;
+			sum = 0;
+		}
+		while (j < n && ext[j].bno < end)
+			sum += ext[j++].len;
+		nfree = sum;
+		if (ext[j - 1].bno + ext[j - 1].len > end)
+			nfree -= ext[j - 1].bno + ext[j - 1].len - end;
+		if (j - i >= 2 && nfree > best) {
+			best = nfree;
+			*startp = ext[i].bno;
+		}
+		sum -= ext[i].len;
+	}
+	return best;
 }
 
-char *
-getparent(char *fname)
+/*
+ * Find the file data inside [bno, bno + len) of AG 'agno' in the
+ * reverse map.  Only regular file data can be relocated; blocks owned
+ * by anything else are counted in '*pinnedp'.
+ */
+static int
+compact_owners(struct fsr_rmap *rm, xfs_agnumber_t agno, xfs_agblock_t bno,
+	       xfs_extlen_t len, struct fsr_pin **pinsp, int *npinsp,
+	       __u64 *pinnedp)
 {
-	static char	buf[PATH_MAX+1];
-	char		*ptr;
+	struct fsr_rmap_rec *rp;
+	struct fsr_pin	*pins, *pp;
+	__u64		start = (__u64)agno * fsgeom.agblocks + bno;
+	__u64		end = start + len;
+	__u64		s, e, count, i;
+	int		npins = 0;
+
+	rp = rmap_lookup(rm, agno, bno, len, &count);
+	*pinnedp = 0;
+	pins = malloc(max(count, 1) * sizeof(*pins));
+	if (!pins)
+		return -1;
 
-	strncpy(buf, fname, PATH_MAX);
-	buf[PATH_MAX] = '\0';
-	ptr = strrchr(buf, '/');
-	if (ptr) {
-		if (ptr == &buf[0])
-			++ptr;
-		*ptr = '\0';
-	} else {
-		strcpy(buf, ".");
+	for (i = 0; i < count; i++, rp++) {
+		s = max(rp->pblk, start);
+		e = min(rp->pblk + rp->len, end);
+		if (!(rp->flags & FSR_RMAP_REG) || (rp->flags & FSR_RMAP_ATTR)) {
+			*pinnedp += e - s;
+			continue;
+		}
+		pp = &pins[npins++];
+		pp->ino = rp->ino;
+		pp->offset = (rp->offset + s - rp->pblk) * fsgeom.blocksize;
+		pp->length = (e - s) * fsgeom.blocksize;
+		pp->size = 0;	/* filled in by the caller */
 	}
 
-	return(buf);
+	*pinsp = pins;
+	*npinsp = npins;
+	return 0;
 }
 
+/* smallest files first, then by inode and offset */
+static int
+compact_pincmp(const void *s1, const void *s2)
+{
+	const struct fsr_pin *p1 = s1;
+	const struct fsr_pin *p2 = s2;
+
+	if (p1->size != p2->size)
+		return (p1->size > p2->size) - (p1->size < p2->size);
+	if (p1->ino != p2->ino)
+		return (p1->ino > p2->ino) - (p1->ino < p2->ino);
+	return (p1->offset > p2->offset) - (p1->offset < p2->offset);
+}
 
 /*
- * Read in block map of the input file, coalesce contiguous
- * extents into a single range, keep all holes. Convert from 512 byte
- * blocks to bytes.
- *
- * This code was borrowed from mv.c with some minor mods.
+ * Move one pinned range, or the whole file if it is small, to AG
+ * 'dest'.  Returns 0 if it was moved, 1 if it was moved whole (so the
+ * file's other pins are done too), -1 on error.
  */
-#define MAPSIZE	128
-#define	OUTMAP_SIZE_INCREMENT	MAPSIZE
-
-int	read_fd_bmap(int fd, xfs_bstat_t *sin, int *cur_nextents)
+static int
+compact_move(jdm_fshandle_t *fshandlep, int fsfd, struct fsr_pin *pp,
+	     xfs_agnumber_t dest)
 {
-	int		i, cnt;
-	struct getbmap	map[MAPSIZE];
+	xfs_relocate_range_t	rr;
+	xfs_bstat_t		bstat;
+	xfs_ino_t		ino = pp->ino;
+	int			whole;
+	int			fd;
 
-#define	BUMP_CNT	\
-	if (++cnt >= outmap_size) { \
-		outmap_size += OUTMAP_SIZE_INCREMENT; \
-		outmap = (struct getbmap *)realloc(outmap, \
-		                           outmap_size*sizeof(*outmap)); \
-		if (outmap == NULL) { \
-			fsrprintf(_("realloc failed: %s\n"), \
-				strerror(errno)); \
-			exit(1); \
-		} \
-	}
+	if (xfs_bulkstat_single(fsfd, &ino, &bstat) < 0)
+		return -1;
+	if (bstat.bs_xflags & (XFS_XFLAG_IMMUTABLE|XFS_XFLAG_APPEND))
+		return -1;
+	if ((fd = jdm_open(fshandlep, &bstat, O_RDWR)) < 0)
+		return -1;
 
-	/*	Initialize the outmap array.  It always grows - never shrinks.
-	 *	Left-over memory allocation is saved for the next files.
-	 */
-	if (outmap_size == 0) {
-		outmap_size = OUTMAP_SIZE_INCREMENT; /* Initial size */
-		outmap = (struct getbmap *)malloc(outmap_size*sizeof(*outmap));
-		if (!outmap) {
-			fsrprintf(_("malloc failed: %s\n"),
-				strerror(errno));
-			exit(1);
-		}
+	whole = bstat.bs_size <= FSR_COMPACT_SMALL;
+	memset(&rr, 0, sizeof(rr));
+	rr.rr_version = XFS_RR_VERSION;
+	rr.rr_flags = XFS_RR_AGNO;
+	rr.rr_agno = dest;
+	rr.rr_offset = whole ? 0 : pp->offset;
+	rr.rr_length = whole ? (bstat.bs_size + bstat.bs_blksize - 1) /
+			       bstat.bs_blksize * bstat.bs_blksize : pp->length;
+
+	if (ioctl(fd, XFS_IOC_RELOCATE_RANGE, &rr) < 0) {
+		if (vflag || dflag || errno == ENOTTY)
+			fsrprintf(_("ino=%llu: XFS_IOC_RELOCATE_RANGE: %s\n"),
+				  (unsigned long long)pp->ino,
+				  strerror(errno));
+		close(fd);
+		return errno == ENOTTY ? -2 : -1;
 	}
+	if (dflag)
+		fsrprintf(_("ino=%llu: moved %lld bytes at %lld to AG %u\n"),
+			  (unsigned long long)pp->ino, (long long)rr.rr_moved,
+			  (long long)rr.rr_offset, dest);
+	close(fd);
+	return whole;
+}
 
-	outmap[0].bmv_block = 0;
-	outmap[0].bmv_offset = 0;
-	outmap[0].bmv_length = sin->bs_size;
+/*
+ * fsrcompact -- turn the most promising part of one AG into a large
+ * free extent
+ */
+static void
+fsrcompact(char *mntdir)
+{
+	struct fsr_agfree	*before = NULL, after;
+	struct fsr_freeext	*ext;
+	struct fsr_pin		*pins = NULL;
+	struct fsr_rmap		rmap;
+	xfs_bstat_t		bstat;
+	xfs_ino_t		ino;
+	__u64			pinned;
+	jdm_fshandle_t		*fshandlep = NULL;
+	xfs_agnumber_t		agno, target = NULLAGNUMBER, dest;
+	xfs_agblock_t		start, bstart = 0;
+	xfs_extlen_t		w;
+	__u64			nfree, best = 0;
+	int			fsfd, next, npins = 0;
+	int			moved = 0, failed = 0;
+	int			i, ret;
+
+	if ((fsfd = open(mntdir, O_RDONLY)) < 0) {
+		fsrprintf(_("unable to open: %s: %s\n"),
+			  mntdir, strerror(errno));
+		return;
+	}
+	if (xfs_getgeom(fsfd, &fsgeom) < 0) {
+		fsrprintf(_("Skipping %s: could not get XFS geometry\n"),
+			  mntdir);
+		goto out;
+	}
+	if ((fshandlep = jdm_getfshandle(mntdir)) == NULL) {
+		fsrprintf(_("unable to get handle: %s: %s\n"),
+			  mntdir, strerror(errno));
+		goto out;
+	}
+	before = calloc(fsgeom.agcount, sizeof(*before));
+	if (!before)
+		goto out;
+	w = min(FSR_COMPACT_WINDOW / fsgeom.blocksize,
+		(__u64)fsgeom.agblocks);
 
 	/*
-	 * If a non regular file is involved then forget holes
+	 * Clearing a window only helps an AG whose free extents are all
+	 * smaller than it; of those, take the window that needs the least
+	 * data moved out of it.
 	 */
+	for (agno = 0; agno < fsgeom.agcount; agno++) {
+		if (fsr_freesp(fsfd, agno, &before[agno], &ext, &next) < 0) {
+			fsrprintf(_("%s: XFS_IOC_FIEMAPFS: %s\n"),
+				  mntdir, strerror(errno));
+			goto out;
+		}
+		if (before[agno].longest < w &&
+		    (nfree = compact_window(ext, next, w, &start)) > best) {
+			best = nfree;
+			target = agno;
+			bstart = start;
+		}
+		free(ext);
+	}
+	if (target == NULLAGNUMBER) {
+		fsrprintf(_("%s: no free space worth compacting\n"), mntdir);
+		goto out;
+	}
 
-	if (!S_ISREG(sin->bs_mode))
-		return(1);
-
-	outmap[0].bmv_length = 0;
+	/* send the data to the AG with the most room */
+	dest = target;
+	for (agno = 0; agno < fsgeom.agcount; agno++)
+		if (agno != target &&
+		    (dest == target || before[agno].free > before[dest].free))
+			dest = agno;
+	if (dest == target || before[dest].free < w - best) {
+		fsrprintf(_("%s: no AG has room for the data to move\n"),
+			  mntdir);
+		goto out;
+	}
 
-	map[0].bmv_offset = 0;
-	map[0].bmv_block = 0;
-	map[0].bmv_entries = 0;
-	map[0].bmv_count = MAPSIZE;
-	map[0].bmv_length = -1;
+	fsrprintf(_("%s: compacting AG %u blocks %u-%u, %llu of %u blocks "
+		"free, longest free extent %u\n"), mntdir, target, bstart,
+		bstart + w - 1, (unsigned long long)best, w,
+		before[target].longest);
 
-	cnt = 0;
-	*cur_nextents = 0;
+	if ((ret = rmap_open(&rmap, fsfd, fshandlep)) != 0) {
+		fsrprintf(_("%s: could not build reverse map: %s\n"),
+			  mntdir, strerror(ret));
+		goto out;
+	}
+	ret = compact_owners(&rmap, target, bstart, w, &pins, &npins, &pinned);
+	rmap_close(&rmap);
+	if (ret < 0) {
+		fsrprintf(_("%s: malloc failed: %s\n"),
+			  mntdir, strerror(errno));
+		goto out;
+	}
+	if (vflag)
+		fsrprintf(_("%s: %d file ranges in the window, %llu blocks "
+			"of metadata that can't be moved\n"), mntdir, npins,
+			(unsigned long long)pinned);
+
+	/* sorting wants the file sizes */
+	for (i = 0; i < npins; i++) {
+		ino = pins[i].ino;
+		if (xfs_bulkstat_single(fsfd, &ino, &bstat) == 0)
+			pins[i].size = bstat.bs_size;
+		else
+			pins[i].size = LLONG_MAX;
+	}
 
-	do {
-		if (ioctl(fd, XFS_IOC_GETBMAP, map) < 0) {
-			fsrprintf(_("failed reading extents: inode %llu"),
-			         (unsigned long long)sin->bs_ino);
-			exit(1);
+	qsort(pins, npins, sizeof(*pins), compact_pincmp);
+	for (i = 0; i < npins; i++) {
+		if (endtime && endtime < time(0)) {
+			fsrprintf(_("%s: out of time\n"), mntdir);
+			break;
 		}
-
-		/* Concatenate extents together and replicate holes into
-		 * the output map.
-		 */
-
-		*cur_nextents += map[0].bmv_entries;
-	
-		if(uflag)
-			extent_map(&map);
-
-		for (i = 0; i < map[0].bmv_entries; i++) {
-			if (map[i + 1].bmv_block == -1) {
-			 	BUMP_CNT;
-				outmap[cnt] = map[i+1];
-			} else if (outmap[cnt].bmv_block == -1) {
-				BUMP_CNT;
-				outmap[cnt] = map[i+1];
-			} else {					// This iteration called always
-				outmap[cnt].bmv_length += map[i + 1].bmv_length;
-			}
+		ret = compact_move(fshandlep, fsfd, &pins[i], dest);
+		if (ret == -2)
+			break;
+		if (ret < 0) {
+			failed++;
+			continue;
 		}
+		moved++;
+		rmap_invalidate(&rmap);
+		/* a file moved whole takes its other ranges with it */
+		if (ret == 1)
+			while (i + 1 < npins && pins[i + 1].ino == pins[i].ino &&
+			       pins[i + 1].offset + pins[i + 1].length <=
+			       pins[i].size + fsgeom.blocksize - 1)
+				i++;
+	}
 
+	/* report progress as the growth of the longest free extents */
+	for (agno = 0; agno < fsgeom.agcount; agno++) {
+		if (fsr_freesp(fsfd, agno, &after, NULL, NULL) < 0)
+			break;
+		if (after.longest != before[agno].longest || vflag)
+			fsrprintf(_("%s: AG %u longest free extent %u -> %u "
+				"blocks, %llu -> %llu free extents\n"),
+				mntdir, agno, before[agno].longest,
+				after.longest,
+				(unsigned long long)before[agno].nfree,
+				(unsigned long long)after.nfree);
+	}
+	fsrprintf(_("%s: moved %d ranges, %d could not be moved\n"),
+		  mntdir, moved, failed);
 
-	} while (map[0].bmv_entries == (MAPSIZE-1));
-
-	for (i = 0; i <= cnt; i++) {
-		outmap[i].bmv_offset = BBTOB(outmap[i].bmv_offset);
-		outmap[i].bmv_length = BBTOB(outmap[i].bmv_length);
+out:
+	free(pins);
+	free(before);
+	free(fshandlep);
+	close(fsfd);
+}
 
-	}
-	
-	if(!uflag)
-		outmap[cnt].bmv_length = sin->bs_size - outmap[cnt].bmv_offset;
+/*
+ * AG rebalancing (-B spread).
+ *
+ * Allocations go to the AGs with room, so a few nearly full AGs push
+ * every writer onto the others' AGF locks while whatever does land in
+ * them fragments.  Rebalancing moves files out of the fullest AG into
+ * the emptiest until the usage of all AGs is within 'spread' percent.
+ * Files to move are found in the reverse map; they are copied into a
+ * temporary file created in a directory that lives in the destination
+ * AG, so the inode64 allocator puts the data there, and swapped in
+ * with the usual packfile() path.
+ */
+struct fsr_agusage {
+	__s64		size;		/* blocks in the AG */
+	__s64		free;
+};
 
-	return(cnt+1);
-}
+struct fsr_balcand {
+	xfs_ino_t	ino;
+	__u64		blocks;		/* in the source AG */
+};
 
+static int	*tmp_dirag;		/* AG each .fsr/agN directory is in */
 
 /*
- * extent_map() -	Select and mark extents for defrag
- * AUTHOR: Amey
- * @tmp_map[]:		outmap for temp file		
+ * Find out which AG each temporary directory really is in; the
+ * allocator chose, not us.
  */
-int
-extent_map(struct getbmap *tmp_map) 
+static void
+tmp_mapag(char *mnt)
 {
-	struct cumulative_exts exts[MAPSIZE];
-	int i, k, j;
-	int index, m=0;		
-	int flag;
-	int marker = 0;
-	int sum = 0;					
-	int block_size = 512;		// The XFS block size is 4KB but map and outmap are filled considreing it as 512bytes
-
-	int counter = 0;						
-
-	if(fp==NULL)
-	{
-	 fsrprintf("\nFILE open error\n");
-	}	
+	struct stat64	sb;
+	char		buf[SMBUFSZ];
+	int		i;
 
-	for(i = 1 ; i <= tmp_map[0].bmv_entries ; i++)		
-	{
-	 sum += tmp_map[i].bmv_length;
-	}							
+	free(tmp_dirag);
+	tmp_dirag = malloc(fsgeom.agcount * sizeof(*tmp_dirag));
+	if (!tmp_dirag)
+		return;
+	for (i = 0; i < fsgeom.agcount; i++) {
+		sprintf(buf, "%s/.fsr/ag%d", mnt, i);
+		tmp_dirag[i] = stat64(buf, &sb) < 0 ? -1 :
+			       (int)fsr_ino_to_agno(sb.st_ino);
+	}
+}
 
-	m++;							
-	exts[m].size = sum;
-	exts[m].start = 1;
-	exts[m].last = tmp_map[0].bmv_entries;			
+/*
+ * A temporary file name in AG 'agno', or NULL if no temporary
+ * directory ended up in it.
+ */
+static char *
+tmp_in_ag(char *mnt, xfs_agnumber_t agno)
+{
+	static char	buf[SMBUFSZ];
+	int		i;
 
-	for ( i = 1 ; i <= (tmp_map[0].bmv_entries - 2) ; i++)
-	{
-		for ( k = 1 ; ; k++)		
-		{
-			m++;		
-			exts[m].size = tmp_map[k].bmv_length;
-			exts[m].start = k;
-			for (j = 1 ; j <= i; j++)
-			{
-				index = k + j;		
-				exts[m].size += tmp_map[index].bmv_length;
-				if (index == tmp_map[0].bmv_entries) 
-				{	
-					flag = 1;
-				}
-			}
-			exts[m].last = index;			
-			if ( flag )
-			{
-				flag = 0;			
-				break;
-			}
+	for (i = 0; tmp_dirag && i < fsgeom.agcount; i++) {
+		if (tmp_dirag[i] == agno) {
+			sprintf(buf, "%s/.fsr/ag%d/tmp%d",
+				(strcmp(mnt, "/") == 0) ? "" : mnt, i, getpid());
+			return buf;
 		}
 	}
+	return NULL;
+}
 
-	fsrprintf("\nThe cumulative extents data structure:\n");
-	fsrprintf("\nfrom\tto\tblocks\t\t\tlength(bytes)\tindex\n");
+static int
+balance_read(int fsfd, struct fsr_agusage *use)
+{
+	struct fsr_agfree	af;
+	xfs_agnumber_t		agno;
 
-	for (i = 1 ; i <= m  ; i++)
-	{
-		fsrprintf(" %d \t %d \t %d \t\t %lld \t %d \n", exts[i].start, exts[i].last, exts[i].size, exts[i].size * block_size, i );
-		if ( (exts[i].size * block_size) <= freesp)
-		{
-			//if(exts[marker].size < exts[i].size)	
-				marker = i;
-		}
+	for (agno = 0; agno < fsgeom.agcount; agno++) {
+		if (fsr_freesp(fsfd, agno, &af, NULL, NULL) < 0)
+			return -1;
+		use[agno].size = fsgeom.agblocks;
+		if (agno == fsgeom.agcount - 1)
+			use[agno].size = fsgeom.datablocks -
+				(__u64)agno * fsgeom.agblocks;
+		use[agno].free = af.free;
 	}
+	return 0;
+}
 
-	if(marker == 0) 
-	{		
-		fsrprintf("\nNO SELECTION DONE: Insufficent free space to perform partial defragmentation (exit)\n");
-		exit(1);	
-	}
+static double
+balance_util(struct fsr_agusage *up)
+{
+	return 100.0 * (up->size - up->free) / up->size;
+}
 
-	fsrprintf("\nThe marker value chosen from above index is :%d\n",marker);
-	
+static int
+balance_inocmp(const void *s1, const void *s2)
+{
+	xfs_ino_t	i1 = ((struct fsr_balcand *)s1)->ino;
+	xfs_ino_t	i2 = ((struct fsr_balcand *)s2)->ino;
 
-	for(i = 1 ; i <= tmp_map[0].bmv_entries ; i++)
-	{
-	 if( (i < exts[marker].start) || (i > exts[marker].last))
-	 { 
-	  counter++;
-	 }
-	}						
-	fprintf(fp,"%d\n",counter);
-	unselected = counter;
+	return (i1 > i2) - (i1 < i2);
+}
 
+/* biggest first */
+static int
+balance_candcmp(const void *s1, const void *s2)
+{
+	__u64	b1 = ((struct fsr_balcand *)s1)->blocks;
+	__u64	b2 = ((struct fsr_balcand *)s2)->blocks;
 
-	k = exts[marker].start;
+	return (b1 < b2) - (b1 > b2);
+}
 
-	for ( i = 0 ; i<= tmp_map[0].bmv_entries ; i++ )
-	{
-		tmp_map[k - exts[marker].start + 1] = tmp_map[k];
-		k++;
+/*
+ * Collect the regular files with data in AG 'agno', with how much of
+ * it each has there.
+ */
+static int
+balance_cands(struct fsr_rmap *rm, xfs_agnumber_t agno,
+	      struct fsr_balcand **candsp, int *ncandsp)
+{
+	struct fsr_rmap_rec *rp;
+	struct fsr_balcand *cands;
+	__u64		count, i;
+	int		n = 0, j;
+
+	rp = rmap_lookup(rm, agno, 0, fsgeom.agblocks, &count);
+	cands = malloc(max(count, 1) * sizeof(*cands));
+	if (!cands)
+		return -1;
+
+	/* the index is in block order, so gather by inode afterwards */
+	for (i = 0; i < count; i++, rp++) {
+		if (!(rp->flags & FSR_RMAP_REG) || (rp->flags & FSR_RMAP_ATTR))
+			continue;
+		cands[n].ino = rp->ino;
+		cands[n].blocks = rp->len;
+		n++;
+	}
+	qsort(cands, n, sizeof(*cands), balance_inocmp);
+	for (i = 0, j = 0; i < n; i++) {
+		if (j && cands[j - 1].ino == cands[i].ino)
+			cands[j - 1].blocks += cands[i].blocks;
+		else
+			cands[j++] = cands[i];
 	}
+	qsort(cands, j, sizeof(*cands), balance_candcmp);
+	*candsp = cands;
+	*ncandsp = j;
+	return 0;
+}
 
-	m = exts[marker].last -exts[marker].start + 2;
-	tmp_map[m].bmv_length= tmp_map[m].bmv_offset = tmp_map[m].bmv_block = tmp_map[m].bmv_entries =  0;
-	tmp_map[0].bmv_offset = exts[marker].size;
-	tmp_map[0].bmv_entries =  (exts[marker].last - exts[marker].start) + 1; 
+/*
+ * Copy one file into a temporary file in AG 'dest' and swap it in.
+ * Returns 0 only if the file was moved.
+ */
+static int
+balance_move(jdm_fshandle_t *fshandlep, int fsfd, char *mntdir,
+	     xfs_ino_t ino, xfs_agnumber_t dest)
+{
+	xfs_bstat_t	bstat;
+	char		fname[64];
+	char		*tname;
+	int		fd;
+	int		packed = -1;
+
+	if (xfs_bulkstat_single(fsfd, &ino, &bstat) < 0 ||
+	    (bstat.bs_mode & S_IFMT) != S_IFREG)
+		return -1;
+	if ((tname = tmp_in_ag(mntdir, dest)) == NULL)
+		return -1;
+	if ((fd = jdm_open(fshandlep, &bstat, O_RDWR|O_DIRECT)) < 0)
+		return -1;
+	sprintf(fname, "ino=%lld", (long long)bstat.bs_ino);
 
-	return 1;
+	relocating = 1;
+	fsrfile_common(fname, tname, mntdir, fd, &bstat, &packed);
+	relocating = 0;
+	close(fd);
+	return packed == 0 ? 0 : -1;
 }
 
-
 /*
- * Read the block map and return the number of extents.
+ * fsrbalance -- even out the usage of the AGs of a filesystem
  */
-int
-getnextents(int fd)
+static void
+fsrbalance(char *mntdir)
 {
-	int		nextents;
-	struct getbmap	map[MAPSIZE];
+	struct fsr_agusage	*before = NULL, *use = NULL;
+	struct fsr_balcand	*cands = NULL;
+	struct fsr_rmap		rmap;
+	jdm_fshandle_t		*fshandlep = NULL;
+	xfs_agnumber_t		agno, src, dst, candag = NULLAGNUMBER;
+	__s64			need;
+	int			fsfd, ncands = 0, next = 0;
+	int			moved = 0, failed = 0;
+	int			ret;
+
+	memset(&rmap, 0, sizeof(rmap));
+	if ((fsfd = open(mntdir, O_RDONLY)) < 0) {
+		fsrprintf(_("unable to open: %s: %s\n"),
+			  mntdir, strerror(errno));
+		return;
+	}
+	if (xfs_getgeom(fsfd, &fsgeom) < 0) {
+		fsrprintf(_("Skipping %s: could not get XFS geometry\n"),
+			  mntdir);
+		goto out;
+	}
+	if ((fshandlep = jdm_getfshandle(mntdir)) == NULL) {
+		fsrprintf(_("unable to get handle: %s: %s\n"),
+			  mntdir, strerror(errno));
+		goto out;
+	}
+	before = calloc(fsgeom.agcount, sizeof(*before));
+	use = calloc(fsgeom.agcount, sizeof(*use));
+	if (!before || !use)
+		goto out;
+	if (balance_read(fsfd, before) < 0) {
+		fsrprintf(_("%s: XFS_IOC_FIEMAPFS: %s\n"),
+			  mntdir, strerror(errno));
+		goto out;
+	}
+	memcpy(use, before, fsgeom.agcount * sizeof(*use));
 
-	map[0].bmv_offset = 0;
-	map[0].bmv_block = 0;
-	map[0].bmv_entries = 0;
-	map[0].bmv_count = MAPSIZE;
-	map[0].bmv_length = -1;
+	tmp_init(mntdir);
 
-	nextents = 0;
+	for (;;) {
+		if (endtime && endtime < time(0)) {
+			fsrprintf(_("%s: out of time\n"), mntdir);
+			break;
+		}
 
-	do {
-		if (ioctl(fd,XFS_IOC_GETBMAP, map) < 0) {
-			fsrprintf(_("failed reading extents"));
-			exit(1);
+		/*
+		 * Fullest AG, and the emptiest one we can create files in.
+		 * Usage is tracked from what was moved rather than read
+		 * again after every file.
+		 */
+		src = dst = NULLAGNUMBER;
+		for (agno = 0; agno < fsgeom.agcount; agno++) {
+			if (src == NULLAGNUMBER ||
+			    balance_util(&use[agno]) > balance_util(&use[src]))
+				src = agno;
+			if (tmp_in_ag(mntdir, agno) &&
+			    (dst == NULLAGNUMBER ||
+			     balance_util(&use[agno]) < balance_util(&use[dst])))
+				dst = agno;
 		}
+		if (dst == NULLAGNUMBER || src == dst ||
+		    balance_util(&use[src]) - balance_util(&use[dst]) <=
+		    bspread)
+			break;
 
-		nextents += map[0].bmv_entries;
-	} while (map[0].bmv_entries == (MAPSIZE-1));
+		if (src != candag) {
+			free(cands);
+			cands = NULL;
+			ncands = next = 0;
+			if (!rmap.hdr &&
+			    (ret = rmap_open(&rmap, fsfd, fshandlep)) != 0) {
+				fsrprintf(_("%s: could not build reverse "
+					"map: %s\n"), mntdir, strerror(ret));
+				break;
+			}
+			if (balance_cands(&rmap, src, &cands, &ncands) < 0)
+				break;
+			candag = src;
+		}
 
-	return(nextents);
-}
+		/*
+		 * Take the biggest file that doesn't move more than it takes
+		 * to even out src and dst, or the smallest there is.
+		 */
+		need = (use[dst].free * use[src].size -
+			use[src].free * use[dst].size) /
+		       (use[src].size + use[dst].size);
+		while (next < ncands && cands[next].blocks > max(need, 1) &&
+		       next + 1 < ncands)
+			next++;
+		if (next >= ncands) {
+			fsrprintf(_("%s: nothing left to move out of AG %u\n"),
+				  mntdir, src);
+			break;
+		}
 
-/*
- * Get the fs geometry
- */
-int
-xfs_getgeom(int fd, xfs_fsop_geom_v1_t * fsgeom)
-{
-	if (xfs_fsgeometry(fd, fsgeom) < 0) {
-		return -1;
+		if (vflag)
+			fsrprintf(_("moving ino=%llu, %llu blocks, "
+				"AG %u (%.1f%%) -> AG %u (%.1f%%)\n"),
+				(unsigned long long)cands[next].ino,
+				(unsigned long long)cands[next].blocks,
+				src, balance_util(&use[src]),
+				dst, balance_util(&use[dst]));
+		if (balance_move(fshandlep, fsfd, mntdir, cands[next].ino,
+				 dst) == 0) {
+			use[src].free += cands[next].blocks;
+			use[dst].free -= cands[next].blocks;
+			moved++;
+		} else {
+			failed++;
+		}
+		next++;
 	}
-	return 0;
+
+	if (moved)
+		rmap_invalidate(&rmap);
+	if (balance_read(fsfd, use) == 0) {
+		for (agno = 0; agno < fsgeom.agcount; agno++)
+			if (vflag || use[agno].free != before[agno].free)
+				fsrprintf(_("%s: AG %u %.1f%% -> %.1f%% used\n"),
+					  mntdir, agno,
+					  balance_util(&before[agno]),
+					  balance_util(&use[agno]));
+	}
+	fsrprintf(_("%s: moved %d files, %d could not be moved\n"),
+		  mntdir, moved, failed);
+	tmp_close(mntdir);
+
+out:
+	rmap_close(&rmap);
+	free(cands);
+	free(use);
+	free(before);
+	free(fshandlep);
+	close(fsfd);
 }
 
 /*
@@ -2456,6 +7899,7 @@ tmp_init(char *mnt)
 		}
 	}
 	(void)umask(mask);
+	tmp_mapag(mnt);
 	return;
 }
 
@@ -2469,18 +7913,208 @@ tmp_next(char *mnt)
 	        tmp_agi,
 	        getpid());
 
-	if (++tmp_agi == fsgeom.agcount)
-		tmp_agi = 0;
+	/* parallel workers only rotate through the AGs they own */
+	if ((tmp_agi += tmp_agstep) >= fsgeom.agcount)
+		tmp_agi = worker_id;
 
 	return(buf);
 }
 
+/*
+ * Temporary file placement.
+ *
+ * Round-robin through the AGs puts the copy of a big file wherever the
+ * rotor happens to be, often in an AG that can't hold it in one piece.
+ * Instead keep a summary of the largest free extents of every AG and
+ * create the temporary file in the AG with the smallest free extent
+ * the file fits in, or failing that the one that would need the fewest
+ * extents for it.  The summary is updated as files are placed and read
+ * again every FSR_FREESUM_AGE seconds.  Workers only place files in
+ * the AGs they own, so they don't count the same free space twice.
+ * Without a summary, or a temporary directory in the chosen AG, we
+ * fall back to tmp_next().
+ */
+#define FSR_FREESUM_TOP		32	/* free extents kept per AG */
+#define FSR_FREESUM_AGE		60
+
+struct fsr_freesum {
+	__u64			free;
+	int			n;
+	struct fsr_freeext	ext[FSR_FREESUM_TOP];	/* largest first */
+};
+
+static struct fsr_freesum *freesum;
+static time_t		freesum_time;
+static int		freesum_fd = -1;
+
+static int
+freesum_extcmp(const void *s1, const void *s2)
+{
+	xfs_extlen_t	l1 = ((struct fsr_freeext *)s1)->len;
+	xfs_extlen_t	l2 = ((struct fsr_freeext *)s2)->len;
+
+	return (l1 < l2) - (l1 > l2);
+}
+
+static void
+tmp_freesum(int fsfd)
+{
+	struct fsr_agfree	af;
+	struct fsr_freeext	*ext;
+	xfs_agnumber_t		agno;
+	int			n;
+
+	freesum_fd = fsfd;
+	freesum_time = time(0);
+	if (!freesum)
+		freesum = calloc(fsgeom.agcount, sizeof(*freesum));
+	if (!freesum)
+		return;
+
+	for (agno = 0; agno < fsgeom.agcount; agno++) {
+		if (fsr_freesp(fsfd, agno, &af, &ext, &n) < 0) {
+			if (dflag)
+				fsrprintf(_("no free space summary: %s\n"),
+					  strerror(errno));
+			free(freesum);
+			freesum = NULL;
+			return;
+		}
+		qsort(ext, n, sizeof(*ext), freesum_extcmp);
+		freesum[agno].free = af.free;
+		freesum[agno].n = min(n, FSR_FREESUM_TOP);
+		memcpy(freesum[agno].ext, ext,
+		       freesum[agno].n * sizeof(*ext));
+		free(ext);
+	}
+}
+
+/*
+ * How many of an AG's largest free extents it would take to hold
+ * 'need' blocks, or INT_MAX if they can't.
+ */
+static int
+freesum_nextents(struct fsr_freesum *fsp, __u64 need)
+{
+	int	i;
+
+	if (fsp->free < need)
+		return INT_MAX;
+	for (i = 0; i < fsp->n; i++) {
+		if (fsp->ext[i].len >= need)
+			return i + 1;
+		need -= fsp->ext[i].len;
+	}
+	/* it fits, but in more pieces than we keep track of */
+	return fsp->n + 1;
+}
+
+/*
+ * Take 'need' blocks out of the summary of AG 'agno', as the allocator
+ * would: from the best fitting extent if there is one, else from the
+ * largest ones.
+ */
+static void
+freesum_use(struct fsr_freesum *fsp, int fit, __u64 need)
+{
+	xfs_extlen_t	len;
+	int		i;
+
+	fsp->free -= min(need, fsp->free);
+	if (fit >= 0) {
+		fsp->ext[fit].bno += need;
+		fsp->ext[fit].len -= need;
+	} else {
+		for (i = 0; i < fsp->n && need; i++) {
+			len = min((__u64)fsp->ext[i].len, need);
+			fsp->ext[i].bno += len;
+			fsp->ext[i].len -= len;
+			need -= len;
+		}
+	}
+	qsort(fsp->ext, fsp->n, sizeof(fsp->ext[0]), freesum_extcmp);
+	while (fsp->n && !fsp->ext[fsp->n - 1].len)
+		fsp->n--;
+}
+
+static char *
+tmp_place(char *mnt, xfs_bstat_t *bs)
+{
+	struct fsr_freesum *fsp;
+	xfs_agnumber_t	agno;
+	xfs_agnumber_t	fitag = NULLAGNUMBER, bestag = NULLAGNUMBER;
+	__u64		need = max(bs->bs_blocks, (__s64)1);
+	int		fit = -1, i;
+	int		n, bestn = INT_MAX;
+	char		*tname;
+
+	tmp_hint.valid = 0;
+	if (freesum && time(0) - freesum_time > FSR_FREESUM_AGE)
+		tmp_freesum(freesum_fd);
+	if (!freesum)
+		return tmp_next(mnt);
+
+	for (agno = worker_id; agno < fsgeom.agcount; agno += tmp_agstep) {
+		fsp = &freesum[agno];
+		if (!tmp_in_ag(mnt, agno))
+			continue;
+
+		/* smallest single extent that holds the file */
+		for (i = fsp->n - 1; i >= 0; i--) {
+			if (fsp->ext[i].len < need)
+				continue;
+			if (fitag == NULLAGNUMBER ||
+			    fsp->ext[i].len < freesum[fitag].ext[fit].len) {
+				fitag = agno;
+				fit = i;
+			}
+			break;
+		}
+		if (fitag != NULLAGNUMBER)
+			continue;
+
+		/* else the fewest pieces, in the AG with most room */
+		n = freesum_nextents(fsp, need);
+		if (n < bestn || (n == bestn && n != INT_MAX &&
+				  fsp->free > freesum[bestag].free)) {
+			bestn = n;
+			bestag = agno;
+		}
+	}
+
+	if (fitag != NULLAGNUMBER) {
+		agno = fitag;
+		tmp_hint.bno = freesum[agno].ext[fit].bno;
+		tmp_hint.nextents = 1;
+		tmp_hint.valid = 1;
+	} else if (bestag != NULLAGNUMBER && bestn != INT_MAX) {
+		agno = bestag;
+		tmp_hint.bno = freesum[agno].ext[0].bno;
+		tmp_hint.nextents = bestn;
+		tmp_hint.valid = 1;
+	} else {
+		return tmp_next(mnt);
+	}
+	tmp_hint.agno = agno;
+
+	if (dflag)
+		fsrprintf(_("ino=%llu: %llu blocks, placed in AG %u at %u%s\n"),
+			  (unsigned long long)bs->bs_ino,
+			  (unsigned long long)need, agno, tmp_hint.bno,
+			  fitag != NULLAGNUMBER ? "" : _(", fragmented"));
+	freesum_use(&freesum[agno], fitag != NULLAGNUMBER ? fit : -1, need);
+	tname = tmp_in_ag(mnt, agno);
+	return tname;
+}
+
 static void
 tmp_close(char *mnt)
 {
 	static char	buf[SMBUFSZ];
 	int i;
 
+	swapq_flush();
+
 	/* No data is ever actually written so we can just do rmdir's */
 	for (i=0; i < fsgeom.agcount; i++) {
 		sprintf(buf, "%s/.fsr/ag%d", mnt, i);